@@ -0,0 +1,452 @@
+// bench.cpp - Stage-by-stage benchmark of the GrapeTree engines
+// Times each pipeline stage on one dataset and prints the results as
+// JSON (time, throughput, peak memory per stage: resident and tracked by
+// pipeline stage, see memory.cpp), so runs over a grid of
+// dataset sizes give scaling curves and runs on two commits compare.
+// The same source builds natively and, with em++, as a Node.js program
+// for the WebAssembly numbers.
+//
+// Build: make grapetree-bench (native), make bench-node (wasm)
+// Run:   make bench, or grapetree-bench [options] PROFILES
+//
+// Stages needing a dense n x n matrix are skipped, with the reason, when
+// the matrix would not fit in the memory limit; large datasets then
+// still report the parsing stages.
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten/heap.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "profile_store.cpp"
+#include "profile_json.cpp"
+#include "profile_tsv.cpp"
+#include "fasta_reader.cpp"
+#include "distance.cpp"
+#include "mstree.cpp"
+#include "mstree_v2.cpp"
+#include "newick.cpp"
+#include "response_json.cpp"
+#include "run_profile.cpp"
+#include "memory.cpp"
+#include "thread_pool.cpp"
+#include "cli_args.cpp"
+
+using namespace grapetree;
+using json = nlohmann::json;
+
+namespace {
+
+const char* USAGE =
+    "Usage: grapetree-bench [options] PROFILES\n"
+    "\n"
+    "Times each engine stage on a delimited profile file and prints JSON.\n"
+    "\n"
+    "      --fasta FILE     aligned FASTA for the p-distance stages\n"
+    "  -r, --repeat N       runs per stage; the fastest counts (default 3)\n"
+    "  -t, --threads N      threads, 0 = all cores (default)\n"
+    "  -m, --memory SIZE    skip stages whose matrix would exceed SIZE bytes\n"
+    "                       (K/M/G suffixes; default half the RAM, 2G in wasm)\n"
+    "      --label TEXT     recorded in the output, e.g. a commit id\n"
+    "  -q, --quiet          no progress on stderr\n"
+    "  -h, --help           show this help\n";
+
+struct BenchOptions {
+    std::string profiles_path;
+    std::string fasta_path;
+    unsigned repeat = 3;
+    unsigned n_threads = 0;
+    uint64_t memory_limit = 0;
+    std::string label;
+    bool quiet = false;
+};
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot read " + path);
+    }
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+// Peak memory of the process: the high-water mark of resident memory,
+// reset before each stage where the kernel allows it, or the size of the
+// linear memory in wasm (which only grows, so it is the peak of the run
+// so far)
+class PeakMemory {
+private:
+    bool per_stage_ = false;
+
+public:
+    void reset() {
+#ifndef __EMSCRIPTEN__
+        std::FILE* file = std::fopen("/proc/self/clear_refs", "w");
+        if (file) {
+            per_stage_ = std::fputs("5", file) >= 0;
+            per_stage_ = std::fclose(file) == 0 && per_stage_;
+        }
+#endif
+    }
+
+    bool per_stage() const { return per_stage_; }
+
+    uint64_t bytes() const {
+#ifdef __EMSCRIPTEN__
+        return emscripten_get_heap_size();
+#else
+        std::FILE* file = std::fopen("/proc/self/status", "r");
+        if (!file) {
+            return 0;
+        }
+        char line[256];
+        unsigned long long kilobytes = 0;
+        while (std::fgets(line, sizeof(line), file)) {
+            if (std::sscanf(line, "VmHWM: %llu kB", &kilobytes) == 1) {
+                break;
+            }
+        }
+        std::fclose(file);
+        return kilobytes * 1024;
+#endif
+    }
+};
+
+class Bench {
+private:
+    const BenchOptions& options_;
+    PeakMemory memory_;
+    json stages_ = json::array();
+
+public:
+    explicit Bench(const BenchOptions& options) : options_(options) {}
+
+    const json& stages() const { return stages_; }
+    bool per_stage_memory() const { return memory_.per_stage(); }
+
+    // Run fn options.repeat times; items / fastest run is the throughput.
+    // fn's result of the last run is kept, so later stages can use it.
+    template <typename Fn>
+    auto run(const std::string& name, double items, const std::string& unit, Fn&& fn) {
+        using Result = decltype(fn());
+        std::vector<double> seconds;
+        Result result{};
+
+        memory_.reset();
+        MemoryAccount::instance().reset_peaks();
+        for (unsigned r = 0; r < options_.repeat; ++r) {
+            result = Result();
+            auto start = std::chrono::steady_clock::now();
+            result = fn();
+            seconds.push_back(std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start
+            ).count());
+        }
+
+        std::vector<double> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        double best = sorted.front();
+
+        json stage;
+        stage["name"] = name;
+        stage["seconds"] = best;
+        stage["median_seconds"] = sorted[sorted.size() / 2];
+        stage["runs"] = seconds;
+        stage["items"] = items;
+        stage["unit"] = unit;
+        stage["throughput"] = best > 0.0 ? items / best : 0.0;
+        stage["peak_rss_bytes"] = memory_.bytes();
+        stage["memory"] = memory_json();
+        stages_.push_back(stage);
+
+        if (!options_.quiet) {
+            std::fprintf(stderr, "  %-26s %10.4f s\n", name.c_str(), best);
+        }
+        return result;
+    }
+
+    // Items of the last stage, for stages that only know them afterwards
+    void set_items(double items) {
+        json& stage = stages_.back();
+        double best = stage["seconds"].get<double>();
+        stage["items"] = items;
+        stage["throughput"] = best > 0.0 ? items / best : 0.0;
+    }
+
+    void skip(const std::string& name, const std::string& reason) {
+        json stage;
+        stage["name"] = name;
+        stage["skipped"] = reason;
+        stages_.push_back(stage);
+        if (!options_.quiet) {
+            std::fprintf(stderr, "  %-26s skipped: %s\n", name.c_str(), reason.c_str());
+        }
+    }
+};
+
+// The profiles as the {strains, profiles} document the browser sends:
+// numeric alleles as numbers, anything else (hashes) as strings
+std::string profiles_to_json(const ProfileStore& store) {
+    auto numeric = [](std::string_view allele) {
+        return !allele.empty() && allele.size() < 10 && allele[0] != '0' &&
+            std::all_of(allele.begin(), allele.end(), [](char c) {
+                return c >= '0' && c <= '9';
+            });
+    };
+
+    std::string out = "{\"strains\":[";
+    const StringArena& names = store.strain_names();
+    for (size_t i = 0; i < store.n_strains(); ++i) {
+        out += i == 0 ? "" : ",";
+        out += json(std::string(names[i])).dump();
+    }
+    out += "],\"profiles\":[";
+    for (size_t i = 0; i < store.n_strains(); ++i) {
+        out += i == 0 ? "[" : ",[";
+        for (size_t locus = 0; locus < store.n_loci(); ++locus) {
+            if (locus > 0) {
+                out += ',';
+            }
+            ProfileStore::Code code = store.code(i, locus);
+            if (code == ProfileStore::MISSING) {
+                out += "null";
+            } else {
+                std::string_view allele = store.allele_name(locus, code);
+                out += numeric(allele) ? std::string(allele) :
+                    json(std::string(allele)).dump();
+            }
+        }
+        out += ']';
+    }
+    out += "]}";
+    return out;
+}
+
+void run_profile_stages(Bench& bench, const BenchOptions& options, size_t& n_strains, size_t& n_loci) {
+    std::string text = read_file(options.profiles_path);
+
+    ProfileStore store = bench.run("parse_profile_tsv", 0.0, "cells", [&] {
+        return parse_profile_tsv_parallel(text.data(), text.size());
+    });
+    n_strains = store.n_strains();
+    n_loci = store.n_loci();
+    double cells = static_cast<double>(n_strains) * static_cast<double>(n_loci);
+    bench.set_items(cells);
+    text = std::string();
+
+    {
+        std::string document = profiles_to_json(store);
+        ProfileStore parsed = bench.run("parse_profile_json", cells, "cells", [&] {
+            return parse_profile_json_store(document.data(), document.size());
+        });
+    }
+
+    double n = static_cast<double>(n_strains);
+    uint64_t matrix_bytes = uint64_t(n_strains) * n_strains * sizeof(double);
+    if (matrix_bytes > options.memory_limit) {
+        std::string reason = "distance matrix needs " +
+            std::to_string(matrix_bytes >> 20) + " MB, over the memory limit";
+        for (const char* name : {
+                "compute_symmetric", "MSTree::compute", "compute_asymmetric",
+                "MSTreeV2::compute", "recraft_branches",
+                "NewickFormatter::format", "tree_json", "matrix_json"}) {
+            bench.skip(name, reason);
+        }
+        return;
+    }
+
+    DistanceMatrix engine(store);
+    {
+        DenseMatrix symmetric = bench.run("compute_symmetric", n * (n - 1) / 2, "pairs", [&] {
+            return engine.compute_symmetric();
+        });
+        bench.run("MSTree::compute", n, "strains", [&] {
+            return MSTree(symmetric).compute();
+        });
+    }
+
+    DenseMatrix asymmetric = bench.run("compute_asymmetric", n * (n - 1), "pairs", [&] {
+        return engine.compute_asymmetric();
+    });
+    std::vector<Edge> unrefined = bench.run("MSTreeV2::compute", n, "strains", [&] {
+        return MSTreeV2(asymmetric).compute(false);
+    });
+    std::vector<Edge> edges = bench.run("recraft_branches", static_cast<double>(unrefined.size()), "edges", [&] {
+        std::vector<Edge> tree = unrefined;
+        MSTreeV2(asymmetric).recraft_branches(tree);
+        return tree;
+    });
+
+    const StringArena& names = store.strain_names();
+    std::string newick = NewickFormatter().format(edges, names);
+    bench.run("NewickFormatter::format", static_cast<double>(newick.size()), "bytes", [&] {
+        return NewickFormatter().format(edges, names);
+    });
+
+    std::string response = tree_response(edges, names, n_strains).dump();
+    bench.run("tree_json", static_cast<double>(response.size()), "bytes", [&] {
+        return tree_response(edges, names, n_strains).dump();
+    });
+
+    std::string matrix_json;
+    append_matrix_json(matrix_json, asymmetric);
+    size_t matrix_json_bytes = matrix_json.size();
+    matrix_json = std::string();
+    bench.run("matrix_json", static_cast<double>(matrix_json_bytes), "bytes", [&] {
+        std::string out;
+        append_matrix_json(out, asymmetric);
+        return out;
+    });
+}
+
+void run_fasta_stages(Bench& bench, const BenchOptions& options) {
+    std::string text = read_file(options.fasta_path);
+
+    PackedAlignment alignment = bench.run("FastaReader", static_cast<double>(text.size()), "bytes", [&] {
+        FastaReader reader;
+        reader.feed(text.data(), text.size());
+        return reader.finish();
+    });
+    text = std::string();
+
+    double n = static_cast<double>(alignment.n_sequences());
+    uint64_t matrix_bytes = uint64_t(alignment.n_sequences()) *
+        alignment.n_sequences() * sizeof(double);
+    if (matrix_bytes > options.memory_limit) {
+        bench.skip("compute_p_distance", "distance matrix needs " +
+                   std::to_string(matrix_bytes >> 20) + " MB, over the memory limit");
+        return;
+    }
+    bench.run("compute_p_distance", n * (n - 1) / 2, "pairs", [&] {
+        return DistanceMatrix::compute_p_distance(alignment);
+    });
+}
+
+BenchOptions parse_arguments(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw UsageError(arg + " expects a value");
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            std::fputs(USAGE, stdout);
+            std::exit(0);
+        } else if (arg == "--fasta") {
+            options.fasta_path = value();
+        } else if (arg == "-r" || arg == "--repeat") {
+            options.repeat = static_cast<unsigned>(parse_count(value(), arg));
+        } else if (arg == "-t" || arg == "--threads") {
+            options.n_threads = static_cast<unsigned>(parse_count(value(), arg));
+        } else if (arg == "-m" || arg == "--memory") {
+            options.memory_limit = parse_size(value(), arg);
+        } else if (arg == "--label") {
+            options.label = value();
+        } else if (arg == "-q" || arg == "--quiet") {
+            options.quiet = true;
+        } else if (!arg.empty() && arg[0] == '-') {
+            throw UsageError("Unknown option " + arg);
+        } else if (options.profiles_path.empty()) {
+            options.profiles_path = arg;
+        } else {
+            throw UsageError("Only one profile file can be given");
+        }
+    }
+
+    if (options.profiles_path.empty()) {
+        throw UsageError("No profile file given");
+    }
+    if (options.repeat == 0) {
+        throw UsageError("--repeat must be at least 1");
+    }
+    if (options.memory_limit == 0) {
+#ifdef __EMSCRIPTEN__
+        options.memory_limit = uint64_t(2) << 30;
+#else
+        long pages = ::sysconf(_SC_PHYS_PAGES);
+        long page_size = ::sysconf(_SC_PAGE_SIZE);
+        options.memory_limit = pages > 0 && page_size > 0 ?
+            uint64_t(pages) * uint64_t(page_size) / 2 : uint64_t(4) << 30;
+#endif
+    }
+    return options;
+}
+
+void bench(const BenchOptions& options) {
+    ThreadPool::set_shared_threads(options.n_threads);
+    unsigned threads = ThreadPool::shared().size();
+    if (!options.quiet) {
+        std::fprintf(stderr, "%s (%u threads)\n", options.profiles_path.c_str(), threads);
+    }
+
+    Bench bench(options);
+    size_t n_strains = 0;
+    size_t n_loci = 0;
+    run_profile_stages(bench, options, n_strains, n_loci);
+    if (!options.fasta_path.empty()) {
+        run_fasta_stages(bench, options);
+    }
+
+    json report;
+    report["benchmark"] = "grapetree-bench";
+    report["version"] = 1;
+#ifdef __EMSCRIPTEN__
+    report["platform"] = "wasm";
+#else
+    report["platform"] = "native";
+#endif
+#if defined(__wasm_simd128__)
+    report["vectors"] = "simd128";
+#elif defined(__SSE2__)
+    report["vectors"] = "sse2";
+#else
+    report["vectors"] = "scalar";
+#endif
+    report["threads"] = threads;
+    report["repeat"] = options.repeat;
+    report["label"] = options.label;
+    report["dataset"] = {
+        {"profiles", options.profiles_path},
+        {"fasta", options.fasta_path},
+        {"strains", n_strains},
+        {"loci", n_loci}
+    };
+    report["peak_rss_scope"] = bench.per_stage_memory() ? "stage" : "process";
+    report["stages"] = bench.stages();
+    std::string out = report.dump(2);
+    out += '\n';
+    std::fwrite(out.data(), 1, out.size(), stdout);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        bench(parse_arguments(argc, argv));
+        return 0;
+    } catch (const UsageError& e) {
+        std::fprintf(stderr, "grapetree-bench: %s\n\n%s", e.what(), USAGE);
+        return 2;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "grapetree-bench: %s\n", e.what());
+        return 1;
+    }
+}
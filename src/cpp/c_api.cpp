@@ -0,0 +1,457 @@
+// c_api.cpp - libgrapetree: C API over the native engines
+// Implements grapetree.h. Exceptions stop at this boundary and become
+// status codes plus a per-thread error message.
+//
+// Build: make libgrapetree
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <cstring>
+#include <cctype>
+#include <stdexcept>
+
+#include "grapetree.h"
+#include "profile_store.cpp"
+#include "profile_json.cpp"
+#include "profile_tsv.cpp"
+#include "profile_binary.cpp"
+#include "fasta_reader.cpp"
+#include "vcf_reader.cpp"
+#include "matrix.cpp"
+#include "memory.cpp"
+#include "distance.cpp"
+#include "plan.cpp"
+#include "thread_pool.cpp"
+
+using namespace grapetree;
+
+// Profiles, an alignment or SNV calls, whichever the input held, plus
+// the dense matrices trees were built from
+struct grapetree_session {
+    int32_t format = GRAPETREE_FORMAT_PROFILES;
+    ProfileStore profiles;
+    PackedAlignment alignment;
+    SnpMatrix snps;
+
+    // Computing a matrix holds the lock; the shared pool runs one batch
+    // at a time anyway, so two sessions gain nothing from overlapping
+    // distance computations. Trees run unlocked on a shared_ptr.
+    std::mutex mutex;
+    std::map<int32_t, std::shared_ptr<const DenseMatrix>> matrices;
+};
+
+namespace {
+
+class ApiError : public std::runtime_error {
+public:
+    grapetree_status status;
+
+    ApiError(grapetree_status s, const std::string& message)
+        : std::runtime_error(message), status(s) {}
+};
+
+std::string& last_error() {
+    static thread_local std::string message;
+    return message;
+}
+
+grapetree_status fail(grapetree_status status, const char* message) {
+    try {
+        last_error() = message;
+    } catch (...) {
+    }
+    return status;
+}
+
+// Run fn, turning any exception into a status code
+template <typename Fn>
+grapetree_status guarded(Fn&& fn) noexcept {
+    try {
+        fn();
+        return GRAPETREE_OK;
+    } catch (const ApiError& e) {
+        return fail(e.status, e.what());
+    } catch (const std::bad_alloc&) {
+        return fail(GRAPETREE_OUT_OF_MEMORY, "Out of memory");
+    } catch (const std::length_error& e) {
+        return fail(GRAPETREE_OUT_OF_MEMORY, e.what());
+    } catch (const std::exception& e) {
+        return fail(GRAPETREE_ERROR, e.what());
+    } catch (...) {
+        return fail(GRAPETREE_ERROR, "Unknown error");
+    }
+}
+
+void require(bool condition, const char* message) {
+    if (!condition) {
+        throw ApiError(GRAPETREE_INVALID_ARGUMENT, message);
+    }
+}
+
+int32_t detect_format(const char* data, size_t size) {
+    if (ProfileStoreFormat::matches(data, size)) {
+        return GRAPETREE_FORMAT_PROFILES;
+    }
+    size_t i = 0;
+    while (i < size && std::isspace(static_cast<unsigned char>(data[i]))) {
+        ++i;
+    }
+    if (i < size && data[i] == '>') {
+        return GRAPETREE_FORMAT_FASTA;
+    }
+    static const char VCF_HEADER[] = "##fileformat=VCF";
+    if (size - i >= sizeof(VCF_HEADER) - 1 &&
+        std::memcmp(data + i, VCF_HEADER, sizeof(VCF_HEADER) - 1) == 0) {
+        return GRAPETREE_FORMAT_VCF;
+    }
+    return GRAPETREE_FORMAT_PROFILES;
+}
+
+// Delimited, JSON or binary profiles, as parse_profiles() in the wasm
+// module accepts them
+ProfileStore load_profiles(
+    const char* data,
+    size_t size,
+    bool borrow,
+    const ParseOptions& options
+) {
+    if (ProfileStoreFormat::matches(data, size)) {
+        return borrow ? view_profile_store(data, size) :
+            adopt_profile_store(std::string(data, size));
+    }
+    size_t i = 0;
+    while (i < size && std::isspace(static_cast<unsigned char>(data[i]))) {
+        ++i;
+    }
+    if (i < size && data[i] == '{') {
+        return parse_profile_json_store(data, size, options);
+    }
+    return parse_profile_tsv_parallel(data, size, options);
+}
+
+ParseOptions parse_options(uint32_t flags, const char* missing_tokens) {
+    ParseOptions options;
+    options.pack_columns = (flags & GRAPETREE_PACK_COLUMNS) != 0;
+    if (missing_tokens) {
+        // "" is an empty list, not one empty token
+        options.missing_tokens.clear();
+        for (const char* p = missing_tokens; *p != '\0';) {
+            const char* comma = std::strchr(p, ',');
+            const char* end = comma ? comma : p + std::strlen(p);
+            options.missing_tokens.emplace_back(p, end);
+            p = comma ? comma + 1 : end;
+        }
+    }
+    return options;
+}
+
+size_t n_strains(const grapetree_session* session) {
+    switch (session->format) {
+        case GRAPETREE_FORMAT_FASTA: return session->alignment.n_sequences();
+        case GRAPETREE_FORMAT_VCF: return session->snps.n_samples();
+    }
+    return session->profiles.n_strains();
+}
+
+// Every cell of matrix; the FASTA and VCF matrices ignore matrix_type
+// and handler
+void fill_distances(
+    const grapetree_session* session,
+    int32_t matrix_type,
+    int32_t handler,
+    DenseMatrix& matrix
+) {
+    size_t n = matrix.size();
+    for (size_t i = 0; i < n; ++i) {
+        matrix(i, i) = 0.0;
+    }
+    switch (session->format) {
+        case GRAPETREE_FORMAT_FASTA:
+            DistanceMatrix::fill_p_distance(session->alignment, matrix);
+            return;
+        case GRAPETREE_FORMAT_VCF:
+            DistanceMatrix::fill_snp_distance(session->snps, matrix);
+            return;
+    }
+    DistanceMatrix engine(session->profiles);
+    if (matrix_type == GRAPETREE_SYMMETRIC) {
+        engine.fill_symmetric_rows(
+            matrix, 0, n, static_cast<DistanceMatrix::MissingHandler>(handler)
+        );
+    } else {
+        engine.fill_asymmetric_rows(matrix, 0, n, engine.count_missing());
+    }
+}
+
+void check_matrix(int32_t matrix_type, int32_t handler) {
+    require(matrix_type == GRAPETREE_ASYMMETRIC || matrix_type == GRAPETREE_SYMMETRIC,
+            "Unknown matrix type");
+    require(handler >= GRAPETREE_MISSING_IGNORE &&
+            handler <= GRAPETREE_MISSING_ABSOLUTE_DIFF,
+            "Missing-data handler must be 0-3");
+}
+
+// Cache key; the asymmetric matrix ignores the handler, FASTA and VCF
+// have a single matrix
+int32_t matrix_key(const grapetree_session* session, int32_t matrix_type, int32_t handler) {
+    if (session->format != GRAPETREE_FORMAT_PROFILES) {
+        return 0;
+    }
+    return matrix_type == GRAPETREE_SYMMETRIC ? 1 + handler : 0;
+}
+
+void write_edges(
+    const std::vector<Edge>& tree,
+    grapetree_edge* edges,
+    size_t capacity,
+    size_t* n_edges
+) {
+    *n_edges = tree.size();
+    if (tree.size() > capacity) {
+        throw ApiError(
+            GRAPETREE_BUFFER_TOO_SMALL,
+            "Edge buffer holds " + std::to_string(capacity) + " edges, " +
+            std::to_string(tree.size()) + " needed"
+        );
+    }
+    for (size_t k = 0; k < tree.size(); ++k) {
+        edges[k].from = tree[k].from;
+        edges[k].to = tree[k].to;
+        edges[k].distance = tree[k].distance;
+    }
+}
+
+// Before any matrix is computed for the tree
+void check_tree(int32_t method, int32_t heuristic) {
+    require(method == GRAPETREE_MSTREE_V2 || method == GRAPETREE_MSTREE,
+            "Unknown tree method");
+    require(heuristic == GRAPETREE_HARMONIC || heuristic == GRAPETREE_EBURST,
+            "Unknown heuristic");
+}
+
+// Arguments already checked by check_tree
+std::vector<Edge> run_tree(const DenseMatrix& distances, int32_t method, int32_t heuristic) {
+    return build_tree(
+        distances,
+        method == GRAPETREE_MSTREE ? "MSTree" : "MSTreeV2",
+        heuristic == GRAPETREE_EBURST ? "eburst" : "harmonic"
+    );
+}
+
+} // namespace
+
+extern "C" {
+
+int32_t grapetree_api_version(void) {
+    return GRAPETREE_API_VERSION;
+}
+
+const char* grapetree_last_error(void) {
+    return last_error().c_str();
+}
+
+grapetree_status grapetree_set_threads(uint32_t n_threads) {
+    ThreadPool::set_shared_threads(n_threads);
+    return GRAPETREE_OK;
+}
+
+grapetree_status grapetree_set_memory_cap(uint64_t bytes) {
+    MemoryAccount::instance().set_cap(bytes);
+    return GRAPETREE_OK;
+}
+
+void grapetree_memory_usage(uint64_t* current, uint64_t* peak) {
+    MemoryAccount& account = MemoryAccount::instance();
+    if (current) {
+        *current = account.current();
+    }
+    if (peak) {
+        *peak = account.peak();
+    }
+    account.reset_peaks();
+}
+
+grapetree_status grapetree_session_create(
+    const void* data,
+    size_t size,
+    int32_t format,
+    uint32_t flags,
+    const char* missing_tokens,
+    grapetree_session** session
+) {
+    return guarded([&]() {
+        require(session != nullptr, "session is NULL");
+        *session = nullptr;
+        require(data != nullptr || size == 0, "data is NULL");
+        require(format >= GRAPETREE_FORMAT_AUTO && format <= GRAPETREE_FORMAT_VCF,
+                "Unknown input format");
+
+        const char* bytes = static_cast<const char*>(data);
+        auto created = std::make_unique<grapetree_session>();
+        created->format = format == GRAPETREE_FORMAT_AUTO ?
+            detect_format(bytes, size) : format;
+
+        try {
+            if (created->format == GRAPETREE_FORMAT_FASTA) {
+                FastaReader reader;
+                reader.feed(bytes, size);
+                created->alignment = reader.finish();
+            } else if (created->format == GRAPETREE_FORMAT_VCF) {
+                VcfReader reader;
+                reader.feed(bytes, size);
+                created->snps = reader.finish();
+            } else {
+                created->profiles = load_profiles(
+                    bytes, size, (flags & GRAPETREE_BORROW_BUFFER) != 0,
+                    parse_options(flags, missing_tokens)
+                );
+            }
+        } catch (const std::runtime_error& e) {
+            throw ApiError(GRAPETREE_PARSE_ERROR, e.what());
+        }
+        *session = created.release();
+    });
+}
+
+void grapetree_session_destroy(grapetree_session* session) {
+    delete session;
+}
+
+size_t grapetree_session_n_strains(const grapetree_session* session) {
+    return session ? n_strains(session) : 0;
+}
+
+size_t grapetree_session_n_loci(const grapetree_session* session) {
+    if (!session) {
+        return 0;
+    }
+    switch (session->format) {
+        case GRAPETREE_FORMAT_FASTA: return session->alignment.length();
+        case GRAPETREE_FORMAT_VCF: return session->snps.n_sites();
+    }
+    return session->profiles.n_loci();
+}
+
+grapetree_status grapetree_session_strain_name(
+    const grapetree_session* session,
+    size_t index,
+    const char** name,
+    size_t* length
+) {
+    return guarded([&]() {
+        require(session && name && length, "NULL argument");
+        require(index < n_strains(session), "Strain index out of range");
+        const StringArena& names =
+            session->format == GRAPETREE_FORMAT_FASTA ? session->alignment.names() :
+            session->format == GRAPETREE_FORMAT_VCF ? session->snps.names() :
+            session->profiles.strain_names();
+        std::string_view view = names[index];
+        *name = view.data();
+        *length = view.size();
+    });
+}
+
+grapetree_status grapetree_session_distances(
+    grapetree_session* session,
+    int32_t matrix,
+    int32_t missing_handler,
+    double* out,
+    size_t capacity
+) {
+    return guarded([&]() {
+        require(session != nullptr, "session is NULL");
+        check_matrix(matrix, missing_handler);
+        size_t n = n_strains(session);
+        if (n != 0 && (n > SIZE_MAX / n || capacity < n * n)) {
+            throw ApiError(
+                GRAPETREE_BUFFER_TOO_SMALL,
+                "Distance buffer needs " + std::to_string(n) + " x " +
+                std::to_string(n) + " doubles"
+            );
+        }
+        require(out != nullptr || n == 0, "out is NULL");
+
+        std::shared_ptr<const DenseMatrix> cached;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            auto it = session->matrices.find(matrix_key(session, matrix, missing_handler));
+            if (it != session->matrices.end()) {
+                cached = it->second;
+            }
+        }
+        if (cached) {
+            if (n > 0) {
+                std::memcpy(out, cached->row(0), n * n * sizeof(double));
+            }
+            return;
+        }
+        DenseMatrix view = DenseMatrix::view(out, n);
+        fill_distances(session, matrix, missing_handler, view);
+    });
+}
+
+grapetree_status grapetree_session_tree(
+    grapetree_session* session,
+    int32_t method,
+    int32_t matrix,
+    int32_t missing_handler,
+    int32_t heuristic,
+    grapetree_edge* edges,
+    size_t capacity,
+    size_t* n_edges
+) {
+    return guarded([&]() {
+        require(session && n_edges, "NULL argument");
+        require(edges != nullptr || capacity == 0, "edges is NULL");
+        check_matrix(matrix, missing_handler);
+        check_tree(method, heuristic);
+
+        std::shared_ptr<const DenseMatrix> distances;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            auto& slot = session->matrices[matrix_key(session, matrix, missing_handler)];
+            if (!slot) {
+                auto computed = std::make_shared<DenseMatrix>(n_strains(session));
+                fill_distances(session, matrix, missing_handler, *computed);
+                slot = std::move(computed);
+            }
+            distances = slot;
+        }
+        write_edges(run_tree(*distances, method, heuristic), edges, capacity, n_edges);
+    });
+}
+
+void grapetree_session_release(grapetree_session* session) {
+    if (session) {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->matrices.clear();
+    }
+}
+
+grapetree_status grapetree_tree_from_distances(
+    const double* distances,
+    size_t n,
+    int32_t method,
+    int32_t heuristic,
+    grapetree_edge* edges,
+    size_t capacity,
+    size_t* n_edges
+) {
+    return guarded([&]() {
+        require(n_edges != nullptr, "n_edges is NULL");
+        require(distances != nullptr || n == 0, "distances is NULL");
+        require(edges != nullptr || capacity == 0, "edges is NULL");
+        require(n == 0 || n <= SIZE_MAX / sizeof(double) / n, "Matrix too large");
+        check_tree(method, heuristic);
+
+        // Read only: the engines take the matrix by const reference
+        const DenseMatrix matrix = DenseMatrix::view(const_cast<double*>(distances), n);
+        write_edges(run_tree(matrix, method, heuristic), edges, capacity, n_edges);
+    });
+}
+
+} // extern "C"
@@ -0,0 +1,31 @@
+// cancel.cpp - Cooperative cancellation
+// A flag set from any thread (or from JS between slices) and polled by
+// long-running work: the distance job at slice boundaries, the tree
+// engines once per node or contraction level
+
+#ifndef GRAPETREE_CANCEL_H
+#define GRAPETREE_CANCEL_H
+
+#include <atomic>
+#include <stdexcept>
+
+namespace grapetree {
+
+class CancelToken {
+private:
+    std::atomic<bool> cancelled_{false};
+
+public:
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    void reset() { cancelled_.store(false, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+};
+
+class CancelledError : public std::runtime_error {
+public:
+    CancelledError() : std::runtime_error("Computation cancelled") {}
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_CANCEL_H
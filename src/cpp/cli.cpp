@@ -0,0 +1,561 @@
+// cli.cpp - Native command-line GrapeTree for batch runs
+// Reads allele profiles (tab/comma delimited, JSON or binary store), an
+// aligned FASTA or a VCF from disk, builds the tree with the same
+// engines as the WebAssembly module on every core, and writes Newick,
+// the edge list and optionally the distance matrix to files
+//
+// Build: make grapetree-cli
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "profile_store.cpp"
+#include "profile_json.cpp"
+#include "profile_tsv.cpp"
+#include "profile_binary.cpp"
+#include "fasta_reader.cpp"
+#include "vcf_reader.cpp"
+#include "mapped_file.cpp"
+#include "distance.cpp"
+#include "pipeline.cpp"
+#include "mstree.cpp"
+#include "mstree_v2.cpp"
+#include "newick.cpp"
+#include "plan.cpp"
+#include "thread_pool.cpp"
+#include "memory.cpp"
+#include "trace.cpp"
+#include "cli_args.cpp"
+
+using namespace grapetree;
+
+namespace {
+
+const char* USAGE =
+    "Usage: grapetree-cli [options] INPUT\n"
+    "\n"
+    "INPUT is a cgMLST/MLST profile file (tab or comma delimited, JSON, or a\n"
+    "binary profile store), an aligned FASTA or a multi-sample VCF. '-',\n"
+    "a pipe or a FIFO is read as delimited profiles, computing distances\n"
+    "while the rows arrive.\n"
+    "\n"
+    "Tree:\n"
+    "  -m, --method NAME          MSTreeV2 (default) or MSTree\n"
+    "  -x, --matrix TYPE          asymmetric (default) or symmetric\n"
+    "      --missing N            missing-data handler 0-3 (default 0)\n"
+    "      --heuristic NAME       harmonic (default) or eburst\n"
+    "  -f, --format FORMAT        auto (default), profile, fasta or vcf\n"
+    "  -t, --threads N            threads, 0 = all cores (default)\n"
+    "      --memory-cap SIZE      fail as soon as the engines would hold more\n"
+    "                             than SIZE bytes (K/M/G suffixes allowed)\n"
+    "\n"
+    "Profiles:\n"
+    "      --missing-tokens LIST  comma-separated alleles read as missing\n"
+    "      --pack-columns         bit-pack allele columns (less memory)\n"
+    "      --memory-budget SIZE   hold distances in the fastest storage that\n"
+    "                             fits SIZE bytes (K/M/G suffixes allowed)\n"
+    "      --sparse-threshold N   let the budget use sparse storage, keeping\n"
+    "                             only pairs within N differences\n"
+    "\n"
+    "Output (Newick goes to stdout when no output is given):\n"
+    "  -o, --output PREFIX        write PREFIX.nwk and PREFIX.edges.tsv\n"
+    "      --newick FILE          Newick tree, '-' for stdout\n"
+    "      --edges FILE           edge list: from, to, distance (TSV)\n"
+    "      --distances FILE       distance matrix with strain names (TSV)\n"
+    "      --trace FILE           Chrome trace of the run, for Perfetto (needs\n"
+    "                             a build with make TRACE=1)\n"
+    "  -q, --quiet                no progress on stderr\n"
+    "  -h, --help                 show this help\n";
+
+struct CliOptions {
+    std::string input;
+    std::string format = "auto";
+    std::string method = "MSTreeV2";
+    std::string matrix_type = "asymmetric";
+    int missing_handler = 0;
+    std::string heuristic = "harmonic";
+    unsigned n_threads = 0;
+    uint64_t memory_cap = 0;
+    ParseOptions parse;
+    uint64_t memory_budget = 0;
+    uint32_t sparse_threshold = 0;
+    std::string newick_path;
+    std::string edges_path;
+    std::string distances_path;
+    std::string trace_path;
+    bool quiet = false;
+};
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    for (;;) {
+        size_t comma = text.find(',', start);
+        items.push_back(text.substr(start, comma - start));
+        if (comma == std::string::npos) {
+            return items;
+        }
+        start = comma + 1;
+    }
+}
+
+CliOptions parse_arguments(int argc, char** argv) {
+    CliOptions options;
+    std::string output_prefix;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw UsageError(arg + " expects a value");
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            std::fputs(USAGE, stdout);
+            std::exit(0);
+        } else if (arg == "-m" || arg == "--method") {
+            options.method = value();
+        } else if (arg == "-x" || arg == "--matrix") {
+            options.matrix_type = value();
+        } else if (arg == "--missing") {
+            options.missing_handler = static_cast<int>(parse_count(value(), arg));
+        } else if (arg == "--heuristic") {
+            options.heuristic = value();
+        } else if (arg == "-f" || arg == "--format") {
+            options.format = value();
+        } else if (arg == "-t" || arg == "--threads") {
+            options.n_threads = static_cast<unsigned>(parse_count(value(), arg));
+        } else if (arg == "--memory-cap") {
+            options.memory_cap = parse_size(value(), arg);
+        } else if (arg == "--missing-tokens") {
+            options.parse.missing_tokens = split_list(value());
+        } else if (arg == "--pack-columns") {
+            options.parse.pack_columns = true;
+        } else if (arg == "--memory-budget") {
+            options.memory_budget = parse_size(value(), arg);
+        } else if (arg == "--sparse-threshold") {
+            options.sparse_threshold = static_cast<uint32_t>(parse_count(value(), arg));
+        } else if (arg == "-o" || arg == "--output") {
+            output_prefix = value();
+        } else if (arg == "--newick") {
+            options.newick_path = value();
+        } else if (arg == "--edges") {
+            options.edges_path = value();
+        } else if (arg == "--distances") {
+            options.distances_path = value();
+        } else if (arg == "--trace") {
+            options.trace_path = value();
+        } else if (arg == "-q" || arg == "--quiet") {
+            options.quiet = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            throw UsageError("Unknown option " + arg);
+        } else if (options.input.empty()) {
+            options.input = arg;
+        } else {
+            throw UsageError("Only one input file is supported");
+        }
+    }
+
+    if (options.input.empty()) {
+        throw UsageError("No input file given");
+    }
+    if (options.method != "MSTree" && options.method != "MSTreeV2") {
+        throw UsageError("Unknown method " + options.method);
+    }
+    if (options.matrix_type != "symmetric" && options.matrix_type != "asymmetric") {
+        throw UsageError("Unknown matrix type " + options.matrix_type);
+    }
+    if (options.missing_handler < 0 || options.missing_handler > 3) {
+        throw UsageError("Missing-data handler must be 0-3");
+    }
+    if (options.heuristic == "eBurst") {
+        options.heuristic = "eburst";
+    }
+    if (options.heuristic != "harmonic" && options.heuristic != "eburst") {
+        throw UsageError("Unknown heuristic " + options.heuristic);
+    }
+
+    if (!output_prefix.empty()) {
+        if (options.newick_path.empty()) {
+            options.newick_path = output_prefix + ".nwk";
+        }
+        if (options.edges_path.empty()) {
+            options.edges_path = output_prefix + ".edges.tsv";
+        }
+    }
+    if (options.newick_path.empty() && options.edges_path.empty() &&
+        options.distances_path.empty()) {
+        options.newick_path = "-";
+    }
+    return options;
+}
+
+// profile, fasta or vcf, from the first bytes of the file
+std::string detect_format(const std::string& path) {
+    MappedFile file(path);
+    const char* data = file.data();
+    size_t size = file.size();
+
+    if (ProfileStoreFormat::matches(data, size)) {
+        return "profile";
+    }
+    size_t i = 0;
+    while (i < size && std::isspace(static_cast<unsigned char>(data[i]))) {
+        ++i;
+    }
+    if (i < size && data[i] == '>') {
+        return "fasta";
+    }
+    static const char VCF_HEADER[] = "##fileformat=VCF";
+    if (size - i >= sizeof(VCF_HEADER) - 1 &&
+        std::memcmp(data + i, VCF_HEADER, sizeof(VCF_HEADER) - 1) == 0) {
+        return "vcf";
+    }
+    return "profile";
+}
+
+// stdin and pipes, which cannot be mapped; read by run_profile_pipeline
+bool is_stream(const std::string& path) {
+    struct stat info;
+    return path == "-" || (::stat(path.c_str(), &info) == 0 && !S_ISREG(info.st_mode));
+}
+
+ProfileStore load_profiles(const CliOptions& options) {
+    {
+        MappedFile file(options.input);
+        if (ProfileStoreFormat::matches(file.data(), file.size())) {
+            return load_profile_store(options.input);
+        }
+        const char* data = file.data();
+        const char* end = data + file.size();
+        while (data < end && std::isspace(static_cast<unsigned char>(*data))) {
+            ++data;
+        }
+        if (data < end && *data == '{') {
+            return parse_profile_json_store(
+                std::string(file.data(), file.size()), options.parse
+            );
+        }
+    }
+    return load_profile_tsv_parallel(options.input, options.parse);
+}
+
+// Writes to a file, or to stdout for "-"
+class OutputFile {
+private:
+    std::FILE* file_;
+    std::string path_;
+
+public:
+    explicit OutputFile(const std::string& path)
+        : file_(path == "-" ? stdout : std::fopen(path.c_str(), "wb")),
+          path_(path) {
+        if (!file_) {
+            throw std::runtime_error(
+                "Cannot write " + path + ": " + std::strerror(errno)
+            );
+        }
+    }
+
+    ~OutputFile() {
+        if (file_ && file_ != stdout) {
+            std::fclose(file_);
+        }
+    }
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    void write(const std::string& text) {
+        if (std::fwrite(text.data(), 1, text.size(), file_) != text.size()) {
+            throw std::runtime_error("Error writing " + path_);
+        }
+    }
+
+    void close() {
+        bool ok = std::fflush(file_) == 0;
+        if (file_ != stdout) {
+            ok = std::fclose(file_) == 0 && ok;
+        }
+        file_ = nullptr;
+        if (!ok) {
+            throw std::runtime_error("Error writing " + path_);
+        }
+    }
+};
+
+// Shortest round-trip formatting, as in the JSON output
+void append_number(std::string& out, double value) {
+    char buf[32];
+    char* end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+    out.append(buf, end);
+}
+
+template <typename Names>
+void write_edges(
+    const std::string& path,
+    const std::vector<Edge>& edges,
+    const Names& names
+) {
+    OutputFile file(path);
+    std::string out = "from\tto\tdistance\n";
+    for (const Edge& e : edges) {
+        out += names[e.from];
+        out += '\t';
+        out += names[e.to];
+        out += '\t';
+        append_number(out, e.distance);
+        out += '\n';
+        if (out.size() > (size_t(1) << 20)) {
+            file.write(out);
+            out.clear();
+        }
+    }
+    file.write(out);
+    file.close();
+}
+
+// Square matrix, names in the first row and column; written a row at a
+// time so the text never exists whole
+template <typename Names>
+void write_distances(
+    const std::string& path,
+    const DenseMatrix& matrix,
+    const Names& names
+) {
+    OutputFile file(path);
+    size_t n = matrix.size();
+    std::string out;
+    for (size_t j = 0; j < n; ++j) {
+        out += '\t';
+        out += names[j];
+    }
+    out += '\n';
+    for (size_t i = 0; i < n; ++i) {
+        out += names[i];
+        const double* row = matrix.row(i);
+        for (size_t j = 0; j < n; ++j) {
+            out += '\t';
+            append_number(out, row[j]);
+        }
+        out += '\n';
+        file.write(out);
+        out.clear();
+    }
+    file.write(out);
+    file.close();
+}
+
+class Stopwatch {
+private:
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+
+public:
+    double seconds() const {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_
+        ).count();
+    }
+};
+
+template <typename Names>
+void write_outputs(
+    const CliOptions& options,
+    const std::vector<Edge>& edges,
+    const Names& names,
+    const DenseMatrix* distances
+) {
+    if (!options.newick_path.empty()) {
+        OutputFile file(options.newick_path);
+        file.write(NewickFormatter().format(edges, names));
+        file.write("\n");
+        file.close();
+    }
+    if (!options.edges_path.empty()) {
+        write_edges(options.edges_path, edges, names);
+    }
+    if (!options.distances_path.empty() && distances) {
+        write_distances(options.distances_path, *distances, names);
+    }
+}
+
+void run(const CliOptions& options) {
+    auto log = [&](const std::string& message) {
+        if (!options.quiet) {
+            std::fprintf(stderr, "%s\n", message.c_str());
+        }
+    };
+    auto fixed = [](double value) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.2f", value);
+        return std::string(buf);
+    };
+
+    ThreadPool::set_shared_threads(options.n_threads);
+    log("Threads: " + std::to_string(ThreadPool::shared().size()));
+    MemoryAccount::instance().set_cap(options.memory_cap);
+
+    Stopwatch load_time;
+    auto tree_from = [&](const DenseMatrix& distances, const StringArena& names) {
+        Stopwatch tree_time;
+        std::vector<Edge> edges = build_tree(distances, options.method, options.heuristic);
+        log("Tree: " + fixed(tree_time.seconds()) + " s");
+        write_outputs(options, edges, names, &distances);
+    };
+
+    // Rows from a pipe are compared as they arrive, into a dense matrix
+    // whose size is not known up front, so there is nothing to plan
+    if (is_stream(options.input)) {
+        if (options.format != "auto" && options.format != "profile") {
+            throw UsageError("Only delimited profiles can be read from a pipe");
+        }
+        if (options.memory_budget != 0) {
+            throw UsageError("--memory-budget needs a file: profiles from a "
+                             "pipe are held in a dense matrix");
+        }
+        PipelineResult result = run_profile_pipeline(
+            options.input, options.matrix_type,
+            static_cast<DistanceMatrix::MissingHandler>(options.missing_handler),
+            options.parse
+        );
+        log("Loaded " + std::to_string(result.profiles.n_strains()) +
+            " profiles x " + std::to_string(result.profiles.n_loci()) +
+            " loci with their distances (" + fixed(load_time.seconds()) + " s)");
+        tree_from(result.distances, result.profiles.strain_names());
+        return;
+    }
+
+    std::string format = options.format == "auto" ?
+        detect_format(options.input) : options.format;
+
+    if (format == "fasta") {
+        PackedAlignment alignment = load_fasta(options.input);
+        log("Loaded " + std::to_string(alignment.n_sequences()) +
+            " sequences x " + std::to_string(alignment.length()) +
+            " sites (" + fixed(load_time.seconds()) + " s)");
+        Stopwatch distance_time;
+        DenseMatrix distances = DistanceMatrix::compute_p_distance(alignment);
+        log("Distances: " + fixed(distance_time.seconds()) + " s");
+        tree_from(distances, alignment.names());
+        return;
+    }
+    if (format == "vcf") {
+        SnpMatrix snps = load_vcf(options.input);
+        log("Loaded " + std::to_string(snps.n_samples()) + " samples x " +
+            std::to_string(snps.n_sites()) + " SNVs (" +
+            fixed(load_time.seconds()) + " s)");
+        Stopwatch distance_time;
+        DenseMatrix distances = DistanceMatrix::compute_snp_distance(snps);
+        log("Distances: " + fixed(distance_time.seconds()) + " s");
+        tree_from(distances, snps.names());
+        return;
+    }
+    if (format != "profile") {
+        throw UsageError("Unknown format " + format);
+    }
+
+    ProfileStore profiles = load_profiles(options);
+    log("Loaded " + std::to_string(profiles.n_strains()) + " profiles x " +
+        std::to_string(profiles.n_loci()) + " loci (" +
+        fixed(load_time.seconds()) + " s)");
+
+    bool asymmetric = options.matrix_type != "symmetric";
+    auto handler = static_cast<DistanceMatrix::MissingHandler>(options.missing_handler);
+
+    PlanRequest request;
+    request.n_strains = profiles.n_strains();
+    request.n_loci = profiles.n_loci();
+    request.method = options.method;
+    request.asymmetric = asymmetric;
+    request.budget_bytes = options.memory_budget;
+    request.profile_bytes = profiles.code_bytes();
+    request.sparse_threshold = options.sparse_threshold;
+    RunPlan plan = plan_run(request);
+    log(std::string("Plan: ") + storage_name(plan.storage) + ", peak " +
+        fixed(plan.peak_bytes / (1024.0 * 1024.0)) + " MB, about " +
+        fixed(plan.seconds()) + " s (" + plan.reason + ")");
+
+    // A written matrix needs the dense one; anything else runs on the
+    // planned storage
+    Stopwatch tree_time;
+    std::vector<Edge> edges;
+    if (!options.distances_path.empty()) {
+        if (plan.storage != MatrixStorage::DENSE || !plan.fits) {
+            throw std::runtime_error(
+                "--distances needs the dense matrix, which does not fit the "
+                "memory budget"
+            );
+        }
+        DistanceMatrix engine(profiles);
+        DenseMatrix distances = asymmetric ?
+            engine.compute_asymmetric() : engine.compute_symmetric(handler);
+        log("Distances: " + fixed(tree_time.seconds()) + " s");
+        edges = build_tree(distances, options.method, options.heuristic);
+        log("Tree: " + fixed(tree_time.seconds()) + " s");
+        write_outputs(options, edges, profiles.strain_names(), &distances);
+        return;
+    }
+
+    edges = build_planned_tree(
+        profiles, plan, options.method, asymmetric, handler, options.heuristic
+    );
+    log("Distances and tree: " + fixed(tree_time.seconds()) + " s");
+    write_outputs(options, edges, profiles.strain_names(), nullptr);
+}
+
+// Peak tracked memory of the run, in total and by stage
+void log_memory() {
+    const MemoryAccount& account = MemoryAccount::instance();
+    std::string message = "Peak memory: " + format_bytes(account.peak()) + " (";
+    for (size_t s = 0; s < MEMORY_STAGES; ++s) {
+        MemoryStage stage = static_cast<MemoryStage>(s);
+        message += s > 0 ? ", " : "";
+        message += std::string(memory_stage_name(stage)) + ' ' +
+                   format_bytes(account.peak(stage));
+    }
+    std::fprintf(stderr, "%s)\n", message.c_str());
+}
+
+void write_trace(const CliOptions& options) {
+#ifndef GRAPETREE_TRACE
+    std::fprintf(stderr, "grapetree-cli: built without tracing, %s will be "
+                 "empty (rebuild with make TRACE=1)\n", options.trace_path.c_str());
+#endif
+    OutputFile file(options.trace_path);
+    file.write(trace_json());
+    file.close();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        CliOptions options = parse_arguments(argc, argv);
+        run(options);
+        if (!options.quiet) {
+            log_memory();
+        }
+        if (!options.trace_path.empty()) {
+            write_trace(options);
+        }
+        return 0;
+    } catch (const UsageError& e) {
+        std::fprintf(stderr, "grapetree-cli: %s\n\n%s", e.what(), USAGE);
+        return 2;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "grapetree-cli: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,56 @@
+// cli_args.cpp - Option values shared by the native tools
+// grapetree-cli, grapetree-daemon and grapetree-bench read counts and
+// byte sizes the same way and reject bad ones as usage errors
+
+#ifndef GRAPETREE_CLI_ARGS_H
+#define GRAPETREE_CLI_ARGS_H
+
+#include <string>
+#include <cstdint>
+#include <charconv>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+
+namespace grapetree {
+
+// Printed with the tool's usage text; exit status 2
+class UsageError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline uint64_t parse_count(const std::string& text, const std::string& option) {
+    uint64_t value = 0;
+    const char* end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value);
+    if (result.ec != std::errc() || result.ptr != end) {
+        throw UsageError(option + " expects a number, got '" + text + "'");
+    }
+    return value;
+}
+
+// Bytes, with an optional K, M or G (binary) suffix
+inline uint64_t parse_size(const std::string& text, const std::string& option) {
+    uint64_t scale = 1;
+    std::string digits = text;
+    if (!digits.empty()) {
+        switch (digits.back()) {
+            case 'k': case 'K': scale = uint64_t(1) << 10; break;
+            case 'm': case 'M': scale = uint64_t(1) << 20; break;
+            case 'g': case 'G': scale = uint64_t(1) << 30; break;
+        }
+        if (scale > 1) {
+            digits.pop_back();
+        }
+    }
+    uint64_t value = parse_count(digits, option);
+    if (value > std::numeric_limits<uint64_t>::max() / scale) {
+        throw UsageError(option + " is out of range, got '" + text + "'");
+    }
+    return value * scale;
+}
+
+} // namespace grapetree
+
+#endif // GRAPETREE_CLI_ARGS_H
@@ -0,0 +1,928 @@
+// daemon.cpp - Native GrapeTree daemon serving warm sessions
+// Keeps recently used profile collections, their distance matrices and
+// trees in memory and answers requests over a Unix domain socket, so a
+// collection queried many times a day is parsed and compared once.
+//
+// Build: make grapetree-daemon
+//
+// Protocol (all integers little-endian). Every message is a frame: a
+// uint64 byte count, then that many bytes. A connection carries any
+// number of request/response pairs in order. A request frame over 1 GB
+// (MAX_FRAME_BYTES) gets an error response and the connection is closed.
+//
+//   Request   uint8 op, then the op's fields
+//   Response  uint8 status (0 = ok, 1 = error), then the op's result or,
+//             on error, the message as UTF-8 text
+//
+//   op 1 LOAD    uint8 source (0 = path, 1 = inline bytes), uint8 flags
+//                (1 = pack columns, 2 = custom missing tokens),
+//                [uint32 length, comma-separated tokens if flags & 2],
+//                rest: file path or file contents (delimited, JSON or
+//                binary profile store)
+//                -> uint64 session, uint64 n_strains, uint64 n_loci
+//   op 2 TREE    uint64 session, uint8 method (0 = MSTreeV2, 1 = MSTree),
+//                uint8 matrix (0 = asymmetric, 1 = symmetric),
+//                uint8 missing handler (0-3), uint8 heuristic
+//                (0 = harmonic, 1 = eburst)
+//                -> uint64 n_edges, n_edges x (uint64 from, uint64 to,
+//                   float64 distance)
+//   op 3 MATRIX  uint64 session, uint8 matrix, uint8 missing handler
+//                -> uint64 n, n x n float64, row-major
+//   op 4 PLACE   uint64 session, uint32 k, rest: query profiles
+//                (delimited or JSON, the collection's locus order)
+//                -> uint64 n_queries, uint32 k', n_queries x k' x
+//                   (uint64 strain, float64 distance), nearest first
+//   op 5 NAMES   uint64 session
+//                -> uint64 n, n x (uint32 length, name bytes)
+//   op 6 DROP    uint64 session -> nothing
+//   op 7 STATS   -> uint64 sessions, uint64 bytes held, uint64 limit
+//
+// A session id is stable for the same input and options: loading the
+// same unchanged file again returns the warm session without reading it.
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <stdexcept>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "profile_store.cpp"
+#include "profile_json.cpp"
+#include "profile_tsv.cpp"
+#include "profile_binary.cpp"
+#include "mapped_file.cpp"
+#include "distance.cpp"
+#include "plan.cpp"
+#include "placement.cpp"
+#include "result_cache.cpp"
+#include "thread_pool.cpp"
+#include "cli_args.cpp"
+
+using namespace grapetree;
+
+namespace {
+
+const char* USAGE =
+    "Usage: grapetree-daemon [options]\n"
+    "\n"
+    "Serves tree, matrix and placement requests on warm profile\n"
+    "collections over a Unix domain socket (protocol in daemon.cpp).\n"
+    "\n"
+    "  -s, --socket PATH         socket to listen on (default\n"
+    "                            /tmp/grapetree.sock)\n"
+    "  -t, --threads N           threads, 0 = all cores (default)\n"
+    "  -m, --memory-limit SIZE   memory for warm sessions (K/M/G suffixes;\n"
+    "                            default half the physical memory)\n"
+    "  -q, --quiet               no request log on stderr\n"
+    "  -h, --help                show this help\n";
+
+enum Op : uint8_t {
+    OP_LOAD = 1,
+    OP_TREE = 2,
+    OP_MATRIX = 3,
+    OP_PLACE = 4,
+    OP_NAMES = 5,
+    OP_DROP = 6,
+    OP_STATS = 7
+};
+
+enum Status : uint8_t {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1
+};
+
+// Largest request frame read; inline LOAD bytes are the only big ones,
+// and larger collections can be loaded by path
+constexpr uint64_t MAX_FRAME_BYTES = uint64_t(1) << 30;
+
+// Fields of a request payload, read in order
+class Reader {
+private:
+    const char* p_;
+    const char* end_;
+
+public:
+    explicit Reader(std::string_view payload)
+        : p_(payload.data()), end_(payload.data() + payload.size()) {}
+
+    template <typename T>
+    T take() {
+        T value;
+        if (static_cast<size_t>(end_ - p_) < sizeof(T)) {
+            throw std::runtime_error("Truncated request");
+        }
+        std::memcpy(&value, p_, sizeof(T));
+        p_ += sizeof(T);
+        return value;
+    }
+
+    std::string_view take_bytes(size_t size) {
+        if (static_cast<size_t>(end_ - p_) < size) {
+            throw std::runtime_error("Truncated request");
+        }
+        std::string_view bytes(p_, size);
+        p_ += size;
+        return bytes;
+    }
+
+    std::string_view rest() {
+        std::string_view bytes(p_, static_cast<size_t>(end_ - p_));
+        p_ = end_;
+        return bytes;
+    }
+};
+
+template <typename T>
+void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// A loaded collection and what has been computed from it
+struct WarmSession {
+    uint64_t id = 0;
+    ProfileStore profiles;
+    ParseOptions options;  // as loaded; PLACE queries are parsed with them
+    std::atomic<uint64_t> last_used{0};
+    std::atomic<uint64_t> bytes{0};  // profiles plus cached results
+
+    // Guards everything below. Computing a matrix holds it: the shared
+    // pool runs one batch at a time, so overlapping computations would
+    // not finish sooner. Trees and placements run unlocked.
+    std::mutex mutex;
+    std::map<int, std::shared_ptr<const DenseMatrix>> matrices;
+    std::map<std::string, std::shared_ptr<const std::string>> trees;
+    std::unique_ptr<ProfilePlacer> placer;
+
+    // After changing the cached results, with mutex held
+    void recount() {
+        uint64_t total = profiles.code_bytes();
+        for (const auto& entry : matrices) {
+            uint64_t n = entry.second ? entry.second->size() : 0;
+            total += n * n * sizeof(double);
+        }
+        for (const auto& entry : trees) {
+            total += entry.second->size();
+        }
+        bytes = total;
+    }
+};
+
+class SessionStore {
+private:
+    struct FileIdentity {
+        int64_t mtime_ns;
+        int64_t size;
+        uint64_t id;
+    };
+
+    std::mutex mutex_;
+    std::map<uint64_t, std::shared_ptr<WarmSession>> sessions_;
+    std::map<std::string, FileIdentity> files_;  // load key -> session
+    std::atomic<uint64_t> clock_{0};
+    uint64_t limit_;
+
+public:
+    explicit SessionStore(uint64_t limit) : limit_(limit) {}
+
+    uint64_t limit() const { return limit_; }
+
+    std::shared_ptr<WarmSession> find(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) {
+            throw std::runtime_error("Unknown session " + std::to_string(id));
+        }
+        touch(*it->second);
+        return it->second;
+    }
+
+    // Session for a file, reused while the file is unchanged
+    std::shared_ptr<WarmSession> load_file(
+        const std::string& path,
+        const std::string& options_key,
+        const ParseOptions& options
+    ) {
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0) {
+            throw std::runtime_error(
+                "Cannot open " + path + ": " + std::strerror(errno)
+            );
+        }
+        int64_t mtime_ns = int64_t(info.st_mtim.tv_sec) * 1000000000 +
+            info.st_mtim.tv_nsec;
+        std::string file_key = path + '\0' + options_key;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = files_.find(file_key);
+            if (it != files_.end() && it->second.mtime_ns == mtime_ns &&
+                it->second.size == info.st_size) {
+                auto session = sessions_.find(it->second.id);
+                if (session != sessions_.end()) {
+                    touch(*session->second);
+                    return session->second;
+                }
+            }
+        }
+
+        uint64_t id = ResultKey().add("file").add(path).add(options_key)
+            .add(static_cast<long long>(mtime_ns))
+            .add(static_cast<long long>(info.st_size)).value();
+        auto session = std::make_shared<WarmSession>();
+        session->id = id;
+        session->profiles = load_profile_file(path, options);
+        session->options = options;
+        session->bytes = session->profiles.code_bytes();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        files_[file_key] = FileIdentity{mtime_ns, int64_t(info.st_size), id};
+        return insert(std::move(session));
+    }
+
+    // Session for file contents sent with the request
+    std::shared_ptr<WarmSession> load_bytes(
+        std::string_view data,
+        const std::string& options_key,
+        const ParseOptions& options
+    ) {
+        uint64_t id = ResultKey().add("bytes").add(data).add(options_key).value();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = sessions_.find(id);
+            if (it != sessions_.end()) {
+                touch(*it->second);
+                return it->second;
+            }
+        }
+
+        auto session = std::make_shared<WarmSession>();
+        session->id = id;
+        session->profiles = load_profile_bytes(data, options);
+        session->options = options;
+        session->bytes = session->profiles.code_bytes();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        return insert(std::move(session));
+    }
+
+    void drop(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sessions_.erase(id);
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sessions_.size();
+    }
+
+    uint64_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_locked();
+    }
+
+    // Free least recently used results, then sessions, until the store
+    // fits its limit again. keep (the session just used) goes last and
+    // keeps its profiles; sessions busy computing are left alone, and
+    // requests in flight keep their session alive.
+    void trim(const WarmSession& keep) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr<WarmSession>> by_age;
+        for (const auto& entry : sessions_) {
+            by_age.push_back(entry.second);
+        }
+        std::sort(by_age.begin(), by_age.end(), [&](const auto& a, const auto& b) {
+            bool a_kept = a.get() == &keep;
+            bool b_kept = b.get() == &keep;
+            if (a_kept != b_kept) {
+                return b_kept;
+            }
+            return a->last_used < b->last_used;
+        });
+
+        uint64_t total = bytes_locked();
+        for (const auto& session : by_age) {
+            if (total <= limit_) {
+                return;
+            }
+            std::unique_lock<std::mutex> busy(session->mutex, std::try_to_lock);
+            if (!busy.owns_lock()) {
+                continue;
+            }
+            total -= session->bytes;
+            session->matrices.clear();
+            session->trees.clear();
+            session->recount();
+            total += session->bytes;
+            if (total > limit_ && session.get() != &keep) {
+                total -= session->bytes;
+                busy.unlock();
+                sessions_.erase(session->id);
+            }
+        }
+    }
+
+private:
+    void touch(WarmSession& session) {
+        session.last_used = ++clock_;
+    }
+
+    std::shared_ptr<WarmSession> insert(std::shared_ptr<WarmSession> session) {
+        // A concurrent load of the same input may have won the race
+        auto it = sessions_.find(session->id);
+        if (it != sessions_.end()) {
+            touch(*it->second);
+            return it->second;
+        }
+        touch(*session);
+        sessions_.emplace(session->id, session);
+        return session;
+    }
+
+    uint64_t bytes_locked() const {
+        uint64_t total = 0;
+        for (const auto& entry : sessions_) {
+            total += entry.second->bytes;
+        }
+        return total;
+    }
+
+    static ProfileStore load_profile_file(
+        const std::string& path,
+        const ParseOptions& options
+    ) {
+        {
+            MappedFile file(path);
+            if (ProfileStoreFormat::matches(file.data(), file.size())) {
+                return load_profile_store(path);
+            }
+        }
+        MappedFile file(path);
+        return load_profile_bytes(std::string_view(file.data(), file.size()), options);
+    }
+
+    static ProfileStore load_profile_bytes(
+        std::string_view data,
+        const ParseOptions& options
+    ) {
+        if (ProfileStoreFormat::matches(data.data(), data.size())) {
+            return adopt_profile_store(std::string(data));
+        }
+        size_t first = data.find_first_not_of(" \t\r\n");
+        if (first != std::string_view::npos && data[first] == '{') {
+            return parse_profile_json_store(data.data(), data.size(), options);
+        }
+        return parse_profile_tsv_parallel(data.data(), data.size(), options);
+    }
+};
+
+// Parse queries with the collection's missing tokens; a handful of rows
+// is never worth packing
+ProfileStore parse_queries(std::string_view data, ParseOptions options) {
+    options.pack_columns = false;
+    size_t first = data.find_first_not_of(" \t\r\n");
+    if (first != std::string_view::npos && data[first] == '{') {
+        return parse_profile_json_store(data.data(), data.size(), options);
+    }
+    return parse_profile_tsv(data.data(), data.size(), options);
+}
+
+const char* method_name(uint8_t method) {
+    switch (method) {
+        case 0: return "MSTreeV2";
+        case 1: return "MSTree";
+    }
+    throw std::runtime_error("Unknown tree method " + std::to_string(method));
+}
+
+void check_matrix(uint8_t matrix, uint8_t missing) {
+    if (matrix > 1) {
+        throw std::runtime_error("Unknown matrix type " + std::to_string(matrix));
+    }
+    if (missing > 3) {
+        throw std::runtime_error("Missing-data handler must be 0-3");
+    }
+}
+
+// The asymmetric matrix ignores the missing-data handler
+int matrix_key(uint8_t matrix, uint8_t missing) {
+    return matrix == 1 ? 1 + missing : 0;
+}
+
+DenseMatrix compute_matrix(const ProfileStore& profiles, uint8_t matrix, uint8_t missing) {
+    DistanceMatrix engine(profiles);
+    return matrix == 1 ?
+        engine.compute_symmetric(static_cast<DistanceMatrix::MissingHandler>(missing)) :
+        engine.compute_asymmetric();
+}
+
+std::shared_ptr<const DenseMatrix> cached_matrix(
+    WarmSession& session,
+    uint8_t matrix,
+    uint8_t missing
+) {
+    std::lock_guard<std::mutex> lock(session.mutex);
+    auto it = session.matrices.find(matrix_key(matrix, missing));
+    return it != session.matrices.end() ? it->second : nullptr;
+}
+
+std::shared_ptr<const DenseMatrix> dense_matrix(
+    WarmSession& session,
+    uint8_t matrix,
+    uint8_t missing
+) {
+    std::lock_guard<std::mutex> lock(session.mutex);
+    auto& slot = session.matrices[matrix_key(matrix, missing)];
+    if (!slot) {
+        try {
+            slot = std::make_shared<const DenseMatrix>(
+                compute_matrix(session.profiles, matrix, missing)
+            );
+        } catch (...) {
+            session.matrices.erase(matrix_key(matrix, missing));
+            throw;
+        }
+        session.recount();
+    }
+    return slot;
+}
+
+class Server {
+private:
+    SessionStore& store_;
+    bool quiet_;
+
+public:
+    Server(SessionStore& store, bool quiet) : store_(store), quiet_(quiet) {}
+
+    // Response payload for one request; errors become error responses
+    std::string handle(std::string_view request) {
+        auto start = std::chrono::steady_clock::now();
+        std::string response(1, static_cast<char>(STATUS_OK));
+        uint8_t op = 0;
+        std::string detail;
+        try {
+            Reader in(request);
+            op = in.take<uint8_t>();
+            detail = dispatch(op, in, response);
+        } catch (const std::exception& e) {
+            response.assign(1, static_cast<char>(STATUS_ERROR));
+            response += e.what();
+            detail = std::string("error: ") + e.what();
+        }
+        if (!quiet_) {
+            double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start
+            ).count();
+            std::fprintf(stderr, "op %u %s (%.1f ms)\n", op, detail.c_str(), ms);
+        }
+        return response;
+    }
+
+private:
+    std::string dispatch(uint8_t op, Reader& in, std::string& out) {
+        switch (op) {
+            case OP_LOAD: return load(in, out);
+            case OP_TREE: return tree(in, out);
+            case OP_MATRIX: return matrix(in, out);
+            case OP_PLACE: return place(in, out);
+            case OP_NAMES: return names(in, out);
+            case OP_DROP: {
+                uint64_t id = in.take<uint64_t>();
+                store_.drop(id);
+                return "session " + std::to_string(id);
+            }
+            case OP_STATS:
+                put<uint64_t>(out, store_.size());
+                put<uint64_t>(out, store_.bytes());
+                put<uint64_t>(out, store_.limit());
+                return std::to_string(store_.size()) + " sessions";
+        }
+        throw std::runtime_error("Unknown op " + std::to_string(op));
+    }
+
+    std::string load(Reader& in, std::string& out) {
+        uint8_t source = in.take<uint8_t>();
+        uint8_t flags = in.take<uint8_t>();
+
+        ParseOptions options;
+        options.pack_columns = (flags & 1) != 0;
+        std::string options_key = options.pack_columns ? "packed" : "flat";
+        if (flags & 2) {
+            std::string_view tokens = in.take_bytes(in.take<uint32_t>());
+            options.missing_tokens.clear();
+            for (size_t start = 0; start < tokens.size();) {
+                size_t comma = std::min(tokens.find(',', start), tokens.size());
+                options.missing_tokens.emplace_back(tokens.substr(start, comma - start));
+                start = comma + 1;
+            }
+            options_key += '|';
+            options_key += tokens;
+        }
+
+        std::shared_ptr<WarmSession> session;
+        if (source == 0) {
+            session = store_.load_file(std::string(in.rest()), options_key, options);
+        } else if (source == 1) {
+            session = store_.load_bytes(in.rest(), options_key, options);
+        } else {
+            throw std::runtime_error("Unknown load source " + std::to_string(source));
+        }
+        store_.trim(*session);
+
+        put<uint64_t>(out, session->id);
+        put<uint64_t>(out, session->profiles.n_strains());
+        put<uint64_t>(out, session->profiles.n_loci());
+        return "session " + std::to_string(session->id) + ", " +
+            std::to_string(session->profiles.n_strains()) + " strains";
+    }
+
+    std::string tree(Reader& in, std::string& out) {
+        std::shared_ptr<WarmSession> session = store_.find(in.take<uint64_t>());
+        const char* method = method_name(in.take<uint8_t>());
+        uint8_t matrix = in.take<uint8_t>();
+        uint8_t missing = in.take<uint8_t>();
+        uint8_t heuristic = in.take<uint8_t>();
+        check_matrix(matrix, missing);
+        if (heuristic > 1) {
+            throw std::runtime_error("Unknown heuristic " + std::to_string(heuristic));
+        }
+        const char* heuristic_name = heuristic == 1 ? "eburst" : "harmonic";
+
+        std::string key = std::string(method) + '|' +
+            std::to_string(matrix_key(matrix, missing)) + '|' + heuristic_name;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            auto it = session->trees.find(key);
+            if (it != session->trees.end()) {
+                out += *it->second;
+                return key + " cached";
+            }
+        }
+
+        // A warm matrix if there is one; otherwise the planner decides
+        // whether a dense one fits next to the other sessions
+        std::vector<Edge> edges;
+        std::string storage = "dense";
+        if (auto distances = cached_matrix(*session, matrix, missing)) {
+            edges = build_tree(*distances, method, heuristic_name);
+        } else {
+            PlanRequest request;
+            request.n_strains = session->profiles.n_strains();
+            request.n_loci = session->profiles.n_loci();
+            request.method = method;
+            request.asymmetric = matrix == 0;
+            request.budget_bytes = remaining_budget(*session);
+            request.profile_bytes = session->profiles.code_bytes();
+            RunPlan plan = plan_run(request);
+            storage = storage_name(plan.storage);
+            if (plan.storage == MatrixStorage::DENSE) {
+                edges = build_tree(
+                    *dense_matrix(*session, matrix, missing), method, heuristic_name
+                );
+            } else {
+                edges = build_planned_tree(
+                    session->profiles, plan, method, matrix == 0,
+                    static_cast<DistanceMatrix::MissingHandler>(missing),
+                    heuristic_name
+                );
+            }
+        }
+
+        auto encoded = std::make_shared<std::string>();
+        put<uint64_t>(*encoded, edges.size());
+        for (const Edge& e : edges) {
+            put<uint64_t>(*encoded, e.from);
+            put<uint64_t>(*encoded, e.to);
+            put<double>(*encoded, e.distance);
+        }
+        out += *encoded;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            session->trees[key] = std::move(encoded);
+            session->recount();
+        }
+        store_.trim(*session);
+        return key + " on " + storage;
+    }
+
+    // The store's limit less what every session holds, this one's
+    // profiles excepted (the plan counts them itself). 0 is no limit to
+    // the planner, so a full store leaves one byte and nothing fits.
+    uint64_t remaining_budget(const WarmSession& session) {
+        uint64_t limit = store_.limit();
+        if (limit == 0) {
+            return 0;
+        }
+        uint64_t held = store_.bytes();
+        uint64_t own = session.profiles.code_bytes();
+        uint64_t in_use = held > own ? held - own : 0;
+        return in_use < limit ? limit - in_use : 1;
+    }
+
+    std::string matrix(Reader& in, std::string& out) {
+        std::shared_ptr<WarmSession> session = store_.find(in.take<uint64_t>());
+        uint8_t matrix = in.take<uint8_t>();
+        uint8_t missing = in.take<uint8_t>();
+        check_matrix(matrix, missing);
+
+        std::shared_ptr<const DenseMatrix> distances = dense_matrix(*session, matrix, missing);
+        size_t n = distances->size();
+        out.reserve(out.size() + sizeof(uint64_t) + n * n * sizeof(double));
+        put<uint64_t>(out, n);
+        if (n > 0) {
+            out.append(reinterpret_cast<const char*>(distances->row(0)),
+                       n * n * sizeof(double));
+        }
+        store_.trim(*session);
+        return std::to_string(n) + " x " + std::to_string(n);
+    }
+
+    std::string place(Reader& in, std::string& out) {
+        std::shared_ptr<WarmSession> session = store_.find(in.take<uint64_t>());
+        uint32_t k = in.take<uint32_t>();
+        ProfileStore queries = parse_queries(in.rest(), session->options);
+
+        const ProfilePlacer* placer;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            if (!session->placer) {
+                session->placer = std::make_unique<ProfilePlacer>(session->profiles);
+            }
+            placer = session->placer.get();
+        }
+        std::vector<std::vector<Placement>> placements = placer->place(queries, k);
+
+        uint32_t placed = placements.empty() ? 0 :
+            static_cast<uint32_t>(placements[0].size());
+        put<uint64_t>(out, placements.size());
+        put<uint32_t>(out, placed);
+        for (const auto& nearest : placements) {
+            for (const Placement& p : nearest) {
+                put<uint64_t>(out, p.strain);
+                put<double>(out, static_cast<double>(p.distance));
+            }
+        }
+        return std::to_string(placements.size()) + " queries";
+    }
+
+    std::string names(Reader& in, std::string& out) {
+        std::shared_ptr<WarmSession> session = store_.find(in.take<uint64_t>());
+        const StringArena& names = session->profiles.strain_names();
+        put<uint64_t>(out, names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            std::string_view name = names[i];
+            put<uint32_t>(out, static_cast<uint32_t>(name.size()));
+            out.append(name.data(), name.size());
+        }
+        return std::to_string(names.size()) + " names";
+    }
+};
+
+bool read_exact(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t got = ::read(fd, data, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+bool write_exact(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Open client connections, so a shutdown can end them
+class Connections {
+private:
+    std::mutex mutex_;
+    std::condition_variable closed_;
+    std::set<int> fds_;
+
+public:
+    void add(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fds_.insert(fd);
+    }
+
+    void remove(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fds_.erase(fd);
+        closed_.notify_all();
+    }
+
+    // Stop reading requests and wait for those in flight to be answered
+    void close_all() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (int fd : fds_) {
+            ::shutdown(fd, SHUT_RD);
+        }
+        closed_.wait(lock, [&] { return fds_.empty(); });
+    }
+};
+
+bool write_frame(int fd, const std::string& response) {
+    uint64_t length = response.size();
+    return write_exact(fd, reinterpret_cast<const char*>(&length), sizeof(length)) &&
+           write_exact(fd, response.data(), response.size());
+}
+
+// Requests in, responses out, until the client hangs up. A frame over
+// MAX_FRAME_BYTES is answered with an error and ends the connection,
+// since its body is never read.
+void serve_connection(int fd, Server& server, Connections& connections) {
+    std::string request;
+    for (;;) {
+        uint64_t size = 0;
+        if (!read_exact(fd, reinterpret_cast<char*>(&size), sizeof(size))) {
+            break;
+        }
+        if (size > MAX_FRAME_BYTES) {
+            std::string response(1, static_cast<char>(STATUS_ERROR));
+            response += "Request of " + std::to_string(size) + " bytes exceeds the " +
+                std::to_string(MAX_FRAME_BYTES) + " byte limit";
+            write_frame(fd, response);
+            break;
+        }
+        try {
+            request.resize(size);
+        } catch (const std::exception&) {
+            break;
+        }
+        if (!read_exact(fd, request.data(), request.size())) {
+            break;
+        }
+        if (!write_frame(fd, server.handle(request))) {
+            break;
+        }
+    }
+    connections.remove(fd);
+    ::close(fd);
+}
+
+std::atomic<bool> stopping{false};
+
+extern "C" void on_signal(int) {
+    stopping = true;
+}
+
+struct DaemonOptions {
+    std::string socket_path = "/tmp/grapetree.sock";
+    unsigned n_threads = 0;
+    uint64_t memory_limit = 0;
+    bool quiet = false;
+};
+
+DaemonOptions parse_arguments(int argc, char** argv) {
+    DaemonOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw UsageError(arg + " expects a value");
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            std::fputs(USAGE, stdout);
+            std::exit(0);
+        } else if (arg == "-s" || arg == "--socket") {
+            options.socket_path = value();
+        } else if (arg == "-t" || arg == "--threads") {
+            options.n_threads = static_cast<unsigned>(parse_count(value(), arg));
+        } else if (arg == "-m" || arg == "--memory-limit") {
+            options.memory_limit = parse_size(value(), arg);
+        } else if (arg == "-q" || arg == "--quiet") {
+            options.quiet = true;
+        } else {
+            throw UsageError("Unknown option " + arg);
+        }
+    }
+
+    if (options.memory_limit == 0) {
+        long pages = ::sysconf(_SC_PHYS_PAGES);
+        long page_size = ::sysconf(_SC_PAGE_SIZE);
+        options.memory_limit = pages > 0 && page_size > 0 ?
+            uint64_t(pages) * uint64_t(page_size) / 2 : uint64_t(4) << 30;
+    }
+    return options;
+}
+
+int listen_on(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+    }
+    // A socket file left by a daemon that did not shut down cleanly
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::chmod(path.c_str(), 0660) != 0 ||
+        ::listen(fd, 64) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw std::runtime_error(
+            "Cannot listen on " + path + ": " + std::strerror(error)
+        );
+    }
+    return fd;
+}
+
+void run(const DaemonOptions& options) {
+    ThreadPool::set_shared_threads(options.n_threads);
+    SessionStore store(options.memory_limit);
+    Server server(store, options.quiet);
+    Connections connections;
+
+    struct sigaction action{};
+    action.sa_handler = on_signal;
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+
+    int listener = listen_on(options.socket_path);
+    if (!options.quiet) {
+        std::fprintf(stderr, "Listening on %s (%u threads, %.1f GB for sessions)\n",
+                     options.socket_path.c_str(), ThreadPool::shared().size(),
+                     options.memory_limit / (1024.0 * 1024.0 * 1024.0));
+    }
+
+    // Wake up now and then to notice a signal
+    pollfd waiting{listener, POLLIN, 0};
+    while (!stopping) {
+        int ready = ::poll(&waiting, 1, 500);
+        if (ready <= 0) {
+            continue;
+        }
+        int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        connections.add(client);
+        std::thread(
+            serve_connection, client, std::ref(server), std::ref(connections)
+        ).detach();
+    }
+
+    ::close(listener);
+    ::unlink(options.socket_path.c_str());
+    connections.close_all();
+    if (!options.quiet) {
+        std::fprintf(stderr, "Stopped\n");
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        run(parse_arguments(argc, argv));
+        return 0;
+    } catch (const UsageError& e) {
+        std::fprintf(stderr, "grapetree-daemon: %s\n\n%s", e.what(), USAGE);
+        return 2;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "grapetree-daemon: %s\n", e.what());
+        return 1;
+    }
+}
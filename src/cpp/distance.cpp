@@ -8,17 +8,31 @@
 #include <string>
 #include <cmath>
 #include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <utility>
+
+#include "profile_store.cpp"
+#include "matrix.cpp"
+#include "fasta_reader.cpp"
+#include "vcf_reader.cpp"
+#include "thread_pool.cpp"
+#include "simd.cpp"
+#include "trace.cpp"
 
 namespace grapetree {
 
+// More pairs within a sparse threshold than the matrix was sized for
+class SparseOverflowError : public std::length_error {
+public:
+    using std::length_error::length_error;
+};
+
 class DistanceMatrix {
 public:
-    struct ProfileData {
-        std::vector<std::string> strain_names;
-        std::vector<std::vector<int>> profiles;
-        int n_strains;
-        int n_genes;
-    };
+    using Code = ProfileStore::Code;
     
     enum MissingHandler {
         IGNORE = 0,        // Ignore missing in pairwise comparison
@@ -28,159 +42,472 @@ public:
     };
     
 private:
-    ProfileData data_;
+    const ProfileStore& data_;
     
 public:
-    explicit DistanceMatrix(const ProfileData& data) : data_(data) {}
+    explicit DistanceMatrix(const ProfileStore& data) : data_(data) {}
     
     // Compute symmetric distance matrix (for MSTree and NJ)
-    std::vector<std::vector<double>> compute_symmetric(
+    DenseMatrix compute_symmetric(
         MissingHandler handler = IGNORE
     ) {
-        std::vector<std::vector<double>> matrix(
-            data_.n_strains,
-            std::vector<double>(data_.n_strains, 0.0)
-        );
+        DenseMatrix matrix(data_.n_strains());
+        fill_symmetric_rows(matrix, 0, data_.n_strains(), handler);
+        return matrix;
+    }
+    
+    // Compute asymmetric distance matrix (for MSTreeV2)
+    DenseMatrix compute_asymmetric() {
+        DenseMatrix matrix(data_.n_strains());
+        fill_asymmetric_rows(matrix, 0, data_.n_strains(), count_missing());
+        return matrix;
+    }
+    
+    // Rows [begin, end) of the symmetric matrix: pairs (i, j > i) and
+    // their mirror images. Filling every row range once in any order
+    // yields compute_symmetric(), so the work can be done in slices.
+    // Rows touch disjoint cells and are spread over the shared pool.
+    void fill_symmetric_rows(
+        DenseMatrix& matrix,
+        size_t begin,
+        size_t end,
+        MissingHandler handler
+    ) {
+        size_t n = data_.n_strains();
         
-        for (int i = 0; i < data_.n_strains; ++i) {
-            for (int j = i + 1; j < data_.n_strains; ++j) {
-                double dist = compute_pairwise_distance(
-                    data_.profiles[i],
-                    data_.profiles[j],
-                    handler
-                );
-                matrix[i][j] = dist;
-                matrix[j][i] = dist;
+        ThreadPool::shared().parallel_for(end - begin, [&](size_t b, size_t e) {
+            GRAPETREE_SPAN_ARG("distance", "symmetric rows", "first", begin + b);
+            std::vector<uint32_t> differences(n);
+            for (size_t i = begin + b; i < begin + e; ++i) {
+                count_row_differences(i, i + 1, n, handler, differences.data());
+                for (size_t j = i + 1; j < n; ++j) {
+                    double dist = static_cast<double>(differences[j]);
+                    matrix(i, j) = dist;
+                    matrix(j, i) = dist;
+                }
+            }
+        });
+    }
+    
+    // Rows [begin, end) of the asymmetric matrix; missing is
+    // count_missing()
+    void fill_asymmetric_rows(
+        DenseMatrix& matrix,
+        size_t begin,
+        size_t end,
+        const std::vector<uint32_t>& missing
+    ) {
+        size_t n = data_.n_strains();
+        
+        // Directional distance = differences at loci present in both
+        // profiles (symmetric) + 0.5 * loci missing in the source profile.
+        // This encourages the tree to grow from complete profiles.
+        ThreadPool::shared().parallel_for(end - begin, [&](size_t b, size_t e) {
+            GRAPETREE_SPAN_ARG("distance", "asymmetric rows", "first", begin + b);
+            std::vector<uint32_t> differences(n);
+            for (size_t i = begin + b; i < begin + e; ++i) {
+                count_row_differences(i, i + 1, n, IGNORE, differences.data());
+                for (size_t j = i + 1; j < n; ++j) {
+                    double dist = static_cast<double>(differences[j]);
+                    matrix(i, j) = dist + 0.5 * static_cast<double>(missing[i]);
+                    matrix(j, i) = dist + 0.5 * static_cast<double>(missing[j]);
+                }
             }
+        });
+    }
+    
+    // Symmetric counts between strain i and every strain, itself
+    // included (0), into differences[0, n). Column blocks are spread
+    // over the shared pool, so a single row still uses every core.
+    void row_differences(
+        size_t i,
+        MissingHandler handler,
+        uint32_t* differences
+    ) const {
+        size_t n = data_.n_strains();
+        ThreadPool::shared().parallel_for(n, [&](size_t first, size_t last) {
+            GRAPETREE_SPAN_ARG("distance", "row columns", "first", first);
+            count_row_differences(i, first, last, handler, differences);
+        }, 4096);
+        differences[i] = 0;
+    }
+    
+    // The symmetric (asymmetric = false) or asymmetric matrix as uint16_t
+    // counts; the data must have at most CondensedMatrix16::MAX_COUNT loci
+    CondensedMatrix16 compute_condensed16(
+        bool asymmetric,
+        MissingHandler handler = IGNORE
+    ) const {
+        size_t n = data_.n_strains();
+        if (data_.n_loci() > CondensedMatrix16::MAX_COUNT) {
+            throw std::length_error(
+                "Too many loci for 16-bit distances: " +
+                std::to_string(data_.n_loci())
+            );
+        }
+        CondensedMatrix16 matrix(n, asymmetric ? missing_offsets() : std::vector<double>());
+        if (asymmetric) {
+            handler = IGNORE;
         }
         
+        ThreadPool::shared().parallel_for(n, [&](size_t b, size_t e) {
+            GRAPETREE_SPAN_ARG("distance", "condensed rows", "first", b);
+            std::vector<uint32_t> differences(n);
+            for (size_t i = b; i < e; ++i) {
+                count_row_differences(i, i + 1, n, handler, differences.data());
+                for (size_t j = i + 1; j < n; ++j) {
+                    matrix.set(j, i, differences[j]);
+                }
+            }
+        });
         return matrix;
     }
     
-    // Compute asymmetric distance matrix (for MSTreeV2)
-    std::vector<std::vector<double>> compute_asymmetric() {
-        std::vector<std::vector<double>> matrix(
-            data_.n_strains,
-            std::vector<double>(data_.n_strains, 0.0)
-        );
+    // Pairs within threshold differences, symmetric or asymmetric. More
+    // than max_pairs such pairs throws SparseOverflowError instead of
+    // growing past the memory they were planned for.
+    SparseMatrix compute_sparse(
+        bool asymmetric,
+        MissingHandler handler,
+        uint32_t threshold,
+        size_t max_pairs
+    ) const {
+        size_t n = data_.n_strains();
+        if (n > UINT32_MAX) {
+            throw std::length_error("Too many strains for a sparse matrix");
+        }
+        if (asymmetric) {
+            handler = IGNORE;
+        }
         
-        for (int i = 0; i < data_.n_strains; ++i) {
-            for (int j = 0; j < data_.n_strains; ++j) {
-                if (i == j) {
-                    matrix[i][j] = 0.0;
-                } else {
-                    matrix[i][j] = compute_directional_distance(
-                        data_.profiles[i],
-                        data_.profiles[j]
+        std::vector<std::vector<std::pair<uint32_t, uint32_t>>> near(n);
+        std::atomic<size_t> n_pairs{0};
+        ThreadPool::shared().parallel_for(n, [&](size_t b, size_t e) {
+            GRAPETREE_SPAN_ARG("distance", "sparse rows", "first", b);
+            std::vector<uint32_t> differences(n);
+            for (size_t i = b; i < e; ++i) {
+                count_row_differences(i, i + 1, n, handler, differences.data());
+                for (size_t j = i + 1; j < n; ++j) {
+                    if (differences[j] <= threshold) {
+                        near[i].emplace_back(static_cast<uint32_t>(j), differences[j]);
+                    }
+                }
+                if (n_pairs.fetch_add(near[i].size()) + near[i].size() > max_pairs) {
+                    throw SparseOverflowError(
+                        "More than " + std::to_string(max_pairs) +
+                        " strain pairs within " + std::to_string(threshold) +
+                        " differences; lower the sparse threshold or raise "
+                        "the memory budget"
                     );
                 }
             }
+        });
+        
+        return SparseMatrix(
+            n, threshold, near,
+            asymmetric ? missing_offsets() : std::vector<double>()
+        );
+    }
+    
+    // 0.5 x missing loci per strain: the row offsets of the asymmetric
+    // matrix
+    std::vector<double> missing_offsets() const {
+        std::vector<uint32_t> missing = count_missing();
+        std::vector<double> offset(missing.size());
+        for (size_t i = 0; i < missing.size(); ++i) {
+            offset[i] = 0.5 * static_cast<double>(missing[i]);
         }
+        return offset;
+    }
+    
+    // Number of missing loci per strain
+    std::vector<uint32_t> count_missing() const {
+        size_t n = data_.n_strains();
+        std::vector<uint32_t> missing(n, 0);
+        Code block[DECODE_BLOCK];
         
-        return matrix;
+        for (size_t k = 0; k < data_.n_loci(); ++k) {
+            for (size_t i = 0; i < n; i += DECODE_BLOCK) {
+                size_t count = std::min(DECODE_BLOCK, n - i);
+                data_.decode(k, i, count, block);
+                for (size_t b = 0; b < count; ++b) {
+                    missing[i + b] += (block[b] == ProfileStore::MISSING);
+                }
+            }
+        }
+        
+        return missing;
     }
     
     // Compute p-distance for aligned sequences
-    std::vector<std::vector<double>> compute_p_distance(
+    DenseMatrix compute_p_distance(
         const std::vector<std::string>& sequences
     ) {
-        int n = sequences.size();
-        std::vector<std::vector<double>> matrix(
-            n, 
-            std::vector<double>(n, 0.0)
-        );
+        size_t n = sequences.size();
+        DenseMatrix matrix(n);
         
-        for (int i = 0; i < n; ++i) {
-            for (int j = i + 1; j < n; ++j) {
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = i + 1; j < n; ++j) {
                 double dist = p_distance(sequences[i], sequences[j]);
-                matrix[i][j] = dist;
-                matrix[j][i] = dist;
+                matrix(i, j) = dist;
+                matrix(j, i) = dist;
             }
         }
         
         return matrix;
     }
     
-private:
-    // Pairwise allelic distance
-    double compute_pairwise_distance(
-        const std::vector<int>& profile1,
-        const std::vector<int>& profile2,
-        MissingHandler handler
+    // Compute p-distance for a bit-packed alignment. Gaps, N and other
+    // ambiguity codes are excluded through the validity planes, and each
+    // pair of 64-site words is compared with a handful of vector ops.
+    static DenseMatrix compute_p_distance(
+        const PackedAlignment& alignment
     ) {
-        int differences = 0;
-        int valid_positions = 0;
+        DenseMatrix matrix(alignment.n_sequences());
+        fill_p_distance(alignment, matrix);
+        return matrix;
+    }
+    
+    // compute_p_distance() into an existing n x n matrix; the diagonal
+    // is left as it is
+    static void fill_p_distance(
+        const PackedAlignment& alignment,
+        DenseMatrix& matrix
+    ) {
+        size_t n = alignment.n_sequences();
+        size_t words = alignment.n_words();
+        
+        ThreadPool::shared().parallel_for(n, [&](size_t first, size_t last) {
+            GRAPETREE_SPAN_ARG("distance", "p-distance rows", "first", first);
+            for (size_t i = first; i < last; ++i) {
+                const PackedSequence& a = alignment.sequence(i);
+                for (size_t j = i + 1; j < n; ++j) {
+                    const PackedSequence& b = alignment.sequence(j);
+                    simd::V128 diff_counts = simd::zero();
+                    simd::V128 valid_counts = simd::zero();
+                    size_t w = 0;
+                    
+                    for (; w + simd::U64_LANES <= words; w += simd::U64_LANES) {
+                        simd::V128 valid = simd::bit_and(
+                            simd::load(&a.valid[w]), simd::load(&b.valid[w])
+                        );
+                        simd::V128 diff = simd::bit_or(
+                            simd::bit_xor(simd::load(&a.hi[w]), simd::load(&b.hi[w])),
+                            simd::bit_xor(simd::load(&a.lo[w]), simd::load(&b.lo[w]))
+                        );
+                        diff_counts = simd::add_u32(
+                            diff_counts, simd::bit_counts(simd::bit_and(diff, valid))
+                        );
+                        valid_counts = simd::add_u32(
+                            valid_counts, simd::bit_counts(valid)
+                        );
+                    }
+                    
+                    uint64_t differences = simd::sum_u32(diff_counts);
+                    uint64_t valid_positions = simd::sum_u32(valid_counts);
+                    for (; w < words; ++w) {
+                        uint64_t valid = a.valid[w] & b.valid[w];
+                        uint64_t diff = (a.hi[w] ^ b.hi[w]) | (a.lo[w] ^ b.lo[w]);
+                        differences += __builtin_popcountll(diff & valid);
+                        valid_positions += __builtin_popcountll(valid);
+                    }
+                    
+                    double dist = valid_positions == 0 ? 0.0 :
+                        static_cast<double>(differences) /
+                        static_cast<double>(valid_positions);
+                    matrix(i, j) = dist;
+                    matrix(j, i) = dist;
+                }
+            }
+        });
+    }
+    
+    // SNP distance: number of kept sites where two samples differ, over
+    // sites called in both. One XOR and a popcount per 128 sites.
+    static DenseMatrix compute_snp_distance(const SnpMatrix& snps) {
+        DenseMatrix matrix(snps.n_samples());
+        fill_snp_distance(snps, matrix);
+        return matrix;
+    }
+    
+    // compute_snp_distance() into an existing n x n matrix; the diagonal
+    // is left as it is
+    static void fill_snp_distance(const SnpMatrix& snps, DenseMatrix& matrix) {
+        size_t n = snps.n_samples();
+        size_t words = snps.n_words();
         
-        for (int k = 0; k < data_.n_genes; ++k) {
-            int allele1 = profile1[k];
-            int allele2 = profile2[k];
+        ThreadPool::shared().parallel_for(n, [&](size_t first, size_t last) {
+            GRAPETREE_SPAN_ARG("distance", "SNP rows", "first", first);
+            for (size_t i = first; i < last; ++i) {
+                const PackedGenotypes& a = snps.sample(i);
+                for (size_t j = i + 1; j < n; ++j) {
+                    const PackedGenotypes& b = snps.sample(j);
+                    simd::V128 counts = simd::zero();
+                    size_t w = 0;
+                    
+                    for (; w + simd::U64_LANES <= words; w += simd::U64_LANES) {
+                        simd::V128 uncalled = simd::bit_or(
+                            simd::load(&a.missing[w]), simd::load(&b.missing[w])
+                        );
+                        simd::V128 alt = simd::bit_xor(
+                            simd::load(&a.alt[w]), simd::load(&b.alt[w])
+                        );
+                        counts = simd::add_u32(
+                            counts, simd::bit_counts(simd::clear(alt, uncalled))
+                        );
+                    }
+                    
+                    uint64_t differences = simd::sum_u32(counts);
+                    for (; w < words; ++w) {
+                        uint64_t called = ~(a.missing[w] | b.missing[w]);
+                        differences += __builtin_popcountll(
+                            (a.alt[w] ^ b.alt[w]) & called
+                        );
+                    }
+                    
+                    double dist = static_cast<double>(differences);
+                    matrix(i, j) = dist;
+                    matrix(j, i) = dist;
+                }
+            }
+        });
+    }
+    
+    // Allelic differences between a profile from outside the store and
+    // strains [first, last), as for a row of the symmetric matrix. The
+    // profile is one code per locus in the store's coding; an allele the
+    // store has never seen needs a code above n_alleles(locus).
+    void count_query_differences(
+        const Code* query,
+        size_t first,
+        size_t last,
+        MissingHandler handler,
+        uint32_t* differences
+    ) const {
+        count_differences(
+            [&](size_t k) { return query[k]; },
+            first, last, handler, differences
+        );
+    }
+    
+private:
+    // Strains decoded per step when columns are bit-packed
+    static constexpr size_t DECODE_BLOCK = 256;
+    
+    // Allelic differences between strain i and strains [first, last),
+    // streamed one locus column at a time. Missing data is code 0.
+    // Bit-packed columns are unpacked a block at a time into a buffer
+    // that stays in L1, then compared exactly like flat columns.
+    void count_row_differences(
+        size_t i,
+        size_t first,
+        size_t last,
+        MissingHandler handler,
+        uint32_t* differences
+    ) const {
+        count_differences(
+            [&](size_t k) { return data_.code(i, k); },
+            first, last, handler, differences
+        );
+    }
+    
+    template <typename SourceCode>
+    void count_differences(
+        SourceCode&& source_code,
+        size_t first,
+        size_t last,
+        MissingHandler handler,
+        uint32_t* differences
+    ) const {
+        std::fill(differences + first, differences + last, 0u);
+        
+        Code block[DECODE_BLOCK];
+        
+        for (size_t k = 0; k < data_.n_loci(); ++k) {
+            Code a = source_code(k);
             
-            // Missing data represented as 0 or negative values
-            bool missing1 = (allele1 <= 0);
-            bool missing2 = (allele2 <= 0);
+            // Positions missing in the source profile are skipped
+            if ((handler == IGNORE || handler == REMOVE_COLUMN) &&
+                a == ProfileStore::MISSING) {
+                continue;
+            }
             
-            if (missing1 || missing2) {
-                switch (handler) {
-                    case IGNORE:
-                        // Skip this position
-                        continue;
-                        
-                    case REMOVE_COLUMN:
-                        // Skip this position (same as IGNORE)
-                        continue;
-                        
-                    case TREAT_AS_ALLELE:
-                        // Missing is treated as a unique allele
-                        if (missing1 != missing2 || 
-                            (!missing1 && allele1 != allele2)) {
-                            differences++;
-                        }
-                        valid_positions++;
-                        break;
-                        
-                    case ABSOLUTE_DIFF:
-                        // Count missing as difference
-                        differences++;
-                        valid_positions++;
-                        break;
-                }
-            } else {
-                // Both alleles present
-                if (allele1 != allele2) {
-                    differences++;
-                }
-                valid_positions++;
-            }
-        }
-        
-        return static_cast<double>(differences);
-    }
-    
-    // Directional distance for MSTreeV2 (asymmetric)
-    double compute_directional_distance(
-        const std::vector<int>& from_profile,
-        const std::vector<int>& to_profile
-    ) {
-        int differences = 0;
-        int missing_in_from = 0;
-        
-        for (int k = 0; k < data_.n_genes; ++k) {
-            int from_allele = from_profile[k];
-            int to_allele = to_profile[k];
+            if (!data_.packed()) {
+                accumulate_differences(
+                    handler, a, data_.column(k) + first, last - first,
+                    differences + first
+                );
+                continue;
+            }
             
-            if (from_allele <= 0) {
-                // Missing data in 'from' profile
-                missing_in_from++;
-            } else if (to_allele > 0 && from_allele != to_allele) {
-                // Both present but different
-                differences++;
+            for (size_t j = first; j < last; j += DECODE_BLOCK) {
+                size_t count = std::min(DECODE_BLOCK, last - j);
+                data_.decode(k, j, count, block);
+                accumulate_differences(
+                    handler, a, block, count, differences + j
+                );
             }
         }
+    }
+    
+    // differences[j] += d(a, column[j]) for j < count. Whole vectors of
+    // codes are compared at once; the last few go through scalar code.
+    static void accumulate_differences(
+        MissingHandler handler,
+        Code a,
+        const Code* column,
+        size_t count,
+        uint32_t* differences
+    ) {
+        static_assert(sizeof(Code) == sizeof(uint32_t), "kernels use u32 lanes");
+        const simd::V128 one = simd::splat(1);
+        const simd::V128 va = simd::splat(a);
+        const simd::V128 missing = simd::splat(ProfileStore::MISSING);
+        size_t j = 0;
         
-        // Asymmetric: penalize missing data in source node
-        // This encourages the tree to grow from complete profiles
-        return static_cast<double>(differences) + 
-               0.5 * static_cast<double>(missing_in_from);
+        switch (handler) {
+            case IGNORE:
+            case REMOVE_COLUMN:
+                // Skip positions missing in either profile
+                for (; j + simd::U32_LANES <= count; j += simd::U32_LANES) {
+                    simd::V128 b = simd::load(column + j);
+                    simd::V128 same = simd::bit_or(
+                        simd::eq_u32(b, va), simd::eq_u32(b, missing)
+                    );
+                    add_lanes(differences + j, simd::clear(one, same));
+                }
+                for (; j < count; ++j) {
+                    Code b = column[j];
+                    differences[j] += (b != ProfileStore::MISSING) & (b != a);
+                }
+                break;
+                
+            case TREAT_AS_ALLELE:
+            case ABSOLUTE_DIFF:
+                // Missing is treated as a unique allele; under
+                // ABSOLUTE_DIFF a missing source differs from everything
+                if (handler == ABSOLUTE_DIFF && a == ProfileStore::MISSING) {
+                    for (; j + simd::U32_LANES <= count; j += simd::U32_LANES) {
+                        add_lanes(differences + j, one);
+                    }
+                    for (; j < count; ++j) {
+                        differences[j] += 1;
+                    }
+                    break;
+                }
+                for (; j + simd::U32_LANES <= count; j += simd::U32_LANES) {
+                    simd::V128 same = simd::eq_u32(simd::load(column + j), va);
+                    add_lanes(differences + j, simd::clear(one, same));
+                }
+                for (; j < count; ++j) {
+                    differences[j] += (column[j] != a);
+                }
+                break;
+        }
+    }
+    
+    static void add_lanes(uint32_t* differences, simd::V128 increment) {
+        simd::store(differences, simd::add_u32(simd::load(differences), increment));
     }
     
     // p-distance for DNA sequences
@@ -192,8 +519,8 @@ private:
             return std::numeric_limits<double>::max();
         }
         
-        int differences = 0;
-        int valid_positions = 0;
+        size_t differences = 0;
+        size_t valid_positions = 0;
         
         for (size_t i = 0; i < seq1.length(); ++i) {
             char c1 = std::toupper(seq1[i]);
@@ -219,6 +546,253 @@ private:
     }
 };
 
+// Distances computed from the profiles when they are read, for inputs
+// whose matrix does not fit in memory at all. Only the most recently
+// used rows of symmetric counts are kept (O(n) memory); a miss costs one
+// pass over the profiles. A read (i, j) is served from row i or, since
+// counts are symmetric, from row j. When neither is held, the one of
+// the two read more often lately is loaded: the index a scan keeps
+// returning to, whether that is the row (MSTree), the column (MSTreeV2)
+// or the members of a contracted cycle.
+class LazyMatrix {
+public:
+    using MissingHandler = DistanceMatrix::MissingHandler;
+    
+    static constexpr size_t DEFAULT_CACHED_ROWS = 64;
+    
+private:
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    
+    DistanceMatrix engine_;
+    MissingHandler handler_;
+    std::vector<double> offset_;  // empty, or one per row
+    size_t n_;
+    
+    mutable TrackedVector<uint32_t> counts_ =  // slot s holds n counts at s * n
+        tracked_vector<uint32_t>(MemoryStage::matrix);
+    mutable std::vector<size_t> slot_row_;    // row held by each slot
+    mutable std::vector<uint64_t> slot_used_; // last use, for eviction
+    mutable std::vector<uint32_t> row_slot_;  // slot holding each row
+    mutable std::vector<uint32_t> reads_;     // recent reads per index
+    mutable uint64_t clock_ = 0;
+    mutable uint64_t rows_computed_ = 0;
+    
+public:
+    LazyMatrix(
+        const ProfileStore& profiles,
+        bool asymmetric,
+        MissingHandler handler = DistanceMatrix::IGNORE,
+        size_t cached_rows = DEFAULT_CACHED_ROWS
+    ) : engine_(profiles),
+        handler_(asymmetric ? DistanceMatrix::IGNORE : handler),
+        n_(profiles.n_strains()) {
+        if (asymmetric) {
+            offset_ = engine_.missing_offsets();
+        }
+        size_t slots = std::max<size_t>(2, std::min(cached_rows, n_));
+        counts_.resize(slots * n_);
+        slot_row_.assign(slots, NO_NODE);
+        slot_used_.assign(slots, 0);
+        row_slot_.assign(n_, NO_SLOT);
+        reads_.assign(n_, 0);
+    }
+    
+    static size_t memory_bytes(
+        size_t n,
+        bool offsets,
+        size_t cached_rows = DEFAULT_CACHED_ROWS
+    ) {
+        return std::max<size_t>(2, std::min(cached_rows, n)) * n * sizeof(uint32_t) +
+               2 * n * sizeof(uint32_t) + (offsets ? n * sizeof(double) : 0);
+    }
+    
+    size_t size() const { return n_; }
+    
+    // Rows computed so far, counting recomputation after eviction
+    uint64_t rows_computed() const { return rows_computed_; }
+    
+    double operator()(size_t i, size_t j) const {
+        if (i == j) {
+            return 0.0;
+        }
+        ++reads_[i];
+        ++reads_[j];
+        if (++clock_ % n_ == 0) {
+            // Decay, so the counts follow the current scan
+            for (uint32_t& reads : reads_) {
+                reads >>= 1;
+            }
+        }
+        
+        uint32_t count;
+        if (row_slot_[i] != NO_SLOT) {
+            count = row(i)[j];
+        } else if (row_slot_[j] != NO_SLOT) {
+            count = row(j)[i];
+        } else if (reads_[j] > reads_[i]) {
+            count = load(j)[i];
+        } else {
+            count = load(i)[j];
+        }
+        return offset_.empty() ? count : count + offset_[i];
+    }
+    
+private:
+    const uint32_t* row(size_t r) const {
+        uint32_t slot = row_slot_[r];
+        slot_used_[slot] = clock_;
+        return counts_.data() + slot * n_;
+    }
+    
+    const uint32_t* load(size_t r) const {
+        size_t slot = std::min_element(slot_used_.begin(), slot_used_.end()) -
+                      slot_used_.begin();
+        if (slot_row_[slot] != NO_NODE) {
+            row_slot_[slot_row_[slot]] = NO_SLOT;
+        }
+        engine_.row_differences(r, handler_, counts_.data() + slot * n_);
+        slot_row_[slot] = r;
+        row_slot_[r] = static_cast<uint32_t>(slot);
+        ++rows_computed_;
+        return row(r);
+    }
+};
+
+// Distance matrix built one profile row at a time, as rows are parsed.
+// Each added row is compared against every earlier row, so the quadratic
+// work keeps pace with the input instead of starting after the last
+// byte. Rows are kept row-major (each comparison streams two contiguous
+// rows) and pairwise counts in a condensed lower triangle; finish()
+// expands them into the same matrix DistanceMatrix would compute.
+class IncrementalDistanceMatrix {
+public:
+    using Code = ProfileStore::Code;
+    using MissingHandler = DistanceMatrix::MissingHandler;
+    
+private:
+    size_t n_loci_;
+    bool asymmetric_;
+    MissingHandler handler_;
+    size_t n_rows_ = 0;
+    TrackedVector<Code> rows_ = tracked_vector<Code>(MemoryStage::encode);
+    std::vector<uint32_t> missing_;
+    TrackedVector<uint32_t> differences_ =  // row i holds i entries
+        tracked_vector<uint32_t>(MemoryStage::matrix);
+    
+public:
+    // The asymmetric matrix always compares with IGNORE, like
+    // DistanceMatrix::compute_asymmetric
+    IncrementalDistanceMatrix(
+        size_t n_loci,
+        bool asymmetric,
+        MissingHandler handler = DistanceMatrix::IGNORE
+    ) : n_loci_(n_loci),
+        asymmetric_(asymmetric),
+        handler_(asymmetric ? DistanceMatrix::IGNORE : handler) {}
+    
+    size_t n_rows() const { return n_rows_; }
+    size_t n_loci() const { return n_loci_; }
+    
+    void add_row(const Code* row) {
+        rows_.insert(rows_.end(), row, row + n_loci_);
+        const Code* a = rows_.data() + n_rows_ * n_loci_;
+        
+        uint32_t missing = 0;
+        for (size_t k = 0; k < n_loci_; ++k) {
+            missing += (a[k] == ProfileStore::MISSING);
+        }
+        missing_.push_back(missing);
+        
+        size_t offset = differences_.size();
+        differences_.resize(offset + n_rows_);
+        ThreadPool::shared().parallel_for(n_rows_, [&](size_t first, size_t last) {
+            for (size_t j = first; j < last; ++j) {
+                differences_[offset + j] =
+                    count_differences(rows_.data() + j * n_loci_, a);
+            }
+        }, 256);
+        ++n_rows_;
+    }
+    
+    DenseMatrix finish() const {
+        size_t n = n_rows_;
+        DenseMatrix matrix(n);
+        
+        for (size_t i = 1; i < n; ++i) {
+            const uint32_t* row = differences_.data() + condensed_index(i, 0);
+            for (size_t j = 0; j < i; ++j) {
+                double dist = static_cast<double>(row[j]);
+                if (asymmetric_) {
+                    matrix(j, i) = dist + 0.5 * static_cast<double>(missing_[j]);
+                    matrix(i, j) = dist + 0.5 * static_cast<double>(missing_[i]);
+                } else {
+                    matrix(j, i) = dist;
+                    matrix(i, j) = dist;
+                }
+            }
+        }
+        
+        return matrix;
+    }
+    
+private:
+    // Same per-locus rules as DistanceMatrix::count_row_differences,
+    // one vector of loci at a time
+    uint32_t count_differences(const Code* a, const Code* b) const {
+        const simd::V128 one = simd::splat(1);
+        const simd::V128 missing = simd::splat(ProfileStore::MISSING);
+        simd::V128 counts = simd::zero();
+        uint32_t differences = 0;
+        size_t k = 0;
+        
+        switch (handler_) {
+            case DistanceMatrix::IGNORE:
+            case DistanceMatrix::REMOVE_COLUMN:
+                for (; k + simd::U32_LANES <= n_loci_; k += simd::U32_LANES) {
+                    simd::V128 va = simd::load(a + k);
+                    simd::V128 vb = simd::load(b + k);
+                    simd::V128 same = simd::bit_or(
+                        simd::eq_u32(va, vb),
+                        simd::bit_or(simd::eq_u32(va, missing), simd::eq_u32(vb, missing))
+                    );
+                    counts = simd::add_u32(counts, simd::clear(one, same));
+                }
+                for (; k < n_loci_; ++k) {
+                    differences += (a[k] != ProfileStore::MISSING) &
+                                   (b[k] != ProfileStore::MISSING) &
+                                   (a[k] != b[k]);
+                }
+                break;
+                
+            case DistanceMatrix::TREAT_AS_ALLELE:
+                for (; k + simd::U32_LANES <= n_loci_; k += simd::U32_LANES) {
+                    simd::V128 same = simd::eq_u32(simd::load(a + k), simd::load(b + k));
+                    counts = simd::add_u32(counts, simd::clear(one, same));
+                }
+                for (; k < n_loci_; ++k) {
+                    differences += (a[k] != b[k]);
+                }
+                break;
+                
+            case DistanceMatrix::ABSOLUTE_DIFF:
+                for (; k + simd::U32_LANES <= n_loci_; k += simd::U32_LANES) {
+                    simd::V128 va = simd::load(a + k);
+                    simd::V128 same = simd::clear(
+                        simd::eq_u32(va, simd::load(b + k)), simd::eq_u32(va, missing)
+                    );
+                    counts = simd::add_u32(counts, simd::clear(one, same));
+                }
+                for (; k < n_loci_; ++k) {
+                    differences += (a[k] == ProfileStore::MISSING) |
+                                   (a[k] != b[k]);
+                }
+                break;
+        }
+        
+        return differences + simd::sum_u32(counts);
+    }
+};
+
 } // namespace grapetree
 
 #endif // GRAPETREE_DISTANCE_H
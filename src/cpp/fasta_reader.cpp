@@ -0,0 +1,245 @@
+// fasta_reader.cpp - Streaming aligned FASTA reader
+// Packs bases into 2-bit planes plus a validity mask as text arrives,
+// so the text form of an alignment is never held in memory
+
+#ifndef GRAPETREE_FASTA_READER_H
+#define GRAPETREE_FASTA_READER_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+#include "profile_store.cpp"
+#include "mapped_file.cpp"
+#include "memory.cpp"
+
+namespace grapetree {
+
+// One aligned sequence as three bit planes, 64 sites per word.
+// A=00 C=01 G=10 T=11 across (hi, lo); valid is 0 for gaps, N and any
+// other ambiguity code, and for the padding past the last site.
+struct PackedSequence {
+    TrackedVector<uint64_t> hi = tracked_vector<uint64_t>(MemoryStage::encode);
+    TrackedVector<uint64_t> lo = tracked_vector<uint64_t>(MemoryStage::encode);
+    TrackedVector<uint64_t> valid = tracked_vector<uint64_t>(MemoryStage::encode);
+};
+
+class PackedAlignment {
+private:
+    StringArena names_;
+    std::vector<PackedSequence> sequences_;
+    size_t length_ = 0;
+
+    friend class FastaReader;
+
+public:
+    size_t n_sequences() const { return sequences_.size(); }
+    size_t length() const { return length_; }
+    size_t n_words() const { return (length_ + 63) / 64; }
+
+    const StringArena& names() const { return names_; }
+    const PackedSequence& sequence(size_t i) const { return sequences_[i]; }
+};
+
+// Incremental FASTA parser. Input may be split at any byte boundary:
+// call feed() for each chunk (a browser File stream slice, or an mmapped
+// file natively) and finish() once at the end.
+class FastaReader {
+private:
+    enum State {
+        LINE_START,
+        HEADER_NAME,
+        HEADER_REST,
+        SEQUENCE
+    };
+
+    // Per-byte class: bit 0 = lo, bit 1 = hi, bit 2 = valid base,
+    // SKIP for line breaks and blanks inside sequence lines
+    static constexpr uint8_t SKIP = 0x80;
+
+    PackedAlignment alignment_;
+    State state_ = LINE_START;
+    bool in_record_ = false;
+    std::string name_;
+    PackedSequence current_;
+    size_t sites_ = 0;
+    uint64_t hi_ = 0;
+    uint64_t lo_ = 0;
+    uint64_t valid_ = 0;
+    uint8_t table_[256];
+
+public:
+    FastaReader() {
+        for (int c = 0; c < 256; ++c) {
+            table_[c] = 0;
+        }
+        set_base('A', 0);
+        set_base('C', 1);
+        set_base('G', 2);
+        set_base('T', 3);
+        set_base('U', 3);
+        table_[static_cast<uint8_t>('\n')] = SKIP;
+        table_[static_cast<uint8_t>('\r')] = SKIP;
+        table_[static_cast<uint8_t>(' ')] = SKIP;
+        table_[static_cast<uint8_t>('\t')] = SKIP;
+    }
+
+    void feed(const char* data, size_t size) {
+        const char* end = data + size;
+
+        for (const char* p = data; p < end; ++p) {
+            char c = *p;
+
+            switch (state_) {
+                case LINE_START:
+                    if (c == '>') {
+                        end_record();
+                        begin_record();
+                        state_ = HEADER_NAME;
+                        continue;
+                    }
+                    if (c == '\n' || c == '\r') {
+                        continue;
+                    }
+                    if (!in_record_) {
+                        throw std::runtime_error(
+                            "FASTA input must start with a '>' header line"
+                        );
+                    }
+                    state_ = SEQUENCE;
+                    break;
+
+                case HEADER_NAME:
+                    // Name is the first whitespace-delimited word
+                    if (c == '\n') {
+                        state_ = LINE_START;
+                    } else if (c == ' ' || c == '\t' || c == '\r') {
+                        if (!name_.empty()) {
+                            state_ = HEADER_REST;
+                        }
+                    } else {
+                        name_ += c;
+                    }
+                    continue;
+
+                case HEADER_REST:
+                    if (c == '\n') {
+                        state_ = LINE_START;
+                    }
+                    continue;
+
+                case SEQUENCE:
+                    break;
+            }
+
+            // Hot loop: pack bases until the end of the line
+            for (; p < end; ++p) {
+                uint8_t code = table_[static_cast<uint8_t>(*p)];
+                if (code & SKIP) {
+                    if (*p == '\n') {
+                        state_ = LINE_START;
+                        break;
+                    }
+                    continue;
+                }
+                push_site(code);
+            }
+            if (p == end) {
+                break;
+            }
+        }
+    }
+
+    void feed(std::string_view chunk) { feed(chunk.data(), chunk.size()); }
+
+    // Close the last record and validate the alignment
+    PackedAlignment finish() {
+        end_record();
+
+        if (alignment_.n_sequences() == 0) {
+            throw std::runtime_error("No sequences found in FASTA file");
+        }
+
+        return std::move(alignment_);
+    }
+
+private:
+    void set_base(char upper, uint8_t bits) {
+        uint8_t code = static_cast<uint8_t>(4 | bits);
+        table_[static_cast<uint8_t>(upper)] = code;
+        table_[static_cast<uint8_t>(upper - 'A' + 'a')] = code;
+    }
+
+    void begin_record() {
+        in_record_ = true;
+        name_.clear();
+        current_ = PackedSequence();
+        if (alignment_.n_sequences() > 0) {
+            size_t words = alignment_.n_words();
+            current_.hi.reserve(words);
+            current_.lo.reserve(words);
+            current_.valid.reserve(words);
+        }
+        sites_ = 0;
+        hi_ = lo_ = valid_ = 0;
+    }
+
+    void push_site(uint8_t code) {
+        uint64_t bit = uint64_t(1) << (sites_ & 63);
+        if (code & 1) lo_ |= bit;
+        if (code & 2) hi_ |= bit;
+        if (code & 4) valid_ |= bit;
+
+        if ((++sites_ & 63) == 0) {
+            flush_word();
+        }
+    }
+
+    void flush_word() {
+        current_.hi.push_back(hi_);
+        current_.lo.push_back(lo_);
+        current_.valid.push_back(valid_);
+        hi_ = lo_ = valid_ = 0;
+    }
+
+    void end_record() {
+        if (!in_record_) {
+            return;
+        }
+        in_record_ = false;
+
+        if (sites_ & 63) {
+            flush_word();
+        }
+
+        if (alignment_.n_sequences() == 0) {
+            alignment_.length_ = sites_;
+        } else if (sites_ != alignment_.length_) {
+            throw std::runtime_error(
+                "All sequences must have the same length. Sequence " +
+                name_ + " has length " + std::to_string(sites_) +
+                ", expected " + std::to_string(alignment_.length_)
+            );
+        }
+
+        alignment_.names_.push(name_);
+        alignment_.sequences_.push_back(std::move(current_));
+    }
+};
+
+#ifndef __EMSCRIPTEN__
+// Map an alignment from disk and pack it in one pass
+inline PackedAlignment load_fasta(const std::string& path) {
+    MappedFile file(path);
+    FastaReader reader;
+    reader.feed(file.data(), file.size());
+    return reader.finish();
+}
+#endif
+
+} // namespace grapetree
+
+#endif // GRAPETREE_FASTA_READER_H
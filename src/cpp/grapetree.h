@@ -0,0 +1,174 @@
+/* grapetree.h - C API of libgrapetree
+ * Stable C ABI over the native tree engines for in-process use from
+ * other languages (Python ctypes/cffi, Go cgo, ...)
+ *
+ * Build: make libgrapetree  (build/libgrapetree.so)
+ *
+ * Input is read from caller memory and results are written into caller
+ * buffers; nothing returned by the library needs to be freed except the
+ * session itself. Every call on a session may be made from any thread,
+ * concurrently with other calls on the same or other sessions. Calls
+ * that fail return a status other than GRAPETREE_OK and leave a message
+ * for grapetree_last_error() on the calling thread.
+ */
+
+#ifndef GRAPETREE_C_API_H
+#define GRAPETREE_C_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define GRAPETREE_API __declspec(dllexport)
+#else
+#define GRAPETREE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented on incompatible changes only; additions keep the number */
+#define GRAPETREE_API_VERSION 1
+
+typedef struct grapetree_session grapetree_session;
+
+/* Status codes */
+#define GRAPETREE_OK 0
+#define GRAPETREE_INVALID_ARGUMENT 1
+#define GRAPETREE_PARSE_ERROR 2
+#define GRAPETREE_OUT_OF_MEMORY 3
+#define GRAPETREE_BUFFER_TOO_SMALL 4
+#define GRAPETREE_ERROR 5
+
+/* Input formats for grapetree_session_create() */
+#define GRAPETREE_FORMAT_AUTO 0      /* detected from the first bytes */
+#define GRAPETREE_FORMAT_PROFILES 1  /* delimited, JSON or binary store */
+#define GRAPETREE_FORMAT_FASTA 2     /* aligned FASTA */
+#define GRAPETREE_FORMAT_VCF 3       /* multi-sample VCF */
+
+/* Session flags */
+#define GRAPETREE_BORROW_BUFFER 1u  /* use a binary profile store in place;
+                                       the buffer must outlive the session */
+#define GRAPETREE_PACK_COLUMNS 2u   /* bit-pack allele columns */
+
+/* Tree methods */
+#define GRAPETREE_MSTREE_V2 0
+#define GRAPETREE_MSTREE 1
+
+/* Distance matrices (profiles only; FASTA and VCF have one each) */
+#define GRAPETREE_ASYMMETRIC 0
+#define GRAPETREE_SYMMETRIC 1
+
+/* Missing-data handlers for the symmetric matrix */
+#define GRAPETREE_MISSING_IGNORE 0
+#define GRAPETREE_MISSING_REMOVE_COLUMN 1
+#define GRAPETREE_MISSING_TREAT_AS_ALLELE 2
+#define GRAPETREE_MISSING_ABSOLUTE_DIFF 3
+
+/* MSTree tie-breaking heuristics */
+#define GRAPETREE_HARMONIC 0
+#define GRAPETREE_EBURST 1
+
+typedef int32_t grapetree_status;
+
+/* One tree edge between strain indices; 24 bytes, no padding */
+typedef struct grapetree_edge {
+    uint64_t from;
+    uint64_t to;
+    double distance;
+} grapetree_edge;
+
+/* GRAPETREE_API_VERSION the library was built with */
+GRAPETREE_API int32_t grapetree_api_version(void);
+
+/* Message of the last failed call on this thread, "" if none. Valid
+ * until the next failing call on the same thread. */
+GRAPETREE_API const char* grapetree_last_error(void);
+
+/* Threads used by every session (0 = one per core, the default). Only
+ * takes effect before the first computation in the process. */
+GRAPETREE_API grapetree_status grapetree_set_threads(uint32_t n_threads);
+
+/* Cap on the bytes held by the engines (profile columns, distance
+ * matrices, tree work arrays) across all sessions; 0 = none, the
+ * default. A call that would go over fails with GRAPETREE_OUT_OF_MEMORY
+ * before allocating. */
+GRAPETREE_API grapetree_status grapetree_set_memory_cap(uint64_t bytes);
+
+/* Bytes the engines hold now and at most since the previous call (or
+ * since the library was loaded). Either pointer may be NULL. */
+GRAPETREE_API void grapetree_memory_usage(uint64_t* current, uint64_t* peak);
+
+/* Session over size bytes of input at data. Text input is parsed and
+ * may be freed after the call; a binary profile store is copied unless
+ * GRAPETREE_BORROW_BUFFER is given. missing_tokens is a comma-separated
+ * list of alleles read as missing, or NULL for the defaults. */
+GRAPETREE_API grapetree_status grapetree_session_create(
+    const void* data,
+    size_t size,
+    int32_t format,
+    uint32_t flags,
+    const char* missing_tokens,
+    grapetree_session** session);
+
+/* Frees the session and its cached matrices; NULL is ignored. No other
+ * call may be using the session. */
+GRAPETREE_API void grapetree_session_destroy(grapetree_session* session);
+
+GRAPETREE_API size_t grapetree_session_n_strains(const grapetree_session* session);
+
+/* Loci for profiles, alignment sites for FASTA, kept SNVs for VCF */
+GRAPETREE_API size_t grapetree_session_n_loci(const grapetree_session* session);
+
+/* Name of strain index as length bytes at *name (not NUL-terminated),
+ * valid for the life of the session */
+GRAPETREE_API grapetree_status grapetree_session_strain_name(
+    const grapetree_session* session,
+    size_t index,
+    const char** name,
+    size_t* length);
+
+/* The n x n distance matrix, row-major, into out (capacity doubles,
+ * at least n_strains^2). Computed straight into out unless the session
+ * already holds the matrix from an earlier tree. */
+GRAPETREE_API grapetree_status grapetree_session_distances(
+    grapetree_session* session,
+    int32_t matrix,
+    int32_t missing_handler,
+    double* out,
+    size_t capacity);
+
+/* Tree edges into edges (capacity entries; n_strains always suffice).
+ * *n_edges receives the edge count, or the count needed when the status
+ * is GRAPETREE_BUFFER_TOO_SMALL. The session keeps the distance matrix
+ * for later trees until grapetree_session_release() is called. */
+GRAPETREE_API grapetree_status grapetree_session_tree(
+    grapetree_session* session,
+    int32_t method,
+    int32_t matrix,
+    int32_t missing_handler,
+    int32_t heuristic,
+    grapetree_edge* edges,
+    size_t capacity,
+    size_t* n_edges);
+
+/* Drops the session's cached distance matrices */
+GRAPETREE_API void grapetree_session_release(grapetree_session* session);
+
+/* Tree over a caller-owned n x n row-major distance matrix, read in
+ * place. Edges as for grapetree_session_tree(). */
+GRAPETREE_API grapetree_status grapetree_tree_from_distances(
+    const double* distances,
+    size_t n,
+    int32_t method,
+    int32_t heuristic,
+    grapetree_edge* edges,
+    size_t capacity,
+    size_t* n_edges);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAPETREE_C_API_H */
@@ -0,0 +1,131 @@
+// job.cpp - Resumable distance computation
+// Splits the quadratic distance work into bounded slices so callers can
+// report progress between them, stay responsive, and stop early
+
+#ifndef GRAPETREE_JOB_H
+#define GRAPETREE_JOB_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "profile_store.cpp"
+#include "distance.cpp"
+#include "matrix.cpp"
+#include "cancel.cpp"
+
+namespace grapetree {
+
+struct JobProgress {
+    std::string stage;
+    double fraction = 0.0;         // of the whole job
+    uint64_t pairs_done = 0;
+    uint64_t pairs_total = 0;
+    double pairs_per_second = 0.0; // over time spent computing
+};
+
+// Profile distance matrix filled a few rows per step(). Rows are whole
+// units of work, so a step may overshoot its pair budget by one row.
+class DistanceJob {
+private:
+    DistanceMatrix engine_;
+    DenseMatrix matrix_;
+    bool asymmetric_;
+    DistanceMatrix::MissingHandler handler_;
+    std::vector<uint32_t> missing_;
+    size_t n_;
+    size_t next_row_ = 0;
+    uint64_t pairs_done_ = 0;
+    uint64_t pairs_total_;
+    double seconds_ = 0.0;
+
+public:
+    DistanceJob(
+        const ProfileStore& profiles,
+        bool asymmetric,
+        DistanceMatrix::MissingHandler handler
+    ) : engine_(profiles),
+        matrix_(profiles.n_strains()),
+        asymmetric_(asymmetric),
+        handler_(handler),
+        n_(profiles.n_strains()),
+        pairs_total_(n_ < 2 ? 0 : uint64_t(n_) * (n_ - 1) / 2) {
+        if (asymmetric_) {
+            missing_ = engine_.count_missing();
+        }
+    }
+
+    bool done() const { return next_row_ >= n_; }
+
+    // Compute rows until about max_pairs pairs are done; true when finished
+    bool step(uint64_t max_pairs) {
+        auto start = std::chrono::steady_clock::now();
+
+        size_t end = next_row_;
+        uint64_t pairs = 0;
+        while (end < n_ && (pairs == 0 || pairs < max_pairs)) {
+            pairs += n_ - end - 1;
+            ++end;
+        }
+
+        if (asymmetric_) {
+            engine_.fill_asymmetric_rows(matrix_, next_row_, end, missing_);
+        } else {
+            engine_.fill_symmetric_rows(matrix_, next_row_, end, handler_);
+        }
+        next_row_ = end;
+        pairs_done_ += pairs;
+
+        seconds_ += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+        return done();
+    }
+
+    JobProgress progress() const {
+        JobProgress p;
+        p.stage = "distances";
+        p.pairs_done = pairs_done_;
+        p.pairs_total = pairs_total_;
+        p.fraction = pairs_total_ == 0 ? 1.0 :
+            static_cast<double>(pairs_done_) / static_cast<double>(pairs_total_);
+        p.pairs_per_second = seconds_ > 0.0 ?
+            static_cast<double>(pairs_done_) / seconds_ : 0.0;
+        return p;
+    }
+
+    // The finished matrix; the job is spent afterwards
+    DenseMatrix take() {
+        if (!done()) {
+            throw std::logic_error("Distance job has not finished");
+        }
+        return std::move(matrix_);
+    }
+};
+
+// Drive a job to completion in slices, calling on_progress(JobProgress)
+// after each. Throws CancelledError once token is set; work done so far
+// stays in the job, so a later call resumes where this one stopped.
+template <typename OnProgress>
+DenseMatrix run_distance_job(
+    DistanceJob& job,
+    const CancelToken& token,
+    OnProgress&& on_progress,
+    uint64_t slice_pairs = uint64_t(1) << 20
+) {
+    while (!job.done()) {
+        if (token.cancelled()) {
+            throw CancelledError();
+        }
+        job.step(slice_pairs);
+        on_progress(job.progress());
+    }
+    return job.take();
+}
+
+} // namespace grapetree
+
+#endif // GRAPETREE_JOB_H
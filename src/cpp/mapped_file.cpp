@@ -0,0 +1,113 @@
+// mapped_file.cpp - Read-only memory-mapped input files (native builds)
+// Lets the readers scan multi-GB inputs without copying them into memory
+
+#ifndef GRAPETREE_MAPPED_FILE_H
+#define GRAPETREE_MAPPED_FILE_H
+
+#ifndef __EMSCRIPTEN__
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace grapetree {
+
+class MappedFile {
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(
+                "Cannot open " + path + ": " + std::strerror(errno)
+            );
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            throw std::runtime_error(
+                "Cannot stat " + path + ": " + std::strerror(err)
+            );
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                int err = errno;
+                ::close(fd);
+                throw std::runtime_error(
+                    "Cannot map " + path + ": " + std::strerror(err)
+                );
+            }
+            // Input is scanned front to back exactly once
+            ::madvise(p, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(p);
+        }
+
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)) {}
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// Write path through path + ".tmp", renamed over it once complete.
+// Mappings of the old file keep its pages; rewriting it in place would
+// truncate them under a MappedFile (the daemon's loaded stores) and
+// fault its next read with SIGBUS. write(FILE*) returns false on error.
+template <typename Write>
+void replace_file(const std::string& path, Write&& write) {
+    std::string tmp = path + ".tmp";
+    std::FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error(
+            "Cannot write " + path + ": " + std::strerror(errno)
+        );
+    }
+    bool ok = false;
+    try {
+        ok = write(f);
+    } catch (...) {
+        std::fclose(f);
+        std::remove(tmp.c_str());
+        throw;
+    }
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Error writing " + path);
+    }
+}
+
+} // namespace grapetree
+
+#endif // __EMSCRIPTEN__
+
+#endif // GRAPETREE_MAPPED_FILE_H
@@ -0,0 +1,267 @@
+// matrix.cpp - Distance matrix storage
+// One contiguous n x n buffer shared by reference across the pipeline,
+// plus compact layouts for inputs whose dense matrix will not fit
+
+#ifndef GRAPETREE_MATRIX_H
+#define GRAPETREE_MATRIX_H
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#include "memory.cpp"
+
+namespace grapetree {
+
+// Node indices are size_t throughout the engines: n^2 index math must
+// not wrap, and the Memory64 build can hold matrices past 4 GB
+constexpr size_t NO_NODE = SIZE_MAX;
+
+// Position of pair (i, j), j < i, in a condensed lower triangle stored
+// row by row (row i holds i entries)
+inline size_t condensed_index(size_t i, size_t j) {
+    return i * (i - 1) / 2 + j;
+}
+
+// Row-major n x n matrix of doubles. Copying is disabled so the matrix
+// can only be moved or passed by reference: the pipeline holds exactly
+// one n^2 buffer however many stages read it. A view() wraps a buffer
+// owned by someone else (a caller of the C API) instead. The buffer is
+// charged to the matrix stage unless the caller names another (the tree
+// engines' contracted matrices).
+class DenseMatrix {
+private:
+    size_t n_ = 0;
+    TrackedVector<double> values_ =  // empty for a view
+        tracked_vector<double>(MemoryStage::matrix);
+    double* data_ = nullptr;
+
+public:
+    DenseMatrix() = default;
+
+    explicit DenseMatrix(
+        size_t n,
+        double fill = 0.0,
+        MemoryStage stage = MemoryStage::matrix
+    ) : n_(n), values_(allocate(n, fill, stage)), data_(values_.data()) {}
+
+    DenseMatrix(DenseMatrix&& other) noexcept
+        : n_(std::exchange(other.n_, 0)),
+          values_(std::move(other.values_)),
+          data_(std::exchange(other.data_, nullptr)) {}
+
+    DenseMatrix& operator=(DenseMatrix&& other) noexcept {
+        n_ = std::exchange(other.n_, 0);
+        values_ = std::move(other.values_);
+        data_ = std::exchange(other.data_, nullptr);
+        return *this;
+    }
+
+    DenseMatrix(const DenseMatrix&) = delete;
+    DenseMatrix& operator=(const DenseMatrix&) = delete;
+
+    // n x n doubles at data, which must outlive the matrix. Cells are
+    // left as they are.
+    static DenseMatrix view(double* data, size_t n) {
+        DenseMatrix matrix;
+        matrix.n_ = n;
+        matrix.data_ = data;
+        return matrix;
+    }
+
+    size_t size() const { return n_; }
+
+    double& operator()(size_t i, size_t j) { return data_[i * n_ + j]; }
+    double operator()(size_t i, size_t j) const { return data_[i * n_ + j]; }
+
+    double* row(size_t i) { return data_ + i * n_; }
+    const double* row(size_t i) const { return data_ + i * n_; }
+
+private:
+    // n x n doubles, or an error that says why they cannot exist. A
+    // 32-bit wasm build runs out of address space near 23k strains.
+    static TrackedVector<double> allocate(size_t n, double fill, MemoryStage stage) {
+        bool too_large = n != 0 && n > SIZE_MAX / sizeof(double) / n;
+        std::string cap_error;
+        if (!too_large) {
+            try {
+                return tracked_vector<double>(stage, n * n, fill);
+            } catch (const MemoryCapError& e) {
+                cap_error = e.what();
+            } catch (const std::bad_alloc&) {
+            }
+        }
+
+        double bytes = static_cast<double>(n) * static_cast<double>(n) * sizeof(double);
+        std::string message =
+            "Cannot allocate a " + std::to_string(n) + " x " +
+            std::to_string(n) + " distance matrix (" +
+            format_bytes(static_cast<uint64_t>(std::min(bytes, 1e19))) + ")";
+        if (!cap_error.empty()) {
+            message += ": " + cap_error;
+        } else if (sizeof(size_t) < 8) {
+            message += "; this exceeds the 4 GB a 32-bit WebAssembly build "
+                       "can address, use the Memory64 build (grapetree-64.js)";
+        }
+        throw std::length_error(message);
+    }
+};
+
+// Allelic difference counts as uint16_t in a condensed lower triangle,
+// with an optional per-row offset added on read (0.5 x missing loci for
+// the asymmetric matrix). An eighth of a DenseMatrix: half the cells at
+// a quarter of the width. Valid while counts fit, i.e. up to MAX_COUNT
+// loci.
+class CondensedMatrix16 {
+public:
+    static constexpr size_t MAX_COUNT = UINT16_MAX;
+
+private:
+    size_t n_ = 0;
+    TrackedVector<uint16_t> counts_ = tracked_vector<uint16_t>(MemoryStage::matrix);
+    std::vector<double> offset_;  // empty, or one per row
+
+public:
+    CondensedMatrix16() = default;
+
+    explicit CondensedMatrix16(size_t n, std::vector<double> offset = {})
+        : n_(n),
+          counts_(tracked_vector<uint16_t>(
+              MemoryStage::matrix, n < 2 ? 0 : condensed_index(n, 0))),
+          offset_(std::move(offset)) {}
+
+    CondensedMatrix16(CondensedMatrix16&&) noexcept = default;
+    CondensedMatrix16& operator=(CondensedMatrix16&&) noexcept = default;
+    CondensedMatrix16(const CondensedMatrix16&) = delete;
+    CondensedMatrix16& operator=(const CondensedMatrix16&) = delete;
+
+    size_t size() const { return n_; }
+
+    // Pair (i, j), j < i
+    void set(size_t i, size_t j, uint32_t count) {
+        counts_[condensed_index(i, j)] = static_cast<uint16_t>(count);
+    }
+
+    double operator()(size_t i, size_t j) const {
+        if (i == j) {
+            return 0.0;
+        }
+        double count = counts_[i > j ? condensed_index(i, j) : condensed_index(j, i)];
+        return offset_.empty() ? count : count + offset_[i];
+    }
+
+    static size_t memory_bytes(size_t n, bool offsets) {
+        return (n < 2 ? 0 : condensed_index(n, 0)) * sizeof(uint16_t) +
+               (offsets ? n * sizeof(double) : 0);
+    }
+};
+
+// Only the pairs within a distance threshold, as sorted per-row
+// (column, count) lists; every other pair reads as threshold + 1. Trees
+// are exact wherever the near pairs connect the strains; groups with no
+// pair inside the threshold are joined by edges of length threshold + 1.
+class SparseMatrix {
+public:
+    // Bytes per stored pair at the peak of building: collected once
+    // (with up to 2x vector slack), then kept in both rows as column +
+    // count
+    static constexpr size_t BYTES_PER_PAIR =
+        2 * sizeof(std::pair<uint32_t, uint32_t>) + 2 * 2 * sizeof(uint32_t);
+
+private:
+    size_t n_ = 0;
+    double far_ = 0.0;
+    std::vector<size_t> row_start_;  // n + 1 entries
+    TrackedVector<uint32_t> columns_ = tracked_vector<uint32_t>(MemoryStage::matrix);
+    TrackedVector<uint32_t> counts_ = tracked_vector<uint32_t>(MemoryStage::matrix);
+    std::vector<double> offset_;     // empty, or one per row
+
+public:
+    SparseMatrix() = default;
+
+    // near[i] lists the pairs (j, count), j > i, within threshold
+    SparseMatrix(
+        size_t n,
+        uint32_t threshold,
+        const std::vector<std::vector<std::pair<uint32_t, uint32_t>>>& near,
+        std::vector<double> offset = {}
+    ) : n_(n),
+        far_(static_cast<double>(threshold) + 1.0),
+        row_start_(n + 1, 0),
+        offset_(std::move(offset)) {
+        for (size_t i = 0; i < near.size(); ++i) {
+            row_start_[i + 1] += near[i].size();
+            for (const auto& pair : near[i]) {
+                ++row_start_[pair.first + 1];
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            row_start_[i + 1] += row_start_[i];
+        }
+
+        // Rows fill in ascending column order: first the mirrored pairs
+        // from earlier rows (visited in row order), then the row's own
+        columns_.resize(row_start_[n]);
+        counts_.resize(row_start_[n]);
+        std::vector<size_t> fill(row_start_.begin(), row_start_.end() - 1);
+        for (size_t i = 0; i < near.size(); ++i) {
+            for (const auto& pair : near[i]) {
+                size_t k = fill[pair.first]++;
+                columns_[k] = static_cast<uint32_t>(i);
+                counts_[k] = pair.second;
+            }
+        }
+        for (size_t i = 0; i < near.size(); ++i) {
+            for (const auto& pair : near[i]) {
+                size_t k = fill[i]++;
+                columns_[k] = pair.first;
+                counts_[k] = pair.second;
+            }
+        }
+    }
+
+    SparseMatrix(SparseMatrix&&) noexcept = default;
+    SparseMatrix& operator=(SparseMatrix&&) noexcept = default;
+    SparseMatrix(const SparseMatrix&) = delete;
+    SparseMatrix& operator=(const SparseMatrix&) = delete;
+
+    size_t size() const { return n_; }
+    size_t n_pairs() const { return columns_.size() / 2; }
+
+    double operator()(size_t i, size_t j) const {
+        if (i == j) {
+            return 0.0;
+        }
+        const uint32_t* begin = columns_.data() + row_start_[i];
+        const uint32_t* end = columns_.data() + row_start_[i + 1];
+        const uint32_t* it = std::lower_bound(begin, end, static_cast<uint32_t>(j));
+        double count = (it != end && *it == j) ? counts_[it - columns_.data()] : far_;
+        return offset_.empty() ? count : count + offset_[i];
+    }
+};
+
+// Storages whose reads touch no mutable state, so the tree engines may
+// scan them from several threads at once. Caching storages (LazyMatrix,
+// ContractedMatrix) are scanned on the calling thread.
+template <typename Matrix>
+struct ConcurrentReads : std::false_type {};
+
+template <> struct ConcurrentReads<DenseMatrix> : std::true_type {};
+template <> struct ConcurrentReads<CondensedMatrix16> : std::true_type {};
+template <> struct ConcurrentReads<SparseMatrix> : std::true_type {};
+
+// Overloaded by storages that only know at run time
+template <typename Matrix>
+bool concurrent_reads(const Matrix&) {
+    return ConcurrentReads<Matrix>::value;
+}
+
+} // namespace grapetree
+
+#endif // GRAPETREE_MATRIX_H
@@ -0,0 +1,238 @@
+// memory.cpp - Byte accounting of the engines' large buffers
+// Profile columns, allele tables, distance matrices and tree work arrays
+// allocate through TrackedAllocator, which charges every block to the
+// pipeline stage that owns it. MemoryAccount keeps current and peak bytes
+// per stage and in total, and enforces an optional hard cap: an
+// allocation that would cross it throws MemoryCapError (a
+// std::length_error) before anything is requested from the system, so a
+// browser run fails with a message instead of an out-of-memory abort.
+//
+// Only tracked buffers count. They are the ones that grow with the data
+// (n x loci, n^2); small strings and JSON values are left out.
+
+#ifndef GRAPETREE_MEMORY_H
+#define GRAPETREE_MEMORY_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+namespace grapetree {
+
+enum class MemoryStage : uint8_t {
+    parse = 0,   // input text and allele hash tables
+    encode = 1,  // coded profiles: columns, allele strings, strain names
+    matrix = 2,  // distance matrices
+    tree = 3,    // tree work arrays and contracted matrices
+    output = 4   // response text
+};
+
+constexpr size_t MEMORY_STAGES = 5;
+
+inline const char* memory_stage_name(MemoryStage stage) {
+    static const char* const names[MEMORY_STAGES] = {
+        "parse", "encode", "matrix", "tree", "output"
+    };
+    return names[static_cast<size_t>(stage)];
+}
+
+// "512 B", "3.2 MB", "1.5 GB"
+inline std::string format_bytes(uint64_t bytes) {
+    static const char* const units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+        value /= 1024.0;
+        ++unit;
+    }
+    char text[32];
+    if (unit == 0) {
+        std::snprintf(text, sizeof(text), "%llu B", static_cast<unsigned long long>(bytes));
+    } else {
+        std::snprintf(text, sizeof(text), "%.1f %s", value, units[unit]);
+    }
+    return text;
+}
+
+class MemoryCapError : public std::length_error {
+public:
+    MemoryCapError(MemoryStage stage, uint64_t bytes, uint64_t in_use, uint64_t cap)
+        : std::length_error(
+              "Memory cap exceeded: the " + std::string(memory_stage_name(stage)) +
+              " stage needs " + format_bytes(bytes) + " more with " +
+              format_bytes(in_use) + " in use, over the " + format_bytes(cap) +
+              " cap"
+          ) {}
+};
+
+class MemoryAccount {
+private:
+    struct Counter {
+        std::atomic<uint64_t> current{0};
+        std::atomic<uint64_t> peak{0};
+
+        void raise_peak(uint64_t value) {
+            uint64_t peak_now = peak.load(std::memory_order_relaxed);
+            while (value > peak_now &&
+                   !peak.compare_exchange_weak(peak_now, value, std::memory_order_relaxed)) {
+            }
+        }
+    };
+
+    Counter stages_[MEMORY_STAGES];
+    Counter total_;
+    std::atomic<uint64_t> cap_{0};  // 0 = no cap
+
+public:
+    static MemoryAccount& instance() {
+        static MemoryAccount account;
+        return account;
+    }
+
+    // Count bytes against stage, or throw MemoryCapError if they would
+    // take the total over the cap
+    void charge(MemoryStage stage, uint64_t bytes) {
+        uint64_t total = total_.current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        uint64_t cap = cap_.load(std::memory_order_relaxed);
+        if (cap != 0 && total > cap) {
+            total_.current.fetch_sub(bytes, std::memory_order_relaxed);
+            throw MemoryCapError(stage, bytes, total - bytes, cap);
+        }
+        total_.raise_peak(total);
+        Counter& counter = stages_[static_cast<size_t>(stage)];
+        counter.raise_peak(counter.current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    }
+
+    void release(MemoryStage stage, uint64_t bytes) noexcept {
+        stages_[static_cast<size_t>(stage)].current.fetch_sub(bytes, std::memory_order_relaxed);
+        total_.current.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    void set_cap(uint64_t bytes) { cap_.store(bytes, std::memory_order_relaxed); }
+    uint64_t cap() const { return cap_.load(std::memory_order_relaxed); }
+
+    uint64_t current() const { return total_.current.load(std::memory_order_relaxed); }
+    uint64_t peak() const { return total_.peak.load(std::memory_order_relaxed); }
+
+    uint64_t current(MemoryStage stage) const {
+        return stages_[static_cast<size_t>(stage)].current.load(std::memory_order_relaxed);
+    }
+    uint64_t peak(MemoryStage stage) const {
+        return stages_[static_cast<size_t>(stage)].peak.load(std::memory_order_relaxed);
+    }
+
+    // Start measuring peaks from here: each peak drops to its current
+    // value. Called at the start of a request or benchmark stage.
+    void reset_peaks() {
+        for (Counter& counter : stages_) {
+            counter.peak.store(counter.current.load(std::memory_order_relaxed),
+                               std::memory_order_relaxed);
+        }
+        total_.peak.store(total_.current.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    }
+};
+
+// std::allocator that charges its blocks to a stage. The stage travels
+// with the container on move and swap, so a block is always released
+// against the stage it was charged to; any two instances may free each
+// other's blocks.
+template <typename T>
+class TrackedAllocator {
+private:
+    MemoryStage stage_;
+
+    template <typename U>
+    friend class TrackedAllocator;
+
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    explicit TrackedAllocator(MemoryStage stage) noexcept : stage_(stage) {}
+
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U>& other) noexcept : stage_(other.stage_) {}
+
+    MemoryStage stage() const { return stage_; }
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        uint64_t bytes = n * sizeof(T);
+        MemoryAccount::instance().charge(stage_, bytes);
+        try {
+            return std::allocator<T>().allocate(n);
+        } catch (...) {
+            MemoryAccount::instance().release(stage_, bytes);
+            throw;
+        }
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        std::allocator<T>().deallocate(p, n);
+        MemoryAccount::instance().release(stage_, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const TrackedAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const TrackedAllocator<U>&) const noexcept { return false; }
+};
+
+template <typename T>
+using TrackedVector = std::vector<T, TrackedAllocator<T>>;
+
+// Empty vector charging stage
+template <typename T>
+TrackedVector<T> tracked_vector(MemoryStage stage) {
+    return TrackedVector<T>(TrackedAllocator<T>(stage));
+}
+
+// n copies of value charging stage
+template <typename T>
+TrackedVector<T> tracked_vector(MemoryStage stage, size_t n, const T& value = T()) {
+    return TrackedVector<T>(n, value, TrackedAllocator<T>(stage));
+}
+
+// Bytes held outside a TrackedVector (e.g. a response string being
+// built), charged for the lifetime of the object
+class MemoryCharge {
+private:
+    MemoryStage stage_;
+    uint64_t bytes_ = 0;
+
+public:
+    MemoryCharge(MemoryStage stage, uint64_t bytes) : stage_(stage) {
+        resize(bytes);
+    }
+
+    ~MemoryCharge() { MemoryAccount::instance().release(stage_, bytes_); }
+
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+    // Charge bytes instead of what was charged before
+    void resize(uint64_t bytes) {
+        if (bytes > bytes_) {
+            MemoryAccount::instance().charge(stage_, bytes - bytes_);
+        } else {
+            MemoryAccount::instance().release(stage_, bytes_ - bytes);
+        }
+        bytes_ = bytes;
+    }
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_MEMORY_H
@@ -9,109 +9,242 @@
 #include <limits>
 #include <algorithm>
 #include <map>
+#include <stdexcept>
+#include <cstdint>
+
+#include "matrix.cpp"
+#include "memory.cpp"
+#include "cancel.cpp"
+#include "thread_pool.cpp"
+#include "trace.cpp"
 
 namespace grapetree {
 
 struct Edge {
-    int from;
-    int to;
+    size_t from;
+    size_t to;
     double distance;
     
-    Edge(int f, int t, double d) : from(f), to(t), distance(d) {}
+    Edge(size_t f, size_t t, double d) : from(f), to(t), distance(d) {}
+};
+
+// Work done by one tree build, counted by the engines as they go (a few
+// increments per node, so always on) and reported in run profiles
+struct TreeCounters {
+    uint64_t tie_breaks = 0;              // choices among equally near nodes
+    uint64_t cycles_contracted = 0;       // Edmonds cycles, all levels
+    uint64_t contraction_depth = 0;       // deepest nested contraction
+    uint64_t recraft_swaps_tried = 0;
+    uint64_t recraft_swaps_accepted = 0;
+    
+    // Fold in the counts of a nested solve one level down
+    void add_nested(const TreeCounters& nested) {
+        tie_breaks += nested.tie_breaks;
+        cycles_contracted += nested.cycles_contracted;
+        contraction_depth = std::max(contraction_depth, nested.contraction_depth + 1);
+        recraft_swaps_tried += nested.recraft_swaps_tried;
+        recraft_swaps_accepted += nested.recraft_swaps_accepted;
+    }
 };
 
-class MSTree {
+// Tiebreak heuristics, shared by every BasicMSTree instantiation
+class MSTreeBase {
 public:
     enum Heuristic {
         EBURST,
         HARMONIC
     };
-    
+};
+
+// Prim's algorithm over any matrix type providing size() and
+// operator()(i, j): DenseMatrix, or the compact and on-demand storages
+// the memory planner (plan.cpp) picks for large inputs
+template <typename Matrix>
+class BasicMSTree : public MSTreeBase {
 private:
-    int n_nodes_;
-    std::vector<std::vector<double>> distance_matrix_;
+    const Matrix& distance_matrix_;
     Heuristic heuristic_;
+    size_t n_nodes_;
+    std::vector<double> harmonic_;  // memoised scores, -1 = not yet computed
+    TreeCounters counters_;
+    const CancelToken* cancel_ = nullptr;
+    
+    // Prim's state between step() calls
+    TrackedVector<bool> in_tree_ = tracked_vector<bool>(MemoryStage::tree);
+    TrackedVector<double> min_distance_ = tracked_vector<double>(MemoryStage::tree);
+    TrackedVector<size_t> parent_ = tracked_vector<size_t>(MemoryStage::tree);
+    std::vector<Edge> tree_edges_;
+    size_t count_ = 0;  // nodes in the tree
+    
+    std::vector<double> range_min_;  // per scan range
+    
+    static constexpr size_t PRIM_TRACE_BATCH = 1024;
+    
+    // The per-node scans run on the shared pool, in ranges of SCAN_GRAIN
+    // nodes, once a row outweighs a batch's hand-off
+    static constexpr size_t PARALLEL_MIN_NODES = 8192;
+    static constexpr size_t SCAN_GRAIN = 2048;
     
 public:
-    MSTree(
-        const std::vector<std::vector<double>>& distances,
+    BasicMSTree(
+        const Matrix& distances,
         Heuristic heuristic = EBURST
     ) : distance_matrix_(distances),
         heuristic_(heuristic),
         n_nodes_(distances.size()) {}
     
+    // Checked once per node added; a set token makes step() and
+    // compute() throw CancelledError, keeping the nodes added so far
+    void set_cancel_token(const CancelToken* token) { cancel_ = token; }
+    
     std::vector<Edge> compute() {
-        std::vector<Edge> tree_edges;
-        tree_edges.reserve(n_nodes_ - 1);
-        
-        std::vector<bool> in_tree(n_nodes_, false);
-        std::vector<double> min_distance(n_nodes_, 
-                                         std::numeric_limits<double>::max());
-        std::vector<int> parent(n_nodes_, -1);
-        
-        // Start with node 0 (arbitrary choice)
-        int start_node = 0;
-        in_tree[start_node] = true;
-        min_distance[start_node] = 0.0;
-        
-        // Initialize distances from start node
-        for (int i = 0; i < n_nodes_; ++i) {
-            if (i != start_node) {
-                min_distance[i] = distance_matrix_[start_node][i];
-                parent[i] = start_node;
-            }
+        GRAPETREE_SPAN_ARG("tree", "MSTree", "nodes", n_nodes_);
+        while (!step(n_nodes_)) {
+        }
+        return take();
+    }
+    
+    bool done() const { return n_nodes_ == 0 || count_ == n_nodes_; }
+    
+    // Add up to max_nodes nodes to the tree (at least one); true once it
+    // spans every node. Each node costs a few passes over one row.
+    bool step(size_t max_nodes) {
+        if (done()) {
+            return true;
+        }
+        if (count_ == 0) {
+            start();
         }
         
-        // Build tree: add n-1 edges
-        for (int count = 1; count < n_nodes_; ++count) {
-            // Find minimum distance node not yet in tree
-            double min_dist = std::numeric_limits<double>::max();
-            
-            for (int i = 0; i < n_nodes_; ++i) {
-                if (!in_tree[i] && min_distance[i] < min_dist) {
-                    min_dist = min_distance[i];
-                }
+        // Add edges, traced in batches of iterations
+        GRAPETREE_SPAN_VAR(batch_span, "tree", "Prim iterations", "first", count_);
+        size_t end = count_ + std::min(std::max<size_t>(1, max_nodes), n_nodes_ - count_);
+        for (; count_ < end; ++count_) {
+            GRAPETREE_SPAN_EVERY(batch_span, PRIM_TRACE_BATCH, count_);
+            if (cancel_ && cancel_->cancelled()) {
+                throw CancelledError();
             }
             
+            // Find minimum distance node not yet in tree
+            double min_dist = min_remaining_distance();
+            
             // Apply tiebreaking heuristic
-            int min_node = select_node_with_tiebreak(
-                min_distance,
-                in_tree,
+            size_t min_node = select_node_with_tiebreak(
+                min_distance_,
+                in_tree_,
                 min_dist
             );
             
             // Add edge to tree
-            in_tree[min_node] = true;
-            tree_edges.emplace_back(
-                parent[min_node],
+            in_tree_[min_node] = true;
+            tree_edges_.emplace_back(
+                parent_[min_node],
                 min_node,
                 min_dist
             );
             
-            // Update distances to remaining nodes
-            for (int i = 0; i < n_nodes_; ++i) {
-                if (!in_tree[i]) {
-                    double new_dist = distance_matrix_[min_node][i];
-                    if (new_dist < min_distance[i]) {
-                        min_distance[i] = new_dist;
-                        parent[i] = min_node;
-                    }
+            update_distances(min_node);
+        }
+        return done();
+    }
+    
+    // Nodes in the tree so far, of size()
+    size_t nodes_done() const { return count_; }
+    size_t size() const { return n_nodes_; }
+    
+    // The finished edges; the engine is spent afterwards
+    std::vector<Edge> take() {
+        if (!done()) {
+            throw std::logic_error("Tree has not been finished");
+        }
+        in_tree_ = tracked_vector<bool>(MemoryStage::tree);
+        min_distance_ = tracked_vector<double>(MemoryStage::tree);
+        parent_ = tracked_vector<size_t>(MemoryStage::tree);
+        return std::move(tree_edges_);
+    }
+    
+    const TreeCounters& counters() const { return counters_; }
+    
+private:
+    // Start with node 0 (arbitrary choice)
+    void start() {
+        tree_edges_.reserve(n_nodes_ - 1);
+        in_tree_.assign(n_nodes_, false);
+        min_distance_.assign(n_nodes_, std::numeric_limits<double>::max());
+        parent_.assign(n_nodes_, NO_NODE);
+        
+        size_t start_node = 0;
+        in_tree_[start_node] = true;
+        min_distance_[start_node] = 0.0;
+        
+        // Initialize distances from start node
+        for (size_t i = 0; i < n_nodes_; ++i) {
+            if (i != start_node) {
+                min_distance_[i] = distance_matrix_(start_node, i);
+                parent_[i] = start_node;
+            }
+        }
+        count_ = 1;
+    }
+    
+    bool parallel_scans() const {
+        return n_nodes_ >= PARALLEL_MIN_NODES && ThreadPool::shared().size() > 1 &&
+               concurrent_reads(distance_matrix_);
+    }
+    
+    // Smallest distance from the tree to a node outside it; ranges are
+    // reduced in order, so the result does not depend on the pool
+    double min_remaining_distance() {
+        auto scan = [this](size_t begin, size_t end) {
+            double min_dist = std::numeric_limits<double>::max();
+            for (size_t i = begin; i < end; ++i) {
+                if (!in_tree_[i] && min_distance_[i] < min_dist) {
+                    min_dist = min_distance_[i];
                 }
             }
+            return min_dist;
+        };
+        if (!parallel_scans()) {
+            return scan(0, n_nodes_);
         }
         
-        return tree_edges;
+        range_min_.assign((n_nodes_ + SCAN_GRAIN - 1) / SCAN_GRAIN, 0.0);
+        ThreadPool::shared().parallel_for(range_min_.size(), [&](size_t first, size_t last) {
+            for (size_t r = first; r < last; ++r) {
+                range_min_[r] = scan(r * SCAN_GRAIN, std::min(n_nodes_, (r + 1) * SCAN_GRAIN));
+            }
+        });
+        return *std::min_element(range_min_.begin(), range_min_.end());
     }
     
-private:
-    int select_node_with_tiebreak(
-        const std::vector<double>& distances,
-        const std::vector<bool>& in_tree,
+    // Update distances to remaining nodes through the node just added
+    void update_distances(size_t added) {
+        auto update = [this, added](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (!in_tree_[i]) {
+                    double new_dist = distance_matrix_(added, i);
+                    if (new_dist < min_distance_[i]) {
+                        min_distance_[i] = new_dist;
+                        parent_[i] = added;
+                    }
+                }
+            }
+        };
+        if (!parallel_scans()) {
+            update(0, n_nodes_);
+            return;
+        }
+        ThreadPool::shared().parallel_for(n_nodes_, update, SCAN_GRAIN);
+    }
+    
+    size_t select_node_with_tiebreak(
+        const TrackedVector<double>& distances,
+        const TrackedVector<bool>& in_tree,
         double min_dist
     ) {
         // Collect all nodes at minimum distance
-        std::vector<int> candidates;
-        for (int i = 0; i < n_nodes_; ++i) {
+        std::vector<size_t> candidates;
+        for (size_t i = 0; i < n_nodes_; ++i) {
             if (!in_tree[i] && 
                 std::abs(distances[i] - min_dist) < 1e-10) {
                 candidates.push_back(i);
@@ -123,6 +256,7 @@ private:
         }
         
         // Apply heuristic for tiebreaking
+        counters_.tie_breaks++;
         if (heuristic_ == EBURST) {
             return apply_eburst_tiebreak(candidates, in_tree, min_dist);
         } else {
@@ -131,21 +265,21 @@ private:
     }
     
     // eBurst: select node with most connections at min_dist
-    int apply_eburst_tiebreak(
-        const std::vector<int>& candidates,
-        const std::vector<bool>& in_tree,
+    size_t apply_eburst_tiebreak(
+        const std::vector<size_t>& candidates,
+        const TrackedVector<bool>& in_tree,
         double min_dist
     ) {
-        int best_node = candidates[0];
-        int max_connections = 0;
+        size_t best_node = candidates[0];
+        size_t max_connections = 0;
         
-        for (int node : candidates) {
-            int connections = 0;
+        for (size_t node : candidates) {
+            size_t connections = 0;
             
             // Count connections to nodes already in tree
-            for (int j = 0; j < n_nodes_; ++j) {
+            for (size_t j = 0; j < n_nodes_; ++j) {
                 if (in_tree[j] && 
-                    std::abs(distance_matrix_[node][j] - min_dist) < 1e-10) {
+                    std::abs(distance_matrix_(node, j) - min_dist) < 1e-10) {
                     connections++;
                 }
             }
@@ -165,13 +299,13 @@ private:
     }
     
     // Harmonic mean: prefer nodes with smaller average distance
-    int apply_harmonic_tiebreak(
-        const std::vector<int>& candidates
+    size_t apply_harmonic_tiebreak(
+        const std::vector<size_t>& candidates
     ) {
-        int best_node = candidates[0];
+        size_t best_node = candidates[0];
         double best_score = -1.0;
         
-        for (int node : candidates) {
+        for (size_t node : candidates) {
             double score = compute_harmonic_mean_score(node);
             
             if (score > best_score) {
@@ -188,14 +322,26 @@ private:
         return best_node;
     }
     
-    double compute_harmonic_mean_score(int node) {
+    // Scores depend only on the matrix, so each row is scanned at most
+    // once however often its node ties
+    double compute_harmonic_mean_score(size_t node) {
+        if (harmonic_.empty()) {
+            harmonic_.assign(n_nodes_, -1.0);
+        }
+        if (harmonic_[node] < 0.0) {
+            harmonic_[node] = harmonic_mean(node);
+        }
+        return harmonic_[node];
+    }
+    
+    double harmonic_mean(size_t node) const {
         double sum_reciprocals = 0.0;
-        int count = 0;
+        size_t count = 0;
         
-        for (int i = 0; i < n_nodes_; ++i) {
+        for (size_t i = 0; i < n_nodes_; ++i) {
             if (i == node) continue;
             
-            double dist = distance_matrix_[node][i];
+            double dist = distance_matrix_(node, i);
             if (dist > 0.0) {
                 sum_reciprocals += 1.0 / dist;
                 count++;
@@ -211,6 +357,8 @@ private:
     }
 };
 
+using MSTree = BasicMSTree<DenseMatrix>;
+
 } // namespace grapetree
 
 #endif // GRAPETREE_MSTREE_H
@@ -11,30 +11,348 @@
 #include <set>
 #include <queue>
 #include <map>
+#include <unordered_map>
 #include <utility>
+#include <memory>
+#include <atomic>
+#include <type_traits>
+#include <cstdint>
+
+#include "matrix.cpp"
+#include "mstree.cpp"
+#include "memory.cpp"
+#include "cancel.cpp"
+#include "thread_pool.cpp"
+#include "trace.cpp"
 
 namespace grapetree {
 
-// Edge structure defined in mstree.cpp
-struct Edge;
+// Distances between the nodes of a graph whose cycles were contracted,
+// derived on access from the root matrix: d(A, B) is the minimum over
+// root nodes x in A and y in B of root(x, y) - reduction[y], where
+// reduction[y] is the weight of the cycle edge entering y (0 outside
+// cycles). Nothing n^2 is allocated, whatever the storage of the root.
+// Pairs involving large cycles are memoised in a table bounded by a few
+// entries per node, since branch recrafting re-reads them many times.
+//
+// Over a dense root, every level of one solve shares a single buffer
+// (LevelBuffer): each new level writes all its pairs into it before it is
+// scanned, in place from the level above while that one still holds it.
+// Reads stay dense, and the buffer never outgrows the first contracted
+// level, however deep the recursion goes. Once a deeper level has taken
+// the buffer, the levels above it read derived values again for their
+// expansion and recrafting.
+template <typename Root>
+class ContractedMatrix {
+public:
+    struct LevelBuffer {
+        TrackedVector<double> values = tracked_vector<double>(MemoryStage::tree);
+        const void* owner = nullptr;  // level whose values it holds
+    };
+    
+private:
+    static constexpr size_t MEMO_MIN_COST = 16;  // root reads per pair
+    static constexpr size_t MEMO_PER_NODE = 4;
+    
+    const Root& root_;
+    std::vector<std::vector<size_t>> members_;  // root nodes, ascending
+    std::vector<double> reduction_;             // per root node
+    mutable std::unordered_map<uint64_t, double> memo_;
+    std::shared_ptr<LevelBuffer> buffer_;       // dense roots only
+    
+public:
+    ContractedMatrix(
+        const Root& root,
+        std::vector<std::vector<size_t>> members,
+        std::vector<double> reduction,
+        std::shared_ptr<LevelBuffer> buffer = nullptr
+    ) : root_(root),
+        members_(std::move(members)),
+        reduction_(std::move(reduction)),
+        buffer_(std::move(buffer)) {}
+    
+    size_t size() const { return members_.size(); }
+    
+    const Root& root() const { return root_; }
+    const std::vector<size_t>& members(size_t node) const { return members_[node]; }
+    double reduction(size_t root_node) const { return reduction_[root_node]; }
+    const std::shared_ptr<LevelBuffer>& buffer() const { return buffer_; }
+    bool materialized() const { return buffer_ && buffer_->owner == this; }
+    
+    // Write every pair into the shared buffer, taking it over from the
+    // level that held it; reads are served from it until another level
+    // does the same. One pass over the root.
+    void materialize() const {
+        if (!buffer_ || materialized()) {
+            return;
+        }
+        size_t n = members_.size();
+        std::vector<size_t> node(root_.size());
+        for (size_t a = 0; a < n; ++a) {
+            for (size_t x : members_[a]) {
+                node[x] = a;
+            }
+        }
+        
+        TrackedVector<double>& values = buffer_->values;
+        values.assign(n * n, std::numeric_limits<double>::max());
+        for (size_t x = 0; x < node.size(); ++x) {
+            size_t a = node[x];
+            double* row = values.data() + a * n;
+            for (size_t y = 0; y < node.size(); ++y) {
+                size_t b = node[y];
+                if (a == b) continue;
+                double reduced = root_(x, y) - reduction_[y];
+                if (reduced < row[b]) {
+                    row[b] = reduced;
+                }
+            }
+        }
+        buffer_->owner = this;
+    }
+    
+    // The same from the level this one was contracted from, while that
+    // level holds the buffer: members and reduction index its nodes, as
+    // passed to Contraction. One pass over that (larger) level, rewritten
+    // in place: each of its rows is reduced to this level's columns and
+    // packed down, the rows of a contracted node are folded into its first
+    // one, and those are moved to this level's row order.
+    void materialize_from(
+        const ContractedMatrix& parent,
+        const std::vector<std::vector<size_t>>& members,
+        const std::vector<double>& reduction
+    ) const {
+        constexpr double NONE = std::numeric_limits<double>::max();
+        size_t n = members.size();
+        size_t parent_n = parent.size();
+        std::vector<size_t> node(parent_n);
+        for (size_t a = 0; a < n; ++a) {
+            for (size_t p : members[a]) {
+                node[p] = a;
+            }
+        }
+        
+        // Row p lands at p * n, never past the start of row p + 1
+        double* values = buffer_->values.data();
+        std::vector<double> row(n);
+        for (size_t p = 0; p < parent_n; ++p) {
+            std::fill(row.begin(), row.end(), NONE);
+            const double* from = values + p * parent_n;
+            for (size_t q = 0; q < parent_n; ++q) {
+                size_t b = node[q];
+                double reduced = from[q] - reduction[q];
+                if (reduced < row[b]) {
+                    row[b] = reduced;
+                }
+            }
+            std::copy(row.begin(), row.end(), values + p * n);
+        }
+        
+        // Node a's row is now at slot members[a][0]
+        for (size_t a = 0; a < n; ++a) {
+            double* to = values + members[a][0] * n;
+            for (size_t i = 1; i < members[a].size(); ++i) {
+                const double* from = values + members[a][i] * n;
+                for (size_t b = 0; b < n; ++b) {
+                    to[b] = std::min(to[b], from[b]);
+                }
+            }
+            to[a] = NONE;
+        }
+        
+        // Move each row to its slot once the row there has moved on:
+        // follow the chain of rows in the way, then move it back to front
+        constexpr size_t EMPTY = static_cast<size_t>(-1);
+        std::vector<size_t> held_by(parent_n, EMPTY);  // node whose row is in a slot
+        for (size_t a = 0; a < n; ++a) {
+            held_by[members[a][0]] = a;
+        }
+        std::vector<size_t> chain;
+        for (size_t a = 0; a < n; ++a) {
+            if (held_by[a] == a) continue;
+            chain.assign(1, a);
+            while (held_by[chain.back()] != EMPTY && held_by[chain.back()] != a) {
+                chain.push_back(held_by[chain.back()]);
+            }
+            bool cycle = held_by[chain.back()] == a;
+            if (cycle) {
+                std::copy(values + chain.back() * n, values + (chain.back() + 1) * n,
+                          row.begin());
+            }
+            for (size_t i = chain.size(); i-- > (cycle ? 1 : 0);) {
+                size_t c = chain[i];
+                size_t from = members[c][0];
+                std::copy(values + from * n, values + (from + 1) * n, values + c * n);
+                held_by[from] = EMPTY;
+                held_by[c] = c;
+            }
+            if (cycle) {
+                std::copy(row.begin(), row.end(), values + a * n);
+                held_by[a] = a;
+            }
+        }
+        buffer_->values.resize(n * n);
+        buffer_->owner = this;
+    }
+    
+    double operator()(size_t a, size_t b) const {
+        if (materialized()) {
+            return buffer_->values[a * members_.size() + b];
+        }
+        double best = std::numeric_limits<double>::max();
+        if (a == b) {
+            return best;
+        }
+        
+        bool memoise = members_[a].size() * members_[b].size() >= MEMO_MIN_COST;
+        uint64_t key = static_cast<uint64_t>(a) * members_.size() + b;
+        if (memoise) {
+            auto it = memo_.find(key);
+            if (it != memo_.end()) {
+                return it->second;
+            }
+        }
+        
+        for (size_t x : members_[a]) {
+            for (size_t y : members_[b]) {
+                double reduced = root_(x, y) - reduction_[y];
+                if (reduced < best) {
+                    best = reduced;
+                }
+            }
+        }
+        
+        if (memoise) {
+            if (memo_.size() >= MEMO_PER_NODE * members_.size()) {
+                memo_.clear();
+            }
+            memo_.emplace(key, best);
+        }
+        return best;
+    }
+};
+
+// Contracting a matrix yields a ContractedMatrix over it; contracting a
+// ContractedMatrix again folds into one over the same root, so the
+// recursion instantiates a single solver type per root storage. Dense
+// roots are no exception: a dense copy per level would keep the whole
+// chain of contracted matrices alive while the deeper levels solve.
+template <typename Matrix>
+struct Contraction {
+    using type = ContractedMatrix<Matrix>;
+    
+    static type make(
+        const Matrix& matrix,
+        std::vector<std::vector<size_t>> members,
+        std::vector<double> reduction
+    ) {
+        std::shared_ptr<typename type::LevelBuffer> buffer;
+        if (std::is_same<Matrix, DenseMatrix>::value) {
+            buffer = std::make_shared<typename type::LevelBuffer>();
+        }
+        return type(matrix, std::move(members), std::move(reduction), std::move(buffer));
+    }
+};
+
+template <typename Root>
+struct Contraction<ContractedMatrix<Root>> {
+    using type = ContractedMatrix<Root>;
+    
+    static type make(
+        const ContractedMatrix<Root>& matrix,
+        const std::vector<std::vector<size_t>>& members,
+        const std::vector<double>& reduction
+    ) {
+        std::vector<std::vector<size_t>> root_members(members.size());
+        std::vector<double> root_reduction(matrix.root().size(), 0.0);
+        
+        for (size_t a = 0; a < members.size(); ++a) {
+            for (size_t node : members[a]) {
+                for (size_t x : matrix.members(node)) {
+                    root_members[a].push_back(x);
+                    root_reduction[x] = matrix.reduction(x) + reduction[node];
+                }
+            }
+            std::sort(root_members[a].begin(), root_members[a].end());
+        }
+        return type(
+            matrix.root(), std::move(root_members), std::move(root_reduction),
+            matrix.buffer()
+        );
+    }
+};
+
+// Give a freshly contracted level the shared buffer before it is
+// scanned (see ContractedMatrix), from the level it was contracted from
+// when that one holds it; other storages are read as they are
+template <typename Matrix, typename Parent>
+void materialize_level(
+    const Matrix&, const Parent&,
+    const std::vector<std::vector<size_t>>&, const std::vector<double>&
+) {}
+
+template <typename Root, typename Parent>
+void materialize_level(
+    const ContractedMatrix<Root>& level, const Parent&,
+    const std::vector<std::vector<size_t>>&, const std::vector<double>&
+) {
+    level.materialize();
+}
+
+template <typename Root>
+void materialize_level(
+    const ContractedMatrix<Root>& level, const ContractedMatrix<Root>& parent,
+    const std::vector<std::vector<size_t>>& members, const std::vector<double>& reduction
+) {
+    if (parent.materialized()) {
+        level.materialize_from(parent, members, reduction);
+    } else {
+        level.materialize();
+    }
+}
+
+// A level is read-only while it holds the buffer; derived reads memoise
+template <typename Root>
+bool concurrent_reads(const ContractedMatrix<Root>& matrix) {
+    return matrix.materialized();
+}
 
-class MSTreeV2 {
+// Edmonds' algorithm over any matrix type providing size() and
+// operator()(i, j), like BasicMSTree
+template <typename Matrix>
+class BasicMSTreeV2 {
 private:
-    int n_nodes_;
-    std::vector<std::vector<double>> distance_matrix_;
+    const Matrix& distance_matrix_;
+    size_t n_nodes_;
+    // Memoised scores, -1 = not yet computed; atomic, since the incoming
+    // edge scan may run on the pool
+    std::unique_ptr<std::atomic<double>[]> harmonic_;
+    TreeCounters counters_;
+    const CancelToken* cancel_ = nullptr;
+    
+    static constexpr size_t PARALLEL_MIN_NODES = 256;
+    static constexpr size_t INCOMING_GRAIN = 16;  // rows per range
     
 public:
-    explicit MSTreeV2(
-        const std::vector<std::vector<double>>& distances
+    explicit BasicMSTreeV2(
+        const Matrix& distances
     ) : distance_matrix_(distances),
         n_nodes_(distances.size()) {}
     
-    std::vector<Edge> compute() {
+    // Checked once per node in each scan, at every contraction level;
+    // a set token makes compute() throw CancelledError
+    void set_cancel_token(const CancelToken* token) { cancel_ = token; }
+    
+    // recraft = false stops before the final recrafting pass, which the
+    // benchmark harness times on its own through recraft_branches()
+    std::vector<Edge> compute(bool recraft = true) {
+        GRAPETREE_SPAN_ARG("tree", "MSTreeV2", "nodes", n_nodes_);
+        
         // Phase 1: Find minimum incoming edge for each node
         std::vector<Edge> min_incoming = find_minimum_incoming_edges();
         
         // Phase 2: Detect cycles
-        std::vector<int> cycle_id = detect_cycles(min_incoming);
+        std::vector<size_t> cycle_id = detect_cycles(min_incoming);
         
         // Phase 3: Contract cycles if present
         if (has_cycles(cycle_id)) {
@@ -42,57 +360,145 @@ public:
         }
         
         // Phase 4: Local branch recrafting optimization
-        recraft_branches(min_incoming);
+        if (recraft) {
+            recraft_branches(min_incoming);
+        }
         
         return min_incoming;
     }
     
-private:
-    // Find minimum incoming edge for each node using harmonic mean tiebreak
-    std::vector<Edge> find_minimum_incoming_edges() {
-        std::vector<Edge> edges;
+    const TreeCounters& counters() const { return counters_; }
+    
+    // Local branch recrafting to improve tree quality
+    void recraft_branches(std::vector<Edge>& tree) {
+        bool improved = true;
+        unsigned max_iterations = 10;
+        unsigned iteration = 0;
         
-        // Node 0 is the root (no incoming edge)
-        for (int to = 1; to < n_nodes_; ++to) {
-            double min_dist = std::numeric_limits<double>::max();
-            int best_from = -1;
-            double best_score = -1.0;
+        while (improved && iteration < max_iterations) {
+            improved = false;
+            iteration++;
+            GRAPETREE_SPAN_ARG("tree", "recraft pass", "pass", iteration);
             
-            for (int from = 0; from < n_nodes_; ++from) {
-                if (from == to) continue;
-                
-                double dist = distance_matrix_[from][to];
-                
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    best_from = from;
-                    best_score = harmonic_mean_score(from);
-                } else if (std::abs(dist - min_dist) < 1e-10) {
-                    // Tiebreak using harmonic mean
-                    double score = harmonic_mean_score(from);
-                    if (score > best_score) {
-                        best_from = from;
-                        best_score = score;
+            // Try swapping adjacent edges
+            for (size_t i = 0; i < tree.size(); ++i) {
+                check_cancel();
+                for (size_t j = i + 1; j < tree.size(); ++j) {
+                    if (can_swap_edges(tree, i, j)) {
+                        counters_.recraft_swaps_tried++;
+                        double current_cost = tree[i].distance + 
+                                            tree[j].distance;
+                        double swap_cost = calculate_swap_cost(
+                            tree, i, j
+                        );
+                        
+                        if (swap_cost < current_cost - 1e-10) {
+                            perform_edge_swap(tree, i, j);
+                            counters_.recraft_swaps_accepted++;
+                            improved = true;
+                        }
                     }
                 }
             }
-            
-            if (best_from != -1) {
-                edges.emplace_back(best_from, to, min_dist);
+        }
+    }
+    
+private:
+    void check_cancel() const {
+        if (cancel_ && cancel_->cancelled()) {
+            throw CancelledError();
+        }
+    }
+    
+    // Find minimum incoming edge for each node using harmonic mean
+    // tiebreak. Rows are independent, so once the matrix is large enough
+    // and safe to read concurrently they are shared out over the pool in
+    // ranges of INCOMING_GRAIN; edges are kept in node order either way.
+    std::vector<Edge> find_minimum_incoming_edges() {
+        GRAPETREE_SPAN("tree", "minimum incoming edges");
+        if (!harmonic_) {
+            harmonic_.reset(new std::atomic<double>[n_nodes_]);
+            for (size_t i = 0; i < n_nodes_; ++i) {
+                harmonic_[i].store(-1.0, std::memory_order_relaxed);
+            }
+        }
+        
+        // Node 0 is the root (no incoming edge)
+        std::vector<Edge> incoming(n_nodes_, Edge(NO_NODE, NO_NODE, 0.0));
+        std::atomic<uint64_t> tie_breaks{0};
+        auto scan = [&](size_t first, size_t last) {
+            uint64_t ties = 0;
+            for (size_t to = std::max<size_t>(first, 1); to < last; ++to) {
+                check_cancel();
+                incoming[to] = minimum_incoming_edge(to, ties);
             }
+            tie_breaks.fetch_add(ties, std::memory_order_relaxed);
+        };
+        if (n_nodes_ >= PARALLEL_MIN_NODES && ThreadPool::shared().size() > 1 &&
+            concurrent_reads(distance_matrix_)) {
+            ThreadPool::shared().parallel_for(n_nodes_, scan, INCOMING_GRAIN);
+        } else {
+            scan(0, n_nodes_);
         }
+        counters_.tie_breaks += tie_breaks.load(std::memory_order_relaxed);
         
+        std::vector<Edge> edges;
+        for (const Edge& e : incoming) {
+            if (e.from != NO_NODE) {
+                edges.push_back(e);
+            }
+        }
         return edges;
     }
     
-    double harmonic_mean_score(int node) {
+    // One scan of column to; from is NO_NODE if no entry is below the
+    // maximum
+    Edge minimum_incoming_edge(size_t to, uint64_t& ties) const {
+        double min_dist = std::numeric_limits<double>::max();
+        size_t best_from = NO_NODE;
+        double best_score = -1.0;
+        
+        for (size_t from = 0; from < n_nodes_; ++from) {
+            if (from == to) continue;
+            
+            double dist = distance_matrix_(from, to);
+            
+            if (dist < min_dist) {
+                min_dist = dist;
+                best_from = from;
+                best_score = harmonic_mean_score(from);
+            } else if (std::abs(dist - min_dist) < 1e-10) {
+                // Tiebreak using harmonic mean
+                ties++;
+                double score = harmonic_mean_score(from);
+                if (score > best_score) {
+                    best_from = from;
+                    best_score = score;
+                }
+            }
+        }
+        return Edge(best_from, to, min_dist);
+    }
+    
+    // Ties re-score the same candidates many times; each row is scanned
+    // about once (two threads may both score a node, with equal results)
+    double harmonic_mean_score(size_t node) const {
+        double score = harmonic_[node].load(std::memory_order_relaxed);
+        if (score < 0.0) {
+            score = harmonic_mean(node);
+            harmonic_[node].store(score, std::memory_order_relaxed);
+        }
+        return score;
+    }
+    
+    double harmonic_mean(size_t node) const {
         double sum = 0.0;
-        int count = 0;
+        size_t count = 0;
         
-        for (int i = 0; i < n_nodes_; ++i) {
+        for (size_t i = 0; i < n_nodes_; ++i) {
             if (i == node) continue;
             
-            double dist = distance_matrix_[node][i];
+            double dist = distance_matrix_(node, i);
             if (dist > 0.0) {
                 sum += 1.0 / dist;
                 count++;
@@ -102,19 +508,22 @@ private:
         return count > 0 ? static_cast<double>(count) / sum : 0.0;
     }
     
+    // Cycle id of a node outside every cycle
+    static constexpr size_t NO_CYCLE = SIZE_MAX;
+    
     // Detect cycles using Union-Find
-    std::vector<int> detect_cycles(const std::vector<Edge>& edges) {
-        std::vector<int> parent(n_nodes_);
-        std::iota(parent.begin(), parent.end(), 0);
+    std::vector<size_t> detect_cycles(const std::vector<Edge>& edges) {
+        std::vector<size_t> parent(n_nodes_);
+        std::iota(parent.begin(), parent.end(), size_t(0));
         
-        std::vector<int> cycle_id(n_nodes_, -1);
-        int next_cycle_id = 0;
+        std::vector<size_t> cycle_id(n_nodes_, NO_CYCLE);
+        size_t next_cycle_id = 0;
         
         for (const Edge& e : edges) {
-            int root_from = find_root(parent, e.from);
-            int root_to = find_root(parent, e.to);
+            size_t root_from = find_root(parent, e.from);
+            size_t root_to = find_root(parent, e.to);
             
-            if (root_from == root_to && cycle_id[e.to] == -1) {
+            if (root_from == root_to && cycle_id[e.to] == NO_CYCLE) {
                 // Found a cycle - mark all nodes in it
                 mark_cycle(edges, e.to, cycle_id, next_cycle_id);
                 next_cycle_id++;
@@ -126,7 +535,7 @@ private:
         return cycle_id;
     }
     
-    int find_root(std::vector<int>& parent, int node) {
+    size_t find_root(std::vector<size_t>& parent, size_t node) {
         if (parent[node] != node) {
             parent[node] = find_root(parent, parent[node]);
         }
@@ -135,12 +544,12 @@ private:
     
     void mark_cycle(
         const std::vector<Edge>& edges,
-        int start,
-        std::vector<int>& cycle_id,
-        int id
+        size_t start,
+        std::vector<size_t>& cycle_id,
+        size_t id
     ) {
-        int current = start;
-        std::set<int> visited;
+        size_t current = start;
+        std::set<size_t> visited;
         
         while (visited.find(current) == visited.end()) {
             visited.insert(current);
@@ -160,9 +569,9 @@ private:
         }
     }
     
-    bool has_cycles(const std::vector<int>& cycle_id) {
-        for (int id : cycle_id) {
-            if (id != -1) return true;
+    bool has_cycles(const std::vector<size_t>& cycle_id) {
+        for (size_t id : cycle_id) {
+            if (id != NO_CYCLE) return true;
         }
         return false;
     }
@@ -170,24 +579,26 @@ private:
     // Contract cycles and recursively solve
     std::vector<Edge> contract_and_solve(
         const std::vector<Edge>& edges,
-        const std::vector<int>& cycle_id
+        const std::vector<size_t>& cycle_id
     ) {
         // Map old nodes to contracted nodes
-        std::map<int, int> node_mapping;
-        std::vector<std::set<int>> cycles;
-        int next_node = 0;
+        TrackedVector<size_t> node_mapping =
+            tracked_vector<size_t>(MemoryStage::tree, n_nodes_);
+        std::vector<std::set<size_t>> cycles;
+        size_t next_node = 0;
         
         // Identify unique cycles
-        std::set<int> unique_cycles;
-        for (int id : cycle_id) {
-            if (id != -1) unique_cycles.insert(id);
+        std::set<size_t> unique_cycles;
+        for (size_t id : cycle_id) {
+            if (id != NO_CYCLE) unique_cycles.insert(id);
         }
         
         cycles.resize(unique_cycles.size());
+        counters_.cycles_contracted += cycles.size();
         
         // Build mapping
-        for (int i = 0; i < n_nodes_; ++i) {
-            if (cycle_id[i] == -1) {
+        for (size_t i = 0; i < n_nodes_; ++i) {
+            if (cycle_id[i] == NO_CYCLE) {
                 node_mapping[i] = next_node++;
             } else {
                 cycles[cycle_id[i]].insert(i);
@@ -196,72 +607,79 @@ private:
         
         // Assign contracted node for each cycle
         for (size_t i = 0; i < cycles.size(); ++i) {
-            int contracted_node = next_node++;
-            for (int node : cycles[i]) {
+            size_t contracted_node = next_node++;
+            for (size_t node : cycles[i]) {
                 node_mapping[node] = contracted_node;
             }
         }
         
-        // Build contracted distance matrix and edge mapping
-        int new_size = next_node;
-        std::vector<std::vector<double>> new_distances(
-            new_size,
-            std::vector<double>(new_size, 
-                               std::numeric_limits<double>::max())
-        );
+        // Original nodes behind each contracted node, in index order
+        size_t new_size = next_node;
+        std::vector<std::vector<size_t>> members(new_size);
+        for (size_t i = 0; i < n_nodes_; ++i) {
+            members[node_mapping[i]].push_back(i);
+        }
         
-        // Map: (contracted_from, contracted_to) -> Original Edge
-        // We use int pair for key as Edge might not be comparable
-        std::map<std::pair<int, int>, Edge> edge_mapping;
-
-        for (int i = 0; i < n_nodes_; ++i) {
-            for (int j = 0; j < n_nodes_; ++j) {
-                if (i == j) continue;
-                
-                int ni = node_mapping[i];
-                int nj = node_mapping[j];
-                
-                if (ni != nj) {
-                    double dist = distance_matrix_[i][j];
-                    double reduced_dist = dist;
-
-                    // If target is in a cycle, reduce weight
-                    if (cycle_id[j] != -1) {
-                        double cycle_edge_weight = 0;
-                        for(const auto& e : edges) {
-                            if (e.to == j) {
-                                cycle_edge_weight = e.distance;
-                                break;
-                            }
-                        }
-                        reduced_dist -= cycle_edge_weight;
-                    }
-
-                    if (reduced_dist < new_distances[ni][nj]) {
-                        new_distances[ni][nj] = reduced_dist;
-                        // We construct Edge manually to avoid needing default constructor if it doesn't have one
-                        // But Edge structure is simple struct in mstree.cpp
-                        edge_mapping.erase({ni, nj});
-                        edge_mapping.insert({{ni, nj}, Edge(i, j, dist)});
-                    }
+        // Weight of the cycle edge entering each cycle node
+        std::vector<double> cycle_edge_weight(n_nodes_, 0.0);
+        for (size_t j = n_nodes_; j-- > 0;) {
+            if (cycle_id[j] == NO_CYCLE) continue;
+            for (const auto& e : edges) {
+                if (e.to == j) {
+                    cycle_edge_weight[j] = e.distance;
+                    break;
                 }
             }
         }
         
-        // Recursively solve on contracted graph
-        MSTreeV2 contracted_solver(new_distances);
-        std::vector<Edge> contracted_edges = contracted_solver.compute();
+        // Solve the contracted graph (see Contraction for how its
+        // distances are held). The original edge behind each one is
+        // recovered below for the few pairs the solution uses. Nested
+        // levels show as nested spans.
+        std::vector<Edge> contracted_edges;
+        {
+            GRAPETREE_SPAN_ARG("tree", "Edmonds contraction", "cycles", cycles.size());
+            using Contracted = Contraction<Matrix>;
+            typename Contracted::type new_distances = Contracted::make(
+                distance_matrix_, members, cycle_edge_weight
+            );
+            materialize_level(new_distances, distance_matrix_, members, cycle_edge_weight);
+            BasicMSTreeV2<typename Contracted::type> contracted_solver(new_distances);
+            contracted_solver.set_cancel_token(cancel_);
+            contracted_edges = contracted_solver.compute();
+            counters_.add_nested(contracted_solver.counters());
+        }
         
         // Expand solution back to original graph
         std::vector<Edge> final_edges;
-        std::set<int> nodes_with_incoming_edges;
+        std::set<size_t> nodes_with_incoming_edges;
 
-        // 1. Add inter-component edges from contracted solution
+        // 1. Add inter-component edges from contracted solution, using the
+        // first original edge (in index order) with the minimum reduced weight
         for (const auto& e : contracted_edges) {
-            if (edge_mapping.count({e.from, e.to})) {
-                Edge original = edge_mapping.at({e.from, e.to});
-                final_edges.push_back(original);
-                nodes_with_incoming_edges.insert(original.to);
+            if (e.from == e.to) continue;
+            
+            double best = std::numeric_limits<double>::max();
+            size_t best_i = NO_NODE;
+            size_t best_j = NO_NODE;
+            
+            for (size_t i : members[e.from]) {
+                for (size_t j : members[e.to]) {
+                    double reduced_dist =
+                        distance_matrix_(i, j) - cycle_edge_weight[j];
+                    if (reduced_dist < best) {
+                        best = reduced_dist;
+                        best_i = i;
+                        best_j = j;
+                    }
+                }
+            }
+            
+            if (best_i != NO_NODE) {
+                final_edges.emplace_back(
+                    best_i, best_j, distance_matrix_(best_i, best_j)
+                );
+                nodes_with_incoming_edges.insert(best_j);
             }
         }
 
@@ -279,36 +697,6 @@ private:
         return final_edges;
     }
     
-    // Local branch recrafting to improve tree quality
-    void recraft_branches(std::vector<Edge>& tree) {
-        bool improved = true;
-        int max_iterations = 10;
-        int iteration = 0;
-        
-        while (improved && iteration < max_iterations) {
-            improved = false;
-            iteration++;
-            
-            // Try swapping adjacent edges
-            for (size_t i = 0; i < tree.size(); ++i) {
-                for (size_t j = i + 1; j < tree.size(); ++j) {
-                    if (can_swap_edges(tree, i, j)) {
-                        double current_cost = tree[i].distance + 
-                                            tree[j].distance;
-                        double swap_cost = calculate_swap_cost(
-                            tree, i, j
-                        );
-                        
-                        if (swap_cost < current_cost - 1e-10) {
-                            perform_edge_swap(tree, i, j);
-                            improved = true;
-                        }
-                    }
-                }
-            }
-        }
-    }
-    
     bool can_swap_edges(
         const std::vector<Edge>& tree,
         size_t idx1,
@@ -331,10 +719,10 @@ private:
         const Edge& e2 = tree[idx2];
         
         // Try alternative connections
-        double cost1 = distance_matrix_[e1.from][e2.to] +
-                      distance_matrix_[e2.from][e1.to];
-        double cost2 = distance_matrix_[e1.to][e2.from] +
-                      distance_matrix_[e2.to][e1.from];
+        double cost1 = distance_matrix_(e1.from, e2.to) +
+                      distance_matrix_(e2.from, e1.to);
+        double cost2 = distance_matrix_(e1.to, e2.from) +
+                      distance_matrix_(e2.to, e1.from);
         
         return std::min(cost1, cost2);
     }
@@ -349,11 +737,13 @@ private:
         Edge& e2 = tree[idx2];
         
         std::swap(e1.to, e2.to);
-        e1.distance = distance_matrix_[e1.from][e1.to];
-        e2.distance = distance_matrix_[e2.from][e2.to];
+        e1.distance = distance_matrix_(e1.from, e1.to);
+        e2.distance = distance_matrix_(e2.from, e2.to);
     }
 };
 
+using MSTreeV2 = BasicMSTreeV2<DenseMatrix>;
+
 } // namespace grapetree
 
 #endif // GRAPETREE_MSTREE_V2_H
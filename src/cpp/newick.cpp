@@ -5,12 +5,15 @@
 #define GRAPETREE_NEWICK_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <sstream>
 #include <iomanip>
 #include <set>
 
+#include "trace.cpp"
+
 namespace grapetree {
 
 struct Edge;
@@ -27,12 +30,17 @@ private:
     };
     
 public:
+    // Names may be any indexable container of string-like values
+    // (std::vector<std::string>, StringArena, ...)
+    template <typename Names>
     std::string format(
         const std::vector<Edge>& edges,
-        const std::vector<std::string>& strain_names
+        const Names& strain_names
     ) {
+        GRAPETREE_SPAN_ARG("output", "Newick", "edges", edges.size());
         if (edges.empty()) {
-            return strain_names.empty() ? "();" : strain_names[0] + ";";
+            return strain_names.empty() ? "();" :
+                std::string(strain_names[0]) + ";";
         }
 
         // Build tree structure
@@ -55,7 +63,8 @@ public:
 
         if (roots.empty()) {
             // No roots found (shouldn't happen, but handle gracefully)
-            return strain_names.empty() ? "();" : strain_names[0] + ";";
+            return strain_names.empty() ? "();" :
+                std::string(strain_names[0]) + ";";
         } else if (roots.size() == 1) {
             // Single connected tree - standard case
             oss << to_newick(roots[0], nodes, strain_names);
@@ -121,10 +130,11 @@ private:
         return best_root;
     }
     
+    template <typename Names>
     std::string to_newick(
         int node_id,
         const std::vector<TreeNode>& nodes,
-        const std::vector<std::string>& names
+        const Names& names
     ) {
         const TreeNode& node = nodes[node_id];
         std::ostringstream oss;
@@ -158,7 +168,7 @@ private:
         return oss.str();
     }
     
-    std::string sanitize_name(const std::string& name) {
+    std::string sanitize_name(std::string_view name) {
         // Remove/escape characters that are special in Newick format
         std::string sanitized;
         bool needs_quotes = false;
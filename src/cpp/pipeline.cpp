@@ -0,0 +1,252 @@
+// pipeline.cpp - Overlapped parse -> encode -> distance pipeline
+// Distances for each profile row are computed as soon as the row has
+// been parsed, so tree building can start the moment input ends
+
+#ifndef GRAPETREE_PIPELINE_H
+#define GRAPETREE_PIPELINE_H
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <cstdio>
+#include <stdexcept>
+#include <exception>
+
+#ifndef __EMSCRIPTEN__
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#endif
+
+#include "profile_store.cpp"
+#include "profile_tsv.cpp"
+#include "distance.cpp"
+#include "matrix.cpp"
+
+namespace grapetree {
+
+struct PipelineResult {
+    ProfileStore profiles;
+    DenseMatrix distances;
+};
+
+// Single-threaded pipeline for delimited profile text arriving in chunks
+// (a browser network or File stream). Each feed() parses the complete
+// lines it received and compares the new rows against all earlier ones,
+// so the quadratic work overlaps with waiting for the next chunk.
+class ProfilePipeline {
+private:
+    ProfileTsvStream stream_;
+    bool asymmetric_;
+    DistanceMatrix::MissingHandler handler_;
+    std::unique_ptr<IncrementalDistanceMatrix> distances_;
+    std::vector<ProfileStore::Code> row_;
+
+public:
+    // Same matrix_type / missing_handler arguments as compute_tree
+    ProfilePipeline(
+        const std::string& matrix_type,
+        int missing_handler,
+        const ParseOptions& options = ParseOptions()
+    ) : stream_(options),
+        asymmetric_(matrix_type != "symmetric"),
+        handler_(static_cast<DistanceMatrix::MissingHandler>(missing_handler)) {}
+
+    void feed(const char* data, size_t size) {
+        stream_.feed(data, size);
+        drain();
+    }
+
+    void feed(std::string_view chunk) { feed(chunk.data(), chunk.size()); }
+
+    size_t n_rows() const { return stream_.n_rows(); }
+
+    PipelineResult finish() {
+        stream_.close();
+        drain();
+        ProfileStore profiles = stream_.finish();
+        return PipelineResult{std::move(profiles), distances_->finish()};
+    }
+
+private:
+    void drain() {
+        size_t n = stream_.n_rows();
+        if (n == 0) {
+            return;
+        }
+        if (!distances_) {
+            distances_ = std::make_unique<IncrementalDistanceMatrix>(
+                stream_.n_loci(), asymmetric_, handler_
+            );
+            row_.resize(stream_.n_loci());
+        }
+        for (size_t i = distances_->n_rows(); i < n; ++i) {
+            stream_.encoder().copy_row(i, row_.data());
+            distances_->add_row(row_.data());
+        }
+    }
+};
+
+#ifndef __EMSCRIPTEN__
+// Fixed-capacity FIFO between two threads. push() blocks while the queue
+// is full, which holds a fast producer back to the consumer's pace.
+template <typename T>
+class BoundedQueue {
+private:
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    // False if the queue was closed before the item could be queued
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] {
+            return closed_ || items_.size() < capacity_;
+        });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // False once the queue is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+};
+
+// Rows encoded by the reader thread, row-major
+struct RowBatch {
+    size_t n_loci = 0;
+    std::vector<ProfileStore::Code> codes;
+};
+
+// Two-thread pipeline over a profile file or pipe ("-" for stdin). A
+// reader thread reads, parses and encodes chunks and queues the new rows;
+// the calling thread computes their distances. queue_depth bounds the
+// batches in flight, and with them the memory held between the stages.
+inline PipelineResult run_profile_pipeline(
+    const std::string& path,
+    const std::string& matrix_type,
+    DistanceMatrix::MissingHandler handler,
+    const ParseOptions& options = ParseOptions(),
+    size_t queue_depth = 8,
+    size_t chunk_size = size_t(1) << 20
+) {
+    std::FILE* f = path == "-" ? stdin : std::fopen(path.c_str(), "rb");
+    if (!f) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    auto close_input = [&]() {
+        if (f != stdin) {
+            std::fclose(f);
+        }
+    };
+
+    BoundedQueue<RowBatch> queue(queue_depth);
+    ProfileStore profiles;
+    std::exception_ptr error;
+
+    std::thread reader([&]() {
+        try {
+            ProfileTsvStream stream(options);
+            std::vector<char> buffer(chunk_size);
+            size_t sent = 0;
+
+            auto send_rows = [&]() {
+                size_t n = stream.n_rows();
+                if (n == sent) {
+                    return true;
+                }
+                RowBatch batch;
+                batch.n_loci = stream.n_loci();
+                batch.codes.resize((n - sent) * batch.n_loci);
+                for (size_t i = sent; i < n; ++i) {
+                    stream.encoder().copy_row(
+                        i, batch.codes.data() + (i - sent) * batch.n_loci
+                    );
+                }
+                sent = n;
+                return queue.push(std::move(batch));
+            };
+
+            size_t bytes;
+            while ((bytes = std::fread(buffer.data(), 1, buffer.size(), f)) > 0) {
+                stream.feed(buffer.data(), bytes);
+                if (!send_rows()) {
+                    break;
+                }
+            }
+            if (std::ferror(f)) {
+                throw std::runtime_error("Error reading " + path);
+            }
+
+            stream.close();
+            send_rows();
+            profiles = stream.finish();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        queue.close();
+    });
+
+    std::unique_ptr<IncrementalDistanceMatrix> distances;
+    try {
+        RowBatch batch;
+        while (queue.pop(batch)) {
+            if (!distances) {
+                distances = std::make_unique<IncrementalDistanceMatrix>(
+                    batch.n_loci, matrix_type != "symmetric", handler
+                );
+            }
+            for (size_t i = 0; i < batch.codes.size(); i += batch.n_loci) {
+                distances->add_row(batch.codes.data() + i);
+            }
+        }
+    } catch (...) {
+        queue.close();
+        reader.join();
+        close_input();
+        throw;
+    }
+
+    reader.join();
+    close_input();
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (!distances) {
+        throw std::runtime_error("No profiles in " + path);
+    }
+    return PipelineResult{std::move(profiles), distances->finish()};
+}
+#endif
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PIPELINE_H
@@ -0,0 +1,130 @@
+// placement.cpp - Nearest-strain placement of new profiles
+// Scores query profiles against a loaded collection without re-encoding
+// or re-clustering it: query alleles are translated to the collection's
+// codes per locus, then each query is compared with every strain the way
+// one row of the symmetric matrix is
+
+#ifndef GRAPETREE_PLACEMENT_H
+#define GRAPETREE_PLACEMENT_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+#include "profile_store.cpp"
+#include "distance.cpp"
+#include "thread_pool.cpp"
+
+namespace grapetree {
+
+struct Placement {
+    size_t strain;      // index in the collection
+    uint32_t distance;  // allelic differences
+};
+
+// Holds a per-locus allele index of the collection, which must outlive
+// the placer and stay where it is
+class ProfilePlacer {
+public:
+    using Code = ProfileStore::Code;
+
+    // Code for query alleles the collection has never seen: differs from
+    // every strain
+    static constexpr Code NEW_ALLELE = UINT32_MAX;
+
+private:
+    const ProfileStore& collection_;
+    std::vector<std::unordered_map<std::string_view, Code>> alleles_;
+
+public:
+    explicit ProfilePlacer(const ProfileStore& collection)
+        : collection_(collection), alleles_(collection.n_loci()) {
+        for (size_t locus = 0; locus < collection.n_loci(); ++locus) {
+            const StringArena& names = collection.alleles(locus);
+            alleles_[locus].reserve(names.size());
+            for (size_t a = 0; a < names.size(); ++a) {
+                alleles_[locus].emplace(names[a], static_cast<Code>(a + 1));
+            }
+        }
+    }
+
+    const ProfileStore& collection() const { return collection_; }
+
+    // Query profile q in the collection's coding
+    std::vector<Code> translate(const ProfileStore& queries, size_t q) const {
+        check_loci(queries);
+        std::vector<Code> codes(queries.n_loci(), ProfileStore::MISSING);
+        for (size_t locus = 0; locus < queries.n_loci(); ++locus) {
+            Code code = queries.code(q, locus);
+            if (code == ProfileStore::MISSING) {
+                continue;
+            }
+            auto it = alleles_[locus].find(queries.allele_name(locus, code));
+            codes[locus] = it != alleles_[locus].end() ? it->second : NEW_ALLELE;
+        }
+        return codes;
+    }
+
+    // The k strains nearest to each query, closest first; ties go to the
+    // lower strain index. Loci are matched by position, so queries need
+    // the collection's locus order.
+    std::vector<std::vector<Placement>> place(
+        const ProfileStore& queries,
+        size_t k,
+        DistanceMatrix::MissingHandler handler = DistanceMatrix::IGNORE
+    ) const {
+        check_loci(queries);
+        size_t n = collection_.n_strains();
+        k = std::min(k, n);
+
+        DistanceMatrix engine(collection_);
+        std::vector<uint32_t> differences(n);
+        std::vector<size_t> order(n);
+        std::vector<std::vector<Placement>> placements(queries.n_strains());
+
+        for (size_t q = 0; q < queries.n_strains(); ++q) {
+            std::vector<Code> codes = translate(queries, q);
+            ThreadPool::shared().parallel_for(n, [&](size_t first, size_t last) {
+                engine.count_query_differences(
+                    codes.data(), first, last, handler, differences.data()
+                );
+            }, 4096);
+
+            for (size_t j = 0; j < n; ++j) {
+                order[j] = j;
+            }
+            std::partial_sort(
+                order.begin(), order.begin() + k, order.end(),
+                [&](size_t a, size_t b) {
+                    return differences[a] != differences[b] ?
+                        differences[a] < differences[b] : a < b;
+                }
+            );
+            placements[q].reserve(k);
+            for (size_t r = 0; r < k; ++r) {
+                placements[q].push_back(Placement{order[r], differences[order[r]]});
+            }
+        }
+        return placements;
+    }
+
+private:
+    void check_loci(const ProfileStore& queries) const {
+        if (queries.n_loci() != collection_.n_loci()) {
+            throw std::runtime_error(
+                "Query profiles have " + std::to_string(queries.n_loci()) +
+                " loci, the collection has " +
+                std::to_string(collection_.n_loci())
+            );
+        }
+    }
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PLACEMENT_H
@@ -0,0 +1,294 @@
+// plan.cpp - Memory-budgeted run planning
+// Picks how the distance matrix is held (dense, 16-bit condensed,
+// thresholded sparse or recomputed on demand) so a run fits the memory
+// it is given, estimates its peak memory and run time before any work
+// starts, and runs the tree engines on the chosen storage
+
+#ifndef GRAPETREE_PLAN_H
+#define GRAPETREE_PLAN_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+
+#include "profile_store.cpp"
+#include "matrix.cpp"
+#include "distance.cpp"
+#include "mstree.cpp"
+#include "mstree_v2.cpp"
+#include "thread_pool.cpp"
+#include "cancel.cpp"
+
+namespace grapetree {
+
+enum class MatrixStorage {
+    DENSE,        // n x n doubles
+    CONDENSED16,  // uint16_t lower triangle
+    SPARSE,       // pairs within a threshold only
+    LAZY          // rows recomputed from the profiles on demand
+};
+
+inline const char* storage_name(MatrixStorage storage) {
+    switch (storage) {
+        case MatrixStorage::DENSE: return "dense";
+        case MatrixStorage::CONDENSED16: return "condensed16";
+        case MatrixStorage::SPARSE: return "sparse";
+        case MatrixStorage::LAZY: return "lazy";
+    }
+    return "unknown";
+}
+
+struct PlanRequest {
+    size_t n_strains = 0;
+    size_t n_loci = 0;
+    std::string method = "MSTreeV2";
+    bool asymmetric = true;
+    uint64_t budget_bytes = 0;      // 0 = unlimited
+    uint64_t profile_bytes = 0;     // resident profiles; 0 = estimate unpacked
+    uint32_t sparse_threshold = 0;  // > 0 allows sparse storage
+    unsigned n_threads = 0;         // 0 = the shared pool's size
+};
+
+struct RunPlan {
+    bool fits = false;
+    MatrixStorage storage = MatrixStorage::DENSE;
+    uint64_t matrix_bytes = 0;
+    uint64_t peak_bytes = 0;
+    uint32_t sparse_threshold = 0;
+    uint64_t max_sparse_pairs = 0;  // pairs the budget leaves room for
+    size_t cached_rows = 0;         // lazy, and sparse's lazy fallback (0 =
+                                    // none): rows the budget leaves room for
+    double distance_seconds = 0.0;
+    double tree_seconds = 0.0;
+    std::string reason;             // why this storage, or why none fits
+
+    double seconds() const { return distance_seconds + tree_seconds; }
+};
+
+// Rough throughput figures for the estimates. They are meant to get the
+// order of magnitude right (seconds vs. hours), not to predict timings.
+namespace plan_cost {
+constexpr double LOCUS_COMPARISONS_PER_SECOND = 1.0e9;  // per thread
+constexpr double MATRIX_READS_PER_SECOND = 2.0e8;       // dense reads
+constexpr uint64_t NODE_BYTES = 1024;                   // engines + output
+
+// Full passes each engine makes over the matrix
+inline double tree_passes(const std::string& method) {
+    return method == "MSTree" ? 2.0 : 4.0;
+}
+
+// Rows a lazy matrix computes per node, measured on tie-heavy cgMLST
+// data; MSTreeV2 revisits rows at every cycle contraction level
+inline double lazy_rows_per_node(const std::string& method) {
+    return method == "MSTree" ? 16.0 : 128.0;
+}
+
+// Cost of one matrix read relative to a dense one
+inline double read_cost(MatrixStorage storage) {
+    switch (storage) {
+        case MatrixStorage::DENSE: return 1.0;
+        case MatrixStorage::CONDENSED16: return 1.5;
+        case MatrixStorage::SPARSE: return 8.0;
+        case MatrixStorage::LAZY: return 2.0;
+    }
+    return 1.0;
+}
+} // namespace plan_cost
+
+// The first storage that fits the budget, in order of speed: dense,
+// condensed16 (at most 65535 loci), sparse (only when a threshold is
+// given, since it changes distances beyond it; lazy if the near pairs
+// turn out not to fit), then lazy. When nothing
+// fits, fits is false and reason gives the smallest budget that would.
+inline RunPlan plan_run(const PlanRequest& request) {
+    double n = static_cast<double>(request.n_strains);
+    double pairs = n * (n - 1.0) / 2.0;
+    double threads = request.n_threads > 0 ?
+        request.n_threads : ThreadPool::shared().size();
+    uint64_t profile_bytes = request.profile_bytes > 0 ? request.profile_bytes :
+        uint64_t(request.n_strains) * request.n_loci * sizeof(ProfileStore::Code);
+    uint64_t base = profile_bytes + uint64_t(request.n_strains) * plan_cost::NODE_BYTES;
+    uint64_t budget = request.budget_bytes;
+
+    double compute_seconds = pairs * static_cast<double>(request.n_loci) /
+        (plan_cost::LOCUS_COMPARISONS_PER_SECOND * threads);
+    double reads = plan_cost::tree_passes(request.method) * n * n;
+
+    auto make = [&](MatrixStorage storage, uint64_t matrix_bytes) {
+        RunPlan plan;
+        plan.storage = storage;
+        plan.matrix_bytes = matrix_bytes;
+        plan.peak_bytes = base + matrix_bytes;
+        plan.fits = budget == 0 || plan.peak_bytes <= budget;
+        plan.distance_seconds = compute_seconds;
+        plan.tree_seconds = reads * plan_cost::read_cost(storage) /
+            plan_cost::MATRIX_READS_PER_SECOND;
+        return plan;
+    };
+
+    // Over a dense matrix, MSTreeV2 holds one contracted level at a time
+    // (see ContractedMatrix), smaller than the matrix itself; other
+    // storages contract without an n^2 buffer
+    double dense_bytes = n * n * sizeof(double) *
+        (request.method == "MSTreeV2" ? 2.0 : 1.0);
+    if (dense_bytes < static_cast<double>(SIZE_MAX)) {
+        RunPlan dense = make(MatrixStorage::DENSE, static_cast<uint64_t>(dense_bytes));
+        if (dense.fits) {
+            dense.reason = budget == 0 ? "no memory budget" : "dense matrix fits";
+            return dense;
+        }
+    }
+
+    if (request.n_loci <= CondensedMatrix16::MAX_COUNT) {
+        RunPlan condensed = make(
+            MatrixStorage::CONDENSED16,
+            CondensedMatrix16::memory_bytes(request.n_strains, request.asymmetric)
+        );
+        if (condensed.fits) {
+            condensed.reason = "dense matrix exceeds the budget; 16-bit condensed fits";
+            return condensed;
+        }
+    }
+
+    // As many cached rows as the budget leaves room for; more rows mean
+    // fewer recomputed ones
+    size_t cached_rows = 2;
+    uint64_t min_lazy = base + LazyMatrix::memory_bytes(request.n_strains, request.asymmetric, 2);
+    if (budget > min_lazy && request.n_strains > 0) {
+        uint64_t spare = (budget - min_lazy) /
+            (uint64_t(request.n_strains) * sizeof(uint32_t));
+        cached_rows = static_cast<size_t>(
+            std::min<uint64_t>(2 + spare, request.n_strains)
+        );
+    }
+    RunPlan lazy = make(
+        MatrixStorage::LAZY,
+        LazyMatrix::memory_bytes(request.n_strains, request.asymmetric, cached_rows)
+    );
+    lazy.cached_rows = cached_rows;
+    lazy.distance_seconds = 0.0;
+    lazy.tree_seconds += plan_cost::lazy_rows_per_node(request.method) * n *
+        n * static_cast<double>(request.n_loci) /
+        (plan_cost::LOCUS_COMPARISONS_PER_SECOND * threads);
+
+    // Whether the near pairs fit is only known once they are counted, so
+    // a sparse plan keeps the lazy one to fall back on (see
+    // build_planned_tree) when that fits too
+    uint64_t offset_bytes = request.asymmetric ? request.n_strains * sizeof(double) : 0;
+    uint64_t row_bytes = uint64_t(request.n_strains) * (sizeof(size_t) + sizeof(void*) * 3);
+    if (request.sparse_threshold > 0 && budget > base + offset_bytes + row_bytes) {
+        RunPlan sparse = make(MatrixStorage::SPARSE, budget - base);
+        sparse.sparse_threshold = request.sparse_threshold;
+        sparse.max_sparse_pairs =
+            (budget - base - offset_bytes - row_bytes) / SparseMatrix::BYTES_PER_PAIR;
+        sparse.reason = "condensed matrix exceeds the budget; keeping at most " +
+            std::to_string(sparse.max_sparse_pairs) + " pairs within " +
+            std::to_string(request.sparse_threshold) + " differences";
+        if (lazy.fits) {
+            sparse.cached_rows = lazy.cached_rows;
+            sparse.reason += ", else recomputing distances on demand";
+        }
+        return sparse;
+    }
+
+    if (lazy.fits) {
+        lazy.reason = "no stored matrix fits the budget; distances are "
+                      "recomputed on demand";
+        return lazy;
+    }
+
+    lazy.reason = "needs at least " + std::to_string(lazy.peak_bytes) +
+        " bytes, budget is " + std::to_string(budget) + " bytes";
+    return lazy;
+}
+
+inline MSTreeBase::Heuristic tree_heuristic(const std::string& heuristic) {
+    return heuristic == "harmonic" ? MSTreeBase::HARMONIC : MSTreeBase::EBURST;
+}
+
+// Run the selected tree algorithm on any matrix storage; the engine's
+// work counts go to counters when given, and a set cancel token stops
+// it with CancelledError
+template <typename Matrix>
+std::vector<Edge> build_tree(
+    const Matrix& distances,
+    const std::string& method,
+    const std::string& heuristic,
+    TreeCounters* counters = nullptr,
+    const CancelToken* cancel = nullptr
+) {
+    if (method == "MSTree") {
+        BasicMSTree<Matrix> mst(distances, tree_heuristic(heuristic));
+        mst.set_cancel_token(cancel);
+        std::vector<Edge> edges = mst.compute();
+        if (counters) {
+            *counters = mst.counters();
+        }
+        return edges;
+    } else if (method == "MSTreeV2") {
+        BasicMSTreeV2<Matrix> mst2(distances);
+        mst2.set_cancel_token(cancel);
+        std::vector<Edge> edges = mst2.compute();
+        if (counters) {
+            *counters = mst2.counters();
+        }
+        return edges;
+    }
+    throw std::runtime_error("Unknown method: " + method);
+}
+
+// Build the planned storage from the profiles and run the tree on it.
+// A plan that does not fit fails here, before any work is done.
+inline std::vector<Edge> build_planned_tree(
+    const ProfileStore& profiles,
+    const RunPlan& plan,
+    const std::string& method,
+    bool asymmetric,
+    DistanceMatrix::MissingHandler handler,
+    const std::string& heuristic
+) {
+    if (!plan.fits) {
+        throw std::length_error("Run does not fit the memory budget: " + plan.reason);
+    }
+
+    DistanceMatrix engine(profiles);
+    switch (plan.storage) {
+        case MatrixStorage::DENSE: {
+            DenseMatrix distances = asymmetric ?
+                engine.compute_asymmetric() : engine.compute_symmetric(handler);
+            return build_tree(distances, method, heuristic);
+        }
+        case MatrixStorage::CONDENSED16: {
+            CondensedMatrix16 distances = engine.compute_condensed16(asymmetric, handler);
+            return build_tree(distances, method, heuristic);
+        }
+        case MatrixStorage::SPARSE: {
+            SparseMatrix distances;
+            try {
+                distances = engine.compute_sparse(
+                    asymmetric, handler, plan.sparse_threshold,
+                    static_cast<size_t>(plan.max_sparse_pairs)
+                );
+            } catch (const SparseOverflowError&) {
+                if (plan.cached_rows == 0) {
+                    throw;
+                }
+                LazyMatrix lazy(profiles, asymmetric, handler, plan.cached_rows);
+                return build_tree(lazy, method, heuristic);
+            }
+            return build_tree(distances, method, heuristic);
+        }
+        case MatrixStorage::LAZY: {
+            LazyMatrix distances(profiles, asymmetric, handler, plan.cached_rows);
+            return build_tree(distances, method, heuristic);
+        }
+    }
+    throw std::logic_error("Unknown matrix storage");
+}
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PLAN_H
@@ -0,0 +1,301 @@
+// profile_binary.cpp - Binary columnar profile store files
+// A parsed ProfileStore written once can be mapped (natively) or loaded
+// from a single buffer (wasm) and used by the distance kernels in place
+//
+// Layout (little-endian, every section 8-byte aligned):
+//   Header       magic "GTPSTORE", version, code width, counts,
+//                section offsets and total size
+//   Names        uint64 offsets[n_strains + 1], then name bytes
+//   Dictionaries uint64 index[n_loci] of block offsets; each block is
+//                uint64 count, uint64 offsets[count + 1], allele bytes
+//   Matrix       uint32 codes, column-major (n_loci x n_strains)
+
+#ifndef GRAPETREE_PROFILE_BINARY_H
+#define GRAPETREE_PROFILE_BINARY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include "profile_store.cpp"
+#include "mapped_file.cpp"
+
+namespace grapetree {
+
+class ProfileStoreFormat {
+public:
+    static constexpr char MAGIC[8] = {'G', 'T', 'P', 'S', 'T', 'O', 'R', 'E'};
+    static constexpr uint32_t VERSION = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t code_bytes;
+        uint64_t n_strains;
+        uint64_t n_loci;
+        uint64_t names_offset;
+        uint64_t dictionaries_offset;
+        uint64_t matrix_offset;
+        uint64_t file_size;
+    };
+
+    static bool matches(const char* data, size_t size) {
+        return size >= sizeof(MAGIC) &&
+               std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    // Stream the store through sink(const void*, size_t)
+    template <typename Sink>
+    static void write(const ProfileStore& store, Sink&& sink) {
+        check_little_endian();
+
+        size_t n = store.n_strains();
+        size_t loci = store.n_loci();
+
+        Header header = {};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.code_bytes = sizeof(ProfileStore::Code);
+        header.n_strains = n;
+        header.n_loci = loci;
+
+        uint64_t pos = sizeof(Header);
+        header.names_offset = pos;
+        pos += arena_bytes(store.strain_names());
+
+        header.dictionaries_offset = pos;
+        pos += 8 * loci;
+        std::vector<uint64_t> index(loci);
+        for (size_t k = 0; k < loci; ++k) {
+            index[k] = pos;
+            pos += 8 + arena_bytes(store.alleles(k));
+        }
+
+        header.matrix_offset = pos;
+        pos += align8(sizeof(ProfileStore::Code) * n * loci);
+        header.file_size = pos;
+
+        uint64_t written = 0;
+        auto put = [&](const void* p, size_t bytes) {
+            if (bytes > 0) {
+                sink(p, bytes);
+            }
+            written += bytes;
+        };
+        auto pad = [&]() {
+            static const char zeros[8] = {};
+            put(zeros, align8(written) - written);
+        };
+
+        put(&header, sizeof(header));
+        write_arena(store.strain_names(), put, pad);
+
+        put(index.data(), 8 * loci);
+        for (size_t k = 0; k < loci; ++k) {
+            uint64_t count = store.alleles(k).size();
+            put(&count, 8);
+            write_arena(store.alleles(k), put, pad);
+        }
+
+        if (store.packed()) {
+            // Files always hold flat columns; unpack a block at a time
+            std::vector<ProfileStore::Code> block(4096);
+            for (size_t k = 0; k < loci; ++k) {
+                for (size_t i = 0; i < n; i += block.size()) {
+                    size_t count = std::min(block.size(), n - i);
+                    store.decode(k, i, count, block.data());
+                    put(block.data(), sizeof(ProfileStore::Code) * count);
+                }
+            }
+        } else {
+            for (size_t k = 0; k < loci; ++k) {
+                put(store.column(k), sizeof(ProfileStore::Code) * n);
+            }
+        }
+        pad();
+    }
+
+    // Build a store whose names, dictionaries and columns point into
+    // data. owner keeps the buffer alive for the lifetime of the store.
+    static ProfileStore view(
+        const char* data,
+        size_t size,
+        std::shared_ptr<const void> owner
+    ) {
+        check_little_endian();
+
+        if (size < sizeof(Header) || !matches(data, size)) {
+            throw std::runtime_error("Not a GrapeTree profile store file");
+        }
+
+        Header header;
+        std::memcpy(&header, data, sizeof(header));
+
+        if (header.version != VERSION) {
+            throw std::runtime_error(
+                "Unsupported profile store version " +
+                std::to_string(header.version)
+            );
+        }
+        if (header.code_bytes != sizeof(ProfileStore::Code) ||
+            header.file_size > size ||
+            reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+            throw std::runtime_error("Corrupt or misaligned profile store");
+        }
+
+        ProfileStore store;
+        store.n_strains_ = header.n_strains;
+        store.strain_names_ = view_arena(
+            data, size, header.names_offset, header.n_strains
+        );
+
+        const uint64_t* index = section<uint64_t>(
+            data, size, header.dictionaries_offset, header.n_loci
+        );
+        store.alleles_.reserve(header.n_loci);
+        for (uint64_t k = 0; k < header.n_loci; ++k) {
+            uint64_t count = *section<uint64_t>(data, size, index[k], 1);
+            store.alleles_.push_back(
+                view_arena(data, size, index[k] + 8, count)
+            );
+        }
+
+        if (header.n_loci != 0 && header.n_strains > UINT64_MAX / header.n_loci) {
+            throw std::runtime_error("Corrupt profile store: bad matrix size");
+        }
+        const ProfileStore::Code* matrix = section<ProfileStore::Code>(
+            data, size, header.matrix_offset, header.n_strains * header.n_loci
+        );
+        store.column_ptrs_.reserve(header.n_loci);
+        for (uint64_t k = 0; k < header.n_loci; ++k) {
+            const ProfileStore::Code* column = matrix + k * header.n_strains;
+            check_codes(column, header.n_strains, store.alleles_[k].size());
+            store.column_ptrs_.push_back(column);
+        }
+
+        store.backing_ = std::move(owner);
+        return store;
+    }
+
+private:
+    static uint64_t align8(uint64_t x) { return (x + 7) & ~uint64_t(7); }
+
+    static uint64_t arena_bytes(const StringArena& arena) {
+        size_t n = arena.size();
+        return 8 * (n + 1) + align8(arena.offsets()[n]);
+    }
+
+    template <typename Put, typename Pad>
+    static void write_arena(const StringArena& arena, Put& put, Pad& pad) {
+        size_t n = arena.size();
+        put(arena.offsets(), 8 * (n + 1));
+        put(arena.chars(), arena.offsets()[n]);
+        pad();
+    }
+
+    template <typename T>
+    static const T* section(
+        const char* data,
+        size_t size,
+        uint64_t offset,
+        uint64_t count
+    ) {
+        if (offset % alignof(T) != 0 || offset > size ||
+            count > (size - offset) / sizeof(T)) {
+            throw std::runtime_error("Corrupt profile store: bad section");
+        }
+        return reinterpret_cast<const T*>(data + offset);
+    }
+
+    // Offsets must rise from the first to offsets[count], the length of
+    // the bytes that follow them
+    static StringArena view_arena(
+        const char* data,
+        size_t size,
+        uint64_t offset,
+        uint64_t count
+    ) {
+        if (count >= size / 8) {
+            throw std::runtime_error("Corrupt profile store: bad string count");
+        }
+        const uint64_t* offsets = section<uint64_t>(data, size, offset, count + 1);
+        uint64_t chars_offset = offset + 8 * (count + 1);
+        section<char>(data, size, chars_offset, offsets[count]);
+        for (uint64_t i = 0; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1]) {
+                throw std::runtime_error("Corrupt profile store: bad string offsets");
+            }
+        }
+        return StringArena::view(data + chars_offset, offsets, count);
+    }
+
+    // Codes index the locus dictionary (1..n_alleles, 0 = missing)
+    static void check_codes(
+        const ProfileStore::Code* codes,
+        uint64_t count,
+        uint64_t n_alleles
+    ) {
+        ProfileStore::Code max_code = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            max_code = std::max(max_code, codes[i]);
+        }
+        if (max_code > n_alleles) {
+            throw std::runtime_error("Corrupt profile store: bad allele code");
+        }
+    }
+
+    static void check_little_endian() {
+        static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+                      "Profile store files are little-endian");
+    }
+};
+
+// Serialise a store into one buffer (wasm: handed back to JS as bytes)
+inline std::string serialize_profile_store(const ProfileStore& store) {
+    std::string out;
+    ProfileStoreFormat::write(store, [&](const void* p, size_t bytes) {
+        out.append(static_cast<const char*>(p), bytes);
+    });
+    return out;
+}
+
+// Zero-copy store over a buffer that outlives it (no ownership taken)
+inline ProfileStore view_profile_store(const char* data, size_t size) {
+    return ProfileStoreFormat::view(data, size, nullptr);
+}
+
+// Take ownership of a loaded buffer and view it in place
+inline ProfileStore adopt_profile_store(std::string&& buffer) {
+    auto owner = std::make_shared<const std::string>(std::move(buffer));
+    return ProfileStoreFormat::view(owner->data(), owner->size(), owner);
+}
+
+#ifndef __EMSCRIPTEN__
+inline void save_profile_store(
+    const ProfileStore& store,
+    const std::string& path
+) {
+    replace_file(path, [&](std::FILE* f) {
+        bool ok = true;
+        ProfileStoreFormat::write(store, [&](const void* p, size_t bytes) {
+            ok = ok && std::fwrite(p, 1, bytes, f) == bytes;
+        });
+        return ok;
+    });
+}
+
+// Map a store file; columns are read straight from the page cache
+inline ProfileStore load_profile_store(const std::string& path) {
+    auto file = std::make_shared<const MappedFile>(path);
+    return ProfileStoreFormat::view(file->data(), file->size(), file);
+}
+#endif
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PROFILE_BINARY_H
@@ -0,0 +1,210 @@
+// profile_json.cpp - Streaming JSON profile reader
+// SAX handler that encodes {strains: [...], profiles: [[...], ...]}
+// directly into a ProfileStore without building a JSON DOM
+
+#ifndef GRAPETREE_PROFILE_JSON_H
+#define GRAPETREE_PROFILE_JSON_H
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <stdexcept>
+
+#include "profile_store.cpp"
+
+namespace grapetree {
+
+class ProfileJsonSax : public nlohmann::json_sax<nlohmann::json> {
+private:
+    enum Section {
+        NONE,
+        STRAINS,
+        PROFILES,
+        SKIP
+    };
+
+    ProfileEncoder& encoder_;
+    Section section_ = NONE;
+    int depth_ = 0;
+    std::string error_;
+
+public:
+    explicit ProfileJsonSax(ProfileEncoder& encoder) : encoder_(encoder) {}
+
+    const std::string& error() const { return error_; }
+
+    bool null() override {
+        return value_missing();
+    }
+
+    bool boolean(bool) override {
+        return value_rejected("boolean");
+    }
+
+    bool number_integer(number_integer_t val) override {
+        return value_allele(static_cast<int64_t>(val));
+    }
+
+    bool number_unsigned(number_unsigned_t val) override {
+        return value_allele(static_cast<int64_t>(val));
+    }
+
+    bool number_float(number_float_t val, const string_t&) override {
+        if (val != static_cast<number_float_t>(static_cast<int64_t>(val))) {
+            return value_rejected("non-integer number");
+        }
+        return value_allele(static_cast<int64_t>(val));
+    }
+
+    bool string(string_t& val) override {
+        if (section_ == STRAINS && depth_ == 2) {
+            encoder_.add_strain_name(val);
+            return true;
+        }
+        if (section_ == PROFILES && depth_ == 3) {
+            // Hashed allele identifiers or missing tokens
+            return guarded([&] { encoder_.push_token(val); });
+        }
+        return true;
+    }
+
+    bool binary(binary_t&) override {
+        return value_rejected("binary");
+    }
+
+    bool start_object(std::size_t) override {
+        ++depth_;
+        if (depth_ > 1 && section_ != SKIP && section_ != NONE) {
+            return fail("Unexpected object in profile data");
+        }
+        return true;
+    }
+
+    bool key(string_t& val) override {
+        if (depth_ != 1) {
+            return true;
+        }
+        if (val == "strains") {
+            section_ = STRAINS;
+        } else if (val == "profiles") {
+            section_ = PROFILES;
+        } else {
+            section_ = SKIP;
+        }
+        return true;
+    }
+
+    bool end_object() override {
+        --depth_;
+        return true;
+    }
+
+    bool start_array(std::size_t) override {
+        ++depth_;
+        if (section_ == PROFILES && depth_ == 3) {
+            return guarded([&] { encoder_.begin_row(); });
+        }
+        if ((section_ == PROFILES && depth_ > 3) ||
+            (section_ == STRAINS && depth_ > 2)) {
+            return fail("Unexpected nested array in profile data");
+        }
+        return true;
+    }
+
+    bool end_array() override {
+        if (section_ == PROFILES && depth_ == 3) {
+            if (!guarded([&] { encoder_.end_row(); })) {
+                return false;
+            }
+        }
+        --depth_;
+        return true;
+    }
+
+    bool parse_error(
+        std::size_t position,
+        const std::string&,
+        const nlohmann::detail::exception& ex
+    ) override {
+        return fail(
+            "JSON parse error at byte " + std::to_string(position) +
+            ": " + ex.what()
+        );
+    }
+
+private:
+    bool value_allele(int64_t allele) {
+        if (section_ == PROFILES && depth_ == 3) {
+            return guarded([&] { encoder_.push_allele(allele); });
+        }
+        if (section_ == STRAINS && depth_ == 2) {
+            return fail("Strain names must be strings");
+        }
+        return true;
+    }
+
+    bool value_missing() {
+        if (section_ == PROFILES && depth_ == 3) {
+            return guarded([&] { encoder_.push_missing(); });
+        }
+        return true;
+    }
+
+    bool value_rejected(const char* what) {
+        if (section_ == PROFILES && depth_ == 3) {
+            return fail(std::string("Unsupported allele value (") + what + ")");
+        }
+        return true;
+    }
+
+    template <typename Fn>
+    bool guarded(Fn&& fn) {
+        try {
+            fn();
+            return true;
+        } catch (const std::exception& e) {
+            return fail(e.what());
+        }
+    }
+
+    bool fail(const std::string& message) {
+        if (error_.empty()) {
+            error_ = message;
+        }
+        return false;
+    }
+};
+
+// Parse a JSON profile document straight into packed columns
+inline ProfileStore parse_profile_json_store(
+    const char* data,
+    size_t size,
+    const ParseOptions& options = ParseOptions()
+) {
+    ProfileStore store;
+    ProfileEncoder encoder(store, options);
+    ProfileJsonSax handler(encoder);
+
+    bool ok = nlohmann::json::sax_parse(data, data + size, &handler);
+    if (!ok) {
+        throw std::runtime_error(
+            handler.error().empty() ? "Invalid profile JSON" : handler.error()
+        );
+    }
+
+    encoder.finish();
+    if (store.n_strains() == 0) {
+        throw std::runtime_error("No profiles found in input");
+    }
+    return store;
+}
+
+inline ProfileStore parse_profile_json_store(
+    const std::string& json_str,
+    const ParseOptions& options = ParseOptions()
+) {
+    return parse_profile_json_store(json_str.data(), json_str.size(), options);
+}
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PROFILE_JSON_H
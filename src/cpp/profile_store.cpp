@@ -0,0 +1,675 @@
+// profile_store.cpp - Packed, recoded allele profile storage
+// Column-major allele codes plus a string arena for strain names
+
+#ifndef GRAPETREE_PROFILE_STORE_H
+#define GRAPETREE_PROFILE_STORE_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+#include <charconv>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+
+#include "memory.cpp"
+
+namespace grapetree {
+
+// Append-only store of strings in one contiguous buffer. An arena can
+// also be a read-only view over strings laid out the same way elsewhere
+// (e.g. a mapped profile store file).
+class StringArena {
+private:
+    TrackedVector<char> chars_ = tracked_vector<char>(MemoryStage::encode);
+    TrackedVector<uint64_t> offsets_ = tracked_vector<uint64_t>(MemoryStage::encode, 1, 0);
+    const char* chars_view_ = nullptr;
+    const uint64_t* offsets_view_ = nullptr;
+    size_t view_size_ = 0;
+
+public:
+    StringArena() = default;
+    StringArena(StringArena&&) noexcept = default;
+    StringArena& operator=(StringArena&&) noexcept = default;
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+
+    // View over n strings: offsets[0..n] index into chars
+    static StringArena view(
+        const char* chars,
+        const uint64_t* offsets,
+        size_t n
+    ) {
+        StringArena arena;
+        arena.chars_view_ = chars;
+        arena.offsets_view_ = offsets;
+        arena.view_size_ = n;
+        return arena;
+    }
+
+    size_t push(std::string_view s) {
+        if (offsets_view_) {
+            throw std::logic_error("Cannot append to a string arena view");
+        }
+        chars_.insert(chars_.end(), s.begin(), s.end());
+        offsets_.push_back(chars_.size());
+        return offsets_.size() - 2;
+    }
+
+    std::string_view operator[](size_t i) const {
+        const char* chars = offsets_view_ ? chars_view_ : chars_.data();
+        const uint64_t* offsets = offsets_view_ ? offsets_view_ : offsets_.data();
+        return std::string_view(chars + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    size_t size() const {
+        return offsets_view_ ? view_size_ : offsets_.size() - 1;
+    }
+    bool empty() const { return size() == 0; }
+
+    // Raw layout, as written to profile store files
+    const char* chars() const {
+        return offsets_view_ ? chars_view_ : chars_.data();
+    }
+    const uint64_t* offsets() const {
+        return offsets_view_ ? offsets_view_ : offsets_.data();
+    }
+};
+
+// FNV-1a; allele tokens are short, so a byte loop is hard to beat
+inline uint64_t hash_bytes(std::string_view s) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : s) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Open-addressing (linear probing) string -> dense code table.
+// Keys live in a StringArena; the table itself holds only codes, so
+// interning a token that was seen before allocates nothing. The table
+// only lives while parsing and is charged to that stage.
+class AlleleInterner {
+public:
+    using Code = uint32_t;
+
+private:
+    StringArena strings_;
+    TrackedVector<uint32_t> hashes_ =  // per code, to skip most compares
+        tracked_vector<uint32_t>(MemoryStage::parse);
+    TrackedVector<Code> slots_ =       // 0 = empty, else code
+        tracked_vector<Code>(MemoryStage::parse, 16, 0);
+    size_t mask_ = 15;
+
+public:
+    AlleleInterner() = default;
+
+    // Code for s (1-based), assigning the next code if unseen
+    Code intern(std::string_view s) {
+        if ((strings_.size() + 1) * 2 > slots_.size()) {
+            grow();
+        }
+
+        uint64_t h = hash_bytes(s);
+        size_t i = h & mask_;
+        while (Code c = slots_[i]) {
+            if (hashes_[c - 1] == static_cast<uint32_t>(h) &&
+                strings_[c - 1] == s) {
+                return c;
+            }
+            i = (i + 1) & mask_;
+        }
+
+        strings_.push(s);
+        hashes_.push_back(static_cast<uint32_t>(h));
+        Code code = static_cast<Code>(strings_.size());
+        slots_[i] = code;
+        return code;
+    }
+
+    // Code for s, or 0 if it has not been interned
+    Code find(std::string_view s) const {
+        uint64_t h = hash_bytes(s);
+        size_t i = h & mask_;
+        while (Code c = slots_[i]) {
+            if (hashes_[c - 1] == static_cast<uint32_t>(h) &&
+                strings_[c - 1] == s) {
+                return c;
+            }
+            i = (i + 1) & mask_;
+        }
+        return 0;
+    }
+
+    size_t size() const { return strings_.size(); }
+
+    // Strings in code order (code c is entry c - 1); the table is dropped
+    StringArena release() {
+        slots_.clear();
+        slots_.shrink_to_fit();
+        hashes_.clear();
+        hashes_.shrink_to_fit();
+        return std::move(strings_);
+    }
+
+private:
+    void grow() {
+        TrackedVector<Code> slots =
+            tracked_vector<Code>(MemoryStage::parse, slots_.size() * 2, 0);
+        size_t mask = slots.size() - 1;
+
+        for (Code c = 1; c <= strings_.size(); ++c) {
+            size_t i = hash_bytes(strings_[c - 1]) & mask;
+            while (slots[i]) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = c;
+        }
+
+        slots_ = std::move(slots);
+        mask_ = mask;
+    }
+};
+
+// Locus column bit-packed at the width of its largest code, i.e.
+// ceil(log2(n_alleles + 1)) bits per strain. Codes may straddle word
+// boundaries. The width grows (and the column is repacked) when a code
+// that does not fit arrives, so columns can be packed while parsing.
+class PackedColumn {
+public:
+    using Code = uint32_t;
+
+private:
+    TrackedVector<uint64_t> words_ =  // one spare word past the data
+        tracked_vector<uint64_t>(MemoryStage::encode, 1, 0);
+    size_t size_ = 0;
+    unsigned bits_ = 0;               // 0 while every code is missing
+
+public:
+    size_t size() const { return size_; }
+    unsigned bits() const { return bits_; }
+
+    void push(Code code) {
+        if (code >> bits_) {
+            widen(bit_width(code));
+        }
+        if (bits_ > 0) {
+            size_t bit = size_ * bits_;
+            if ((bit + bits_ + 63) / 64 + 1 > words_.size()) {
+                words_.push_back(0);
+            }
+            put(bit, code);
+        }
+        ++size_;
+    }
+
+    Code operator[](size_t i) const {
+        return bits_ == 0 ? 0 : get(i * bits_);
+    }
+
+    // Codes [first, first + count) into out
+    void decode(size_t first, size_t count, Code* out) const {
+        if (bits_ == 0) {
+            std::fill(out, out + count, Code(0));
+            return;
+        }
+        // Walk the bit stream with a cursor rather than recomputing each
+        // code's word and shift
+        size_t bit = first * bits_;
+        size_t w = bit >> 6;
+        unsigned shift = bit & 63;
+        uint64_t mask = (uint64_t(1) << bits_) - 1;
+        uint64_t word = words_[w];
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t value = word >> shift;
+            shift += bits_;
+            if (shift >= 64) {
+                word = words_[++w];
+                shift -= 64;
+                if (shift > 0) {
+                    value |= word << (bits_ - shift);
+                }
+            }
+            out[i] = static_cast<Code>(value & mask);
+        }
+    }
+
+    size_t memory_bytes() const { return words_.capacity() * sizeof(uint64_t); }
+
+private:
+    static unsigned bit_width(Code code) {
+        unsigned bits = 0;
+        while (code >> bits) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    Code get(size_t bit) const {
+        size_t w = bit >> 6;
+        unsigned shift = bit & 63;
+        uint64_t value = words_[w] >> shift;
+        if (shift + bits_ > 64) {
+            value |= words_[w + 1] << (64 - shift);
+        }
+        return static_cast<Code>(value & ((uint64_t(1) << bits_) - 1));
+    }
+
+    void put(size_t bit, Code code) {
+        size_t w = bit >> 6;
+        unsigned shift = bit & 63;
+        words_[w] |= uint64_t(code) << shift;
+        if (shift + bits_ > 64) {
+            words_[w + 1] |= uint64_t(code) >> (64 - shift);
+        }
+    }
+
+    void widen(unsigned bits) {
+        PackedColumn wider;
+        wider.bits_ = bits;
+        wider.words_.assign((size_ * bits + 63) / 64 + 1, 0);
+        for (size_t i = 0; i < size_; ++i) {
+            wider.put(i * bits, (*this)[i]);
+        }
+        wider.size_ = size_;
+        *this = std::move(wider);
+    }
+};
+
+// Tokens that mark a missing allele call. Defaults cover EnteroBase and
+// chewBBACA output ('-', LNF, PLOT3/5, NIPH, ...).
+struct ParseOptions {
+    std::vector<std::string> missing_tokens = {
+        "-", "N/A", "NA", "?",
+        "LNF", "PLOT3", "PLOT5", "LOTSC", "NIPH", "NIPHEM",
+        "ALM", "ASM", "PAMA", "EXC"
+    };
+
+    // Keep locus columns bit-packed (see PackedColumn) instead of one
+    // 32-bit code per cell: slower distance kernels, a fraction of the
+    // memory for very large collections
+    bool pack_columns = false;
+};
+
+// Allele profiles recoded per locus to dense codes 1..n_alleles,
+// stored column-major so distance kernels stream one locus at a time.
+// Code 0 marks missing data.
+//
+// Columns are either owned (built by ProfileEncoder), views into a
+// buffer kept alive by backing_ (a mapped or loaded profile store file),
+// or bit-packed (ParseOptions::pack_columns). Packed columns have no
+// flat Code array: read them through code() or decode().
+class ProfileStore {
+public:
+    using Code = uint32_t;
+    static constexpr Code MISSING = 0;
+
+private:
+    StringArena strain_names_;
+    std::vector<TrackedVector<Code>> columns_;
+    std::vector<const Code*> column_ptrs_;
+    std::vector<PackedColumn> packed_columns_;
+    bool packed_ = false;
+    std::vector<StringArena> alleles_;
+    size_t n_strains_ = 0;
+    std::shared_ptr<const void> backing_;
+
+    friend class ProfileEncoder;
+    friend class ProfileStoreFormat;
+    friend class ProfileStoreMerger;
+
+public:
+    ProfileStore() = default;
+    ProfileStore(ProfileStore&&) noexcept = default;
+    ProfileStore& operator=(ProfileStore&&) noexcept = default;
+
+    size_t n_strains() const { return n_strains_; }
+    size_t n_loci() const {
+        return packed_ ? packed_columns_.size() : column_ptrs_.size();
+    }
+
+    const StringArena& strain_names() const { return strain_names_; }
+
+    bool packed() const { return packed_; }
+
+    // Flat column of codes; unpacked stores only
+    const Code* column(size_t locus) const {
+        if (packed_) {
+            throw std::logic_error("Bit-packed profile store has no flat columns");
+        }
+        return column_ptrs_[locus];
+    }
+
+    const PackedColumn& packed_column(size_t locus) const {
+        return packed_columns_[locus];
+    }
+
+    Code code(size_t strain, size_t locus) const {
+        return packed_ ? packed_columns_[locus][strain]
+                       : column_ptrs_[locus][strain];
+    }
+
+    // Codes of strains [first, first + count) at a locus, in either mode
+    void decode(size_t locus, size_t first, size_t count, Code* out) const {
+        if (packed_) {
+            packed_columns_[locus].decode(first, count, out);
+        } else {
+            const Code* column = column_ptrs_[locus] + first;
+            std::copy(column, column + count, out);
+        }
+    }
+
+    // Number of distinct non-missing alleles seen at a locus
+    Code n_alleles(size_t locus) const {
+        return static_cast<Code>(alleles_[locus].size());
+    }
+
+    // Original allele identifier behind a (non-missing) code
+    std::string_view allele_name(size_t locus, Code code) const {
+        return alleles_[locus][code - 1];
+    }
+
+    const StringArena& alleles(size_t locus) const { return alleles_[locus]; }
+
+    // Bytes held by the allele codes, packed or flat (names and allele
+    // strings are not counted)
+    size_t code_bytes() const {
+        if (!packed_) {
+            return n_strains_ * column_ptrs_.size() * sizeof(Code);
+        }
+        size_t bytes = 0;
+        for (const PackedColumn& column : packed_columns_) {
+            bytes += column.memory_bytes();
+        }
+        return bytes;
+    }
+};
+
+// Streams rows into a ProfileStore, interning allele identifiers per locus
+// into dense codes as they arrive. Numeric alleles <= 0 and the configured
+// missing tokens encode as missing.
+class ProfileEncoder {
+private:
+    ProfileStore& store_;
+    std::vector<AlleleInterner> dictionaries_;
+    AlleleInterner missing_tokens_;
+    size_t locus_ = 0;
+    size_t n_rows_ = 0;
+    bool in_row_ = false;
+
+public:
+    explicit ProfileEncoder(
+        ProfileStore& store,
+        const ParseOptions& options = ParseOptions()
+    ) : store_(store) {
+        for (const std::string& token : options.missing_tokens) {
+            missing_tokens_.intern(token);
+        }
+        store_.packed_ = options.pack_columns;
+    }
+
+    void add_strain_name(std::string_view name) {
+        store_.strain_names_.push(name);
+    }
+
+    void begin_row() {
+        if (in_row_) {
+            throw std::runtime_error("Nested profile row");
+        }
+        in_row_ = true;
+        locus_ = 0;
+    }
+
+    // Numeric allele (JSON input)
+    void push_allele(int64_t allele) {
+        if (allele <= 0) {
+            push_code(ProfileStore::MISSING);
+            return;
+        }
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), allele);
+        push_interned(std::string_view(buf, res.ptr - buf));
+    }
+
+    void push_missing() { push_code(ProfileStore::MISSING); }
+
+    // Allele token as written in a profile file:
+    //   123        allele number
+    //   INF-123    inferred new allele (counts as allele 123)
+    //   -, LNF...  missing tokens from ParseOptions
+    //   other      hashed allele identifier, interned as-is
+    void push_token(std::string_view token) {
+        while (!token.empty() &&
+               (token.back() == '\r' || token.back() == ' ')) {
+            token.remove_suffix(1);
+        }
+        while (!token.empty() && token.front() == ' ') {
+            token.remove_prefix(1);
+        }
+
+        if (token.empty() || missing_tokens_.find(token)) {
+            push_code(ProfileStore::MISSING);
+            return;
+        }
+
+        if (token.size() > 4 && token.compare(0, 4, "INF-") == 0) {
+            token.remove_prefix(4);
+        }
+
+        // Integers are canonicalised so "007" and 7 are the same allele
+        int64_t value = 0;
+        const char* first = token.data();
+        const char* last = first + token.size();
+        auto res = std::from_chars(first, last, value);
+        if (res.ec == std::errc() && res.ptr == last) {
+            push_allele(value);
+            return;
+        }
+
+        push_interned(token);
+    }
+
+    void end_row() {
+        if (n_rows_ > 0 && locus_ != dictionaries_.size()) {
+            throw std::runtime_error(
+                "Profile row " + std::to_string(n_rows_) + " has " +
+                std::to_string(locus_) + " loci, expected " +
+                std::to_string(dictionaries_.size())
+            );
+        }
+        in_row_ = false;
+        ++n_rows_;
+        store_.n_strains_ = n_rows_;
+    }
+
+    size_t n_rows() const { return n_rows_; }
+    size_t n_loci() const { return dictionaries_.size(); }
+
+    // Codes of a completed row, readable before finish() so downstream
+    // stages can start on rows while later ones are still being parsed
+    void copy_row(size_t row, ProfileStore::Code* out) const {
+        for (size_t k = 0; k < dictionaries_.size(); ++k) {
+            out[k] = store_.packed_ ? store_.packed_columns_[k][row]
+                                    : store_.columns_[k][row];
+        }
+    }
+
+    // Validate the finished store and hand it the allele dictionaries;
+    // the hash tables themselves are released
+    void finish() {
+        if (in_row_) {
+            throw std::runtime_error("Unterminated profile row");
+        }
+        if (store_.strain_names_.size() != n_rows_) {
+            throw std::runtime_error(
+                "Number of strains (" +
+                std::to_string(store_.strain_names_.size()) +
+                ") does not match number of profiles (" +
+                std::to_string(n_rows_) + ")"
+            );
+        }
+
+        store_.column_ptrs_.clear();
+        if (!store_.packed_) {
+            for (const auto& column : store_.columns_) {
+                store_.column_ptrs_.push_back(column.data());
+            }
+        }
+
+        store_.alleles_.clear();
+        store_.alleles_.reserve(dictionaries_.size());
+        for (AlleleInterner& dict : dictionaries_) {
+            store_.alleles_.push_back(dict.release());
+        }
+        dictionaries_.clear();
+        dictionaries_.shrink_to_fit();
+    }
+
+private:
+    void push_interned(std::string_view allele) {
+        next_column();
+        append(dictionaries_[locus_].intern(allele));
+        ++locus_;
+    }
+
+    void push_code(ProfileStore::Code code) {
+        next_column();
+        append(code);
+        ++locus_;
+    }
+
+    void append(ProfileStore::Code code) {
+        if (store_.packed_) {
+            store_.packed_columns_[locus_].push(code);
+        } else {
+            store_.columns_[locus_].push_back(code);
+        }
+    }
+
+    void next_column() {
+        if (n_rows_ == 0) {
+            // First row defines the number of loci
+            if (store_.packed_) {
+                store_.packed_columns_.emplace_back();
+            } else {
+                store_.columns_.push_back(
+                    tracked_vector<ProfileStore::Code>(MemoryStage::encode));
+            }
+            dictionaries_.emplace_back();
+        } else if (locus_ >= dictionaries_.size()) {
+            throw std::runtime_error(
+                "Profile row " + std::to_string(n_rows_) +
+                " has more than " + std::to_string(dictionaries_.size()) +
+                " loci"
+            );
+        }
+    }
+};
+
+// Joins stores parsed from consecutive chunks of one file into a single
+// store. Each chunk numbered its alleles independently, so codes are
+// reconciled through one dictionary per locus; interning chunk
+// dictionaries in chunk order reproduces the codes a serial parse would
+// have assigned. Loci are independent: merge_locus() may run concurrently
+// for distinct loci, and frees each chunk column as soon as it is copied.
+class ProfileStoreMerger {
+private:
+    std::vector<ProfileStore>& parts_;
+    ProfileStore& out_;
+    size_t n_loci_ = 0;
+
+public:
+    ProfileStoreMerger(std::vector<ProfileStore>& parts, ProfileStore& out)
+        : parts_(parts), out_(out) {
+        bool first = true;
+        for (const ProfileStore& part : parts_) {
+            if (part.n_strains_ == 0) {
+                continue;
+            }
+            if (first) {
+                n_loci_ = part.n_loci();
+                first = false;
+            } else if (part.n_loci() != n_loci_) {
+                throw std::runtime_error(
+                    "Profile chunks disagree on the number of loci"
+                );
+            }
+            for (size_t i = 0; i < part.n_strains_; ++i) {
+                out_.strain_names_.push(part.strain_names_[i]);
+            }
+            out_.n_strains_ += part.n_strains_;
+        }
+
+        out_.packed_ = !parts_.empty() && parts_.front().packed_;
+        if (out_.packed_) {
+            out_.packed_columns_.resize(n_loci_);
+        } else {
+            out_.columns_.resize(
+                n_loci_, tracked_vector<ProfileStore::Code>(MemoryStage::encode));
+        }
+        out_.alleles_.resize(n_loci_);
+    }
+
+    size_t n_loci() const { return n_loci_; }
+
+    void merge_locus(size_t locus) {
+        AlleleInterner dictionary;
+        if (!out_.packed_) {
+            out_.columns_[locus].reserve(out_.n_strains_);
+        }
+        std::vector<ProfileStore::Code> remap;
+        ProfileStore::Code block[256];
+
+        for (ProfileStore& part : parts_) {
+            if (part.n_strains_ == 0) {
+                continue;
+            }
+
+            const StringArena& alleles = part.alleles_[locus];
+            remap.assign(alleles.size() + 1, ProfileStore::MISSING);
+            for (size_t c = 1; c <= alleles.size(); ++c) {
+                remap[c] = dictionary.intern(alleles[c - 1]);
+            }
+
+            for (size_t i = 0; i < part.n_strains_; i += 256) {
+                size_t count = std::min<size_t>(256, part.n_strains_ - i);
+                part.decode(locus, i, count, block);
+                for (size_t b = 0; b < count; ++b) {
+                    if (out_.packed_) {
+                        out_.packed_columns_[locus].push(remap[block[b]]);
+                    } else {
+                        out_.columns_[locus].push_back(remap[block[b]]);
+                    }
+                }
+            }
+
+            if (part.packed_) {
+                part.packed_columns_[locus] = PackedColumn();
+            } else {
+                part.columns_[locus] =
+                    tracked_vector<ProfileStore::Code>(MemoryStage::encode);
+            }
+            part.alleles_[locus] = StringArena();
+        }
+
+        out_.alleles_[locus] = dictionary.release();
+    }
+
+    // Call once every locus has been merged
+    void finish() {
+        out_.column_ptrs_.clear();
+        if (!out_.packed_) {
+            for (const auto& column : out_.columns_) {
+                out_.column_ptrs_.push_back(column.data());
+            }
+        }
+        parts_.clear();
+    }
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PROFILE_STORE_H
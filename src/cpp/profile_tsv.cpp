@@ -0,0 +1,451 @@
+// profile_tsv.cpp - Delimited (TSV/CSV) cgMLST profile reader
+// Splits lines with a SIMD delimiter scan and encodes allele tokens
+// straight into a ProfileStore, without iostreams or per-line strings
+
+#ifndef GRAPETREE_PROFILE_TSV_H
+#define GRAPETREE_PROFILE_TSV_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <exception>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+#include "profile_store.cpp"
+#include "mapped_file.cpp"
+#include "thread_pool.cpp"
+
+namespace grapetree {
+
+// Yields the positions of every field delimiter and newline in a buffer.
+// Scans 16 bytes at a time and hands out matches from a bitmask, so short
+// allele fields cost a couple of bit operations rather than a byte loop.
+class DelimiterScanner {
+private:
+    const char* block_;
+    const char* end_;
+    uint32_t mask_;
+    char delimiter_;
+
+public:
+    DelimiterScanner(const char* begin, const char* end, char delimiter)
+        : block_(begin), end_(end), mask_(0), delimiter_(delimiter) {
+        mask_ = scan_block(block_);
+    }
+
+    // Next delimiter or newline, or end of buffer when exhausted
+    const char* next() {
+        while (mask_ == 0) {
+            block_ += 16;
+            if (block_ >= end_) {
+                block_ = end_;
+                return end_;
+            }
+            mask_ = scan_block(block_);
+        }
+
+        const char* pos = block_ + __builtin_ctz(mask_);
+        mask_ &= mask_ - 1;
+        return pos;
+    }
+
+private:
+    uint32_t scan_block(const char* p) const {
+        if (end_ - p >= 16) {
+#if defined(__SSE2__)
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i hits = _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(delimiter_)),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))
+            );
+            return static_cast<uint32_t>(_mm_movemask_epi8(hits));
+#elif defined(__wasm_simd128__)
+            v128_t v = wasm_v128_load(p);
+            v128_t hits = wasm_v128_or(
+                wasm_i8x16_eq(v, wasm_i8x16_splat(delimiter_)),
+                wasm_i8x16_eq(v, wasm_i8x16_splat('\n'))
+            );
+            return static_cast<uint32_t>(wasm_i8x16_bitmask(hits));
+#endif
+        }
+
+        uint32_t mask = 0;
+        int n = end_ - p < 16 ? static_cast<int>(end_ - p) : 16;
+        for (int i = 0; i < n; ++i) {
+            if (p[i] == delimiter_ || p[i] == '\n') {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+    }
+};
+
+// Tab if the header line has more tabs than commas, else comma
+inline char detect_delimiter(const char* data, size_t size) {
+    size_t tabs = 0;
+    size_t commas = 0;
+    for (size_t i = 0; i < size && data[i] != '\n'; ++i) {
+        tabs += (data[i] == '\t');
+        commas += (data[i] == ',');
+    }
+    return tabs >= commas ? '\t' : ',';
+}
+
+// Malformed data line; line() is relative to the span that was parsed so
+// chunked readers can rebase it
+class TsvFormatError : public std::runtime_error {
+private:
+    size_t line_;
+    std::string detail_;
+
+public:
+    TsvFormatError(size_t line, const std::string& detail)
+        : std::runtime_error("Line " + std::to_string(line) + ": " + detail),
+          line_(line), detail_(detail) {}
+
+    size_t line() const { return line_; }
+    const std::string& detail() const { return detail_; }
+};
+
+class ProfileTsvReader {
+private:
+    ProfileEncoder& encoder_;
+    char delimiter_;
+
+public:
+    ProfileTsvReader(ProfileEncoder& encoder, char delimiter)
+        : encoder_(encoder), delimiter_(delimiter) {}
+
+    // Header line: strain column followed by one column per locus.
+    // Returns the number of fields and sets body to the next line.
+    static size_t read_header(
+        const char* data,
+        const char* end,
+        char delimiter,
+        const char** body
+    ) {
+        const char* p = data;
+        size_t n_fields = 1;
+        for (; p < end && *p != '\n'; ++p) {
+            n_fields += (*p == delimiter);
+        }
+        if (n_fields < 2) {
+            throw std::runtime_error("Profile header has no loci columns");
+        }
+        *body = p < end ? p + 1 : end;
+        return n_fields;
+    }
+
+    void parse(const char* data, size_t size) {
+        const char* end = data + size;
+        const char* body = nullptr;
+        size_t n_fields = read_header(data, end, delimiter_, &body);
+        parse_rows(body, end, n_fields, 2);
+    }
+
+    // Data lines: strain name followed by allele tokens. Blank lines and
+    // lines starting with '#' are skipped. first_line numbers the line at
+    // begin for error messages; returns the number of the last line read.
+    size_t parse_rows(
+        const char* begin,
+        const char* end,
+        size_t n_fields,
+        size_t first_line
+    ) {
+        DelimiterScanner scanner(begin, end, delimiter_);
+        size_t line = first_line - 1;
+        const char* p = begin;
+        const char* d;
+
+        while (p < end) {
+            ++line;
+            d = scanner.next();
+
+            std::string_view name(p, d - p);
+            if (!name.empty() && name.back() == '\r') {
+                name.remove_suffix(1);
+            }
+
+            if (name.empty() || name[0] == '#') {
+                // Blank or comment line: skip to the newline
+                while (d < end && *d != '\n') {
+                    d = scanner.next();
+                }
+                p = d < end ? d + 1 : end;
+                continue;
+            }
+
+            encoder_.add_strain_name(name);
+            encoder_.begin_row();
+
+            size_t fields = 1;
+            while (d < end && *d != '\n') {
+                const char* field = d + 1;
+                d = scanner.next();
+                if (++fields <= n_fields) {
+                    encoder_.push_token(std::string_view(field, d - field));
+                }
+            }
+
+            if (fields != n_fields) {
+                throw TsvFormatError(
+                    line,
+                    "expected " + std::to_string(n_fields) +
+                    " fields, got " + std::to_string(fields)
+                );
+            }
+
+            encoder_.end_row();
+            p = d < end ? d + 1 : end;
+        }
+        return line;
+    }
+};
+
+// Incremental delimited profile parser. Text may arrive in chunks split
+// at any byte boundary; each complete line is encoded as soon as it is
+// fed, so rows() grows while the input is still arriving. Only a partial
+// trailing line is buffered between chunks.
+class ProfileTsvStream {
+private:
+    ProfileStore store_;
+    ProfileEncoder encoder_;
+    char delimiter_;
+    size_t n_fields_ = 0;
+    size_t line_ = 0;
+    std::string carry_;
+
+public:
+    explicit ProfileTsvStream(
+        const ParseOptions& options = ParseOptions(),
+        char delimiter = 0
+    ) : encoder_(store_, options), delimiter_(delimiter) {}
+
+    ProfileTsvStream(const ProfileTsvStream&) = delete;
+    ProfileTsvStream& operator=(const ProfileTsvStream&) = delete;
+
+    void feed(const char* data, size_t size) {
+        const char* end = data + size;
+        const char* p = data;
+
+        if (!carry_.empty()) {
+            const void* nl = std::memchr(p, '\n', end - p);
+            if (!nl) {
+                carry_.append(p, end);
+                return;
+            }
+            const char* eol = static_cast<const char*>(nl) + 1;
+            carry_.append(p, eol);
+            parse_lines(carry_.data(), carry_.data() + carry_.size());
+            carry_.clear();
+            p = eol;
+        }
+
+        // Everything up to the last newline is parsed in place
+        const char* last = end;
+        while (last > p && last[-1] != '\n') {
+            --last;
+        }
+        if (last > p) {
+            parse_lines(p, last);
+        }
+        carry_.assign(last, end);
+    }
+
+    void feed(std::string_view chunk) { feed(chunk.data(), chunk.size()); }
+
+    // Encoded rows so far, and their codes (see ProfileEncoder::copy_row)
+    size_t n_rows() const { return encoder_.n_rows(); }
+    size_t n_loci() const { return encoder_.n_loci(); }
+    const ProfileEncoder& encoder() const { return encoder_; }
+
+    // End of input: parse an unterminated last line. Rows it adds can
+    // still be read before finish().
+    void close() {
+        if (!carry_.empty()) {
+            parse_lines(carry_.data(), carry_.data() + carry_.size());
+            carry_.clear();
+        }
+    }
+
+    ProfileStore finish() {
+        close();
+        encoder_.finish();
+
+        if (store_.n_strains() == 0) {
+            throw std::runtime_error("No valid data lines found in profile file");
+        }
+        return std::move(store_);
+    }
+
+private:
+    // Whole lines only (or the unterminated tail at finish)
+    void parse_lines(const char* p, const char* end) {
+        if (n_fields_ == 0) {
+            if (delimiter_ == 0) {
+                delimiter_ = detect_delimiter(p, end - p);
+            }
+            const char* body = nullptr;
+            n_fields_ = ProfileTsvReader::read_header(p, end, delimiter_, &body);
+            line_ = 1;
+            p = body;
+        }
+        if (p < end) {
+            ProfileTsvReader reader(encoder_, delimiter_);
+            line_ = reader.parse_rows(p, end, n_fields_, line_ + 1);
+        }
+    }
+};
+
+// Parse delimited profile text; delimiter 0 means auto-detect
+inline ProfileStore parse_profile_tsv(
+    const char* data,
+    size_t size,
+    const ParseOptions& options = ParseOptions(),
+    char delimiter = 0
+) {
+    ProfileStore store;
+    ProfileEncoder encoder(store, options);
+
+    if (delimiter == 0) {
+        delimiter = detect_delimiter(data, size);
+    }
+
+    ProfileTsvReader reader(encoder, delimiter);
+    reader.parse(data, size);
+    encoder.finish();
+
+    if (store.n_strains() == 0) {
+        throw std::runtime_error("No valid data lines found in profile file");
+    }
+    return store;
+}
+
+#ifndef __EMSCRIPTEN__
+// Map a profile file from disk and parse it in place
+inline ProfileStore load_profile_tsv(
+    const std::string& path,
+    const ParseOptions& options = ParseOptions(),
+    char delimiter = 0
+) {
+    MappedFile file(path);
+    return parse_profile_tsv(file.data(), file.size(), options, delimiter);
+}
+#endif
+
+// Chunks smaller than this are not worth a thread
+constexpr size_t PARALLEL_PARSE_MIN_CHUNK = size_t(1) << 20;
+
+// Parse a large profile file on the shared thread pool. The body is cut
+// at line boundaries into up to n_threads chunks; each chunk is encoded
+// with its own dictionaries and the results are merged locus by locus.
+// Produces the same store as parse_profile_tsv. n_threads 0 means one
+// chunk per pool thread; without threads the chunks run one by one.
+inline ProfileStore parse_profile_tsv_parallel(
+    const char* data,
+    size_t size,
+    const ParseOptions& options = ParseOptions(),
+    unsigned n_threads = 0,
+    char delimiter = 0
+) {
+    if (delimiter == 0) {
+        delimiter = detect_delimiter(data, size);
+    }
+    ThreadPool& pool = ThreadPool::shared();
+    if (n_threads == 0) {
+        n_threads = pool.size();
+    }
+
+    const char* end = data + size;
+    const char* body = nullptr;
+    size_t n_fields = ProfileTsvReader::read_header(data, end, delimiter, &body);
+
+    size_t body_size = end - body;
+    size_t n_chunks = std::min<size_t>(
+        n_threads, std::max<size_t>(1, body_size / PARALLEL_PARSE_MIN_CHUNK)
+    );
+    if (n_chunks == 1) {
+        return parse_profile_tsv(data, size, options, delimiter);
+    }
+
+    std::vector<const char*> bounds(n_chunks + 1);
+    bounds[0] = body;
+    bounds[n_chunks] = end;
+    for (size_t c = 1; c < n_chunks; ++c) {
+        const char* p = std::max(bounds[c - 1], body + body_size * c / n_chunks);
+        const void* nl = std::memchr(p, '\n', end - p);
+        bounds[c] = nl ? static_cast<const char*>(nl) + 1 : end;
+    }
+
+    // Chunks record their own errors so the earliest one in the file wins
+    std::vector<ProfileStore> parts(n_chunks);
+    std::vector<std::exception_ptr> errors(n_chunks);
+    pool.parallel_for(n_chunks, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) {
+            try {
+                ProfileEncoder encoder(parts[c], options);
+                ProfileTsvReader reader(encoder, delimiter);
+                reader.parse_rows(bounds[c], bounds[c + 1], n_fields, 1);
+                encoder.finish();
+            } catch (...) {
+                errors[c] = std::current_exception();
+            }
+        }
+    });
+
+    // Report the first error in file order, with its absolute line number
+    for (size_t c = 0; c < n_chunks; ++c) {
+        if (!errors[c]) {
+            continue;
+        }
+        try {
+            std::rethrow_exception(errors[c]);
+        } catch (const TsvFormatError& e) {
+            size_t lines_before = std::count(data, bounds[c], '\n');
+            throw TsvFormatError(lines_before + e.line(), e.detail());
+        }
+    }
+
+    ProfileStore store;
+    ProfileStoreMerger merger(parts, store);
+    pool.parallel_for(merger.n_loci(), [&](size_t first, size_t last) {
+        for (size_t k = first; k < last; ++k) {
+            merger.merge_locus(k);
+        }
+    }, 16);
+    merger.finish();
+
+    if (store.n_strains() == 0) {
+        throw std::runtime_error("No valid data lines found in profile file");
+    }
+    return store;
+}
+
+#ifndef __EMSCRIPTEN__
+// Map a profile file from disk and parse it on n_threads threads
+inline ProfileStore load_profile_tsv_parallel(
+    const std::string& path,
+    const ParseOptions& options = ParseOptions(),
+    unsigned n_threads = 0,
+    char delimiter = 0
+) {
+    MappedFile file(path);
+    return parse_profile_tsv_parallel(
+        file.data(), file.size(), options, n_threads, delimiter
+    );
+}
+#endif
+
+} // namespace grapetree
+
+#endif // GRAPETREE_PROFILE_TSV_H
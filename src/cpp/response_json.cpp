@@ -0,0 +1,100 @@
+// response_json.cpp - JSON responses of the tree and matrix entry points
+// Shared by the WebAssembly bindings and the benchmark harness, so the
+// serialization that is timed is the one the browser receives
+
+#ifndef GRAPETREE_RESPONSE_JSON_H
+#define GRAPETREE_RESPONSE_JSON_H
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <charconv>
+#include <algorithm>
+
+#include "matrix.cpp"
+#include "memory.cpp"
+#include "mstree.cpp"
+#include "newick.cpp"
+#include "trace.cpp"
+
+namespace grapetree {
+
+// Convert edges to JSON
+template <typename Names>
+nlohmann::json edges_to_json(
+    const std::vector<Edge>& edges,
+    const Names& strain_names
+) {
+    nlohmann::json result = nlohmann::json::array();
+    
+    for (const Edge& e : edges) {
+        nlohmann::json edge_obj;
+        edge_obj["from"] = e.from;
+        edge_obj["to"] = e.to;
+        edge_obj["from_name"] = std::string(strain_names[e.from]);
+        edge_obj["to_name"] = std::string(strain_names[e.to]);
+        edge_obj["distance"] = e.distance;
+        result.push_back(edge_obj);
+    }
+    
+    return result;
+}
+
+// Append a matrix as a JSON array of row arrays, formatting numbers the
+// way nlohmann::json does (shortest round-trip, ".0" on integral values).
+// The text is charged to the output stage while it is written; the
+// reservation is charged first, so a capped run fails before it.
+inline void append_matrix_json(std::string& out, const DenseMatrix& matrix) {
+    GRAPETREE_SPAN_ARG("output", "matrix JSON", "strains", matrix.size());
+    size_t n = matrix.size();
+    char buf[32];
+    
+    MemoryCharge text(MemoryStage::output, out.size() + n * n * 4);
+    out.reserve(out.size() + n * n * 4);
+    out += '[';
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0) out += ',';
+        out += '[';
+        const double* row = matrix.row(i);
+        for (size_t j = 0; j < n; ++j) {
+            if (j > 0) out += ',';
+            char* end = std::to_chars(buf, buf + sizeof(buf), row[j]).ptr;
+            bool integral = std::find_if(buf, end, [](char c) {
+                return c == '.' || c == 'e' || c == 'n' || c == 'i';
+            }) == end;
+            out.append(buf, end);
+            if (integral) out += ".0";
+        }
+        out += ']';
+    }
+    out += ']';
+    text.resize(out.capacity());
+}
+
+// Newick + edge list response shared by the tree entry points
+template <typename Names>
+nlohmann::json tree_response(
+    const std::vector<Edge>& tree_edges,
+    const Names& strain_names,
+    size_t n_nodes
+) {
+    GRAPETREE_SPAN_ARG("output", "tree response", "edges", tree_edges.size());
+    
+    // Format output as Newick
+    NewickFormatter formatter;
+    std::string newick = formatter.format(tree_edges, strain_names);
+    MemoryCharge text(MemoryStage::output, newick.capacity());
+    
+    // Build JSON response
+    nlohmann::json response;
+    response["success"] = true;
+    response["newick"] = std::move(newick);
+    response["edges"] = edges_to_json(tree_edges, strain_names);
+    response["n_nodes"] = n_nodes;
+    response["n_edges"] = tree_edges.size();
+    return response;
+}
+
+} // namespace grapetree
+
+#endif // GRAPETREE_RESPONSE_JSON_H
@@ -0,0 +1,297 @@
+// result_cache.cpp - Content-addressed cache of computed results
+// Requests are keyed by a 64-bit hash of their input bytes and
+// parameters, so re-running an identical analysis (the same file after a
+// page reload) returns the stored result without recomputing it
+//
+// Serialised layout (little-endian):
+//   Header   magic "GTRCACHE", uint32 version, uint32 reserved,
+//            uint64 entry count
+//   Entries  least recently used first; each is uint64 key,
+//            uint64 length, then length result bytes
+
+#ifndef GRAPETREE_RESULT_CACHE_H
+#define GRAPETREE_RESULT_CACHE_H
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+#include "mapped_file.cpp"
+
+namespace grapetree {
+
+// XXH64 (xxHash, 64-bit). Not cryptographic: fine for cache keys over
+// trusted local input, several GB/s, stable across platforms.
+inline uint64_t xxh64(const void* input, size_t size, uint64_t seed = 0) {
+    constexpr uint64_t P1 = 11400714785074694791ull;
+    constexpr uint64_t P2 = 14029467366897019727ull;
+    constexpr uint64_t P3 = 1609587929392839161ull;
+    constexpr uint64_t P4 = 9650029242287828579ull;
+    constexpr uint64_t P5 = 2870177450012600261ull;
+
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const unsigned char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    };
+    auto read32 = [](const unsigned char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    };
+    auto round = [&](uint64_t acc, uint64_t lane) {
+        acc += lane * P2;
+        return rotl(acc, 31) * P1;
+    };
+    auto merge = [&](uint64_t acc, uint64_t v) {
+        acc ^= round(0, v);
+        return acc * P1 + P4;
+    };
+
+    const unsigned char* p = static_cast<const unsigned char*>(input);
+    const unsigned char* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + P1 + P2;
+        uint64_t v2 = seed + P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+
+    h += static_cast<uint64_t>(size);
+
+    for (; end - p >= 8; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (end - p >= 4) {
+        h ^= static_cast<uint64_t>(read32(p)) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= static_cast<uint64_t>(*p) * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Cache key over a sequence of fields (operation, input, parameters).
+// Each field is hashed with the running key as its seed, so field
+// boundaries matter: ("ab", "c") and ("a", "bc") get different keys.
+class ResultKey {
+private:
+    uint64_t hash_ = 0;
+
+public:
+    ResultKey& add(std::string_view field) {
+        hash_ = xxh64(field.data(), field.size(), hash_ ^ field.size());
+        return *this;
+    }
+
+    ResultKey& add(long long value) { return add(std::to_string(value)); }
+
+    uint64_t value() const { return hash_; }
+};
+
+// Least-recently-used map from request key to result, bounded by the
+// total bytes of the stored results. A result larger than the whole
+// budget is not stored.
+class ResultCache {
+public:
+    static constexpr char MAGIC[8] = {'G', 'T', 'R', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr uint32_t VERSION = 1;
+
+private:
+    struct Entry {
+        uint64_t key;
+        std::string value;
+    };
+
+    std::list<Entry> entries_;  // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    size_t max_bytes_;
+    size_t bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+
+public:
+    explicit ResultCache(size_t max_bytes = size_t(64) << 20)
+        : max_bytes_(max_bytes) {}
+
+    size_t size() const { return entries_.size(); }
+    size_t bytes() const { return bytes_; }
+    size_t max_bytes() const { return max_bytes_; }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+    // Copy the result for key into out and mark it most recently used
+    bool find(uint64_t key, std::string& out) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            ++misses_;
+            return false;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        out = it->second->value;
+        ++hits_;
+        return true;
+    }
+
+    void insert(uint64_t key, std::string value) {
+        erase(key);
+        if (value.size() > max_bytes_) {
+            return;
+        }
+        bytes_ += value.size();
+        entries_.push_front(Entry{key, std::move(value)});
+        index_[key] = entries_.begin();
+        evict();
+    }
+
+    void set_max_bytes(size_t max_bytes) {
+        max_bytes_ = max_bytes;
+        evict();
+    }
+
+    void clear() {
+        entries_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+    std::string serialize() const {
+        std::string out;
+        uint64_t count = entries_.size();
+        uint32_t version = VERSION;
+        uint32_t reserved = 0;
+        out.append(MAGIC, sizeof(MAGIC));
+        append(out, &version, sizeof(version));
+        append(out, &reserved, sizeof(reserved));
+        append(out, &count, sizeof(count));
+
+        for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+            uint64_t length = it->value.size();
+            append(out, &it->key, sizeof(it->key));
+            append(out, &length, sizeof(length));
+            out += it->value;
+        }
+        return out;
+    }
+
+    // Merge serialised entries in; they become the most recently used
+    // in their saved order. Throws on a malformed buffer, leaving the
+    // cache as it was.
+    void load(const char* data, size_t size) {
+        const char* p = data;
+        const char* end = data + size;
+        auto take = [&](void* out, size_t bytes) {
+            if (static_cast<size_t>(end - p) < bytes) {
+                throw std::runtime_error("Corrupt result cache: truncated");
+            }
+            std::memcpy(out, p, bytes);
+            p += bytes;
+        };
+
+        char magic[sizeof(MAGIC)];
+        uint32_t version = 0;
+        uint32_t reserved = 0;
+        uint64_t count = 0;
+        take(magic, sizeof(magic));
+        if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw std::runtime_error("Not a GrapeTree result cache");
+        }
+        take(&version, sizeof(version));
+        take(&reserved, sizeof(reserved));
+        if (version != VERSION) {
+            throw std::runtime_error(
+                "Unsupported result cache version " + std::to_string(version)
+            );
+        }
+        take(&count, sizeof(count));
+
+        std::list<Entry> loaded;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t key = 0;
+            uint64_t length = 0;
+            take(&key, sizeof(key));
+            take(&length, sizeof(length));
+            if (static_cast<uint64_t>(end - p) < length) {
+                throw std::runtime_error("Corrupt result cache: truncated");
+            }
+            loaded.push_back(Entry{key, std::string(p, length)});
+            p += length;
+        }
+
+        for (Entry& entry : loaded) {
+            insert(entry.key, std::move(entry.value));
+        }
+    }
+
+#ifndef __EMSCRIPTEN__
+    void save(const std::string& path) const {
+        std::string bytes = serialize();
+        replace_file(path, [&](std::FILE* f) {
+            return std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+        });
+    }
+
+    void load(const std::string& path) {
+        MappedFile file(path);
+        load(file.data(), file.size());
+    }
+#endif
+
+private:
+    void erase(uint64_t key) {
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            bytes_ -= it->second->value.size();
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+    }
+
+    void evict() {
+        while (bytes_ > max_bytes_ && !entries_.empty()) {
+            bytes_ -= entries_.back().value.size();
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+    }
+
+    static void append(std::string& out, const void* p, size_t bytes) {
+        out.append(static_cast<const char*>(p), bytes);
+    }
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_RESULT_CACHE_H
@@ -0,0 +1,139 @@
+// run_profile.cpp - Per-stage timings and work counts of one request
+// Filled in as compute_tree / compute_distance_matrix run when profiling
+// is switched on, and returned as the "profile" section of the response.
+// Counting costs a clock read per stage; the engines keep their counters
+// regardless (TreeCounters), so leaving it on is cheap. Tracked memory
+// (memory.cpp) is reported alongside, as peaks since the request began.
+
+#ifndef GRAPETREE_RUN_PROFILE_H
+#define GRAPETREE_RUN_PROFILE_H
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+#include "mstree.cpp"
+#include "memory.cpp"
+
+namespace grapetree {
+
+// {cap_bytes, current_bytes, peak_bytes, stages: {name: {current_bytes,
+// peak_bytes}}} of tracked memory; peaks are since the last reset_peaks()
+inline nlohmann::json memory_json() {
+    const MemoryAccount& account = MemoryAccount::instance();
+    nlohmann::json stages = nlohmann::json::object();
+    for (size_t s = 0; s < MEMORY_STAGES; ++s) {
+        MemoryStage stage = static_cast<MemoryStage>(s);
+        stages[memory_stage_name(stage)] = {
+            {"current_bytes", account.current(stage)},
+            {"peak_bytes", account.peak(stage)}
+        };
+    }
+
+    nlohmann::json out;
+    out["cap_bytes"] = account.cap();
+    out["current_bytes"] = account.current();
+    out["peak_bytes"] = account.peak();
+    out["stages"] = std::move(stages);
+    return out;
+}
+
+class RunProfile {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stage {
+        std::string name;
+        double seconds;
+    };
+
+    Clock::time_point start_ = Clock::now();
+    std::vector<Stage> stages_;
+    bool cached_ = false;
+
+public:
+    // Work counts; the distance ones are derived from the matrix shape
+    uint64_t pairs_compared = 0;
+    uint64_t loci_scanned = 0;
+    uint64_t bytes_allocated = 0;  // profiles, matrix and response
+    TreeCounters tree;
+
+    // Run fn, recording its wall time under name. A profile pointer that
+    // is null runs fn untimed, so call sites need no branches.
+    template <typename Fn>
+    static auto time(RunProfile* profile, const char* name, Fn&& fn) -> decltype(fn()) {
+        if (!profile) {
+            return fn();
+        }
+        Clock::time_point start = Clock::now();
+        struct Record {
+            RunProfile& profile;
+            const char* name;
+            Clock::time_point start;
+            ~Record() {
+                profile.stages_.push_back(Stage{
+                    name,
+                    std::chrono::duration<double>(Clock::now() - start).count()
+                });
+            }
+        } record{*profile, name, start};
+        return fn();
+    }
+
+    // n_strains x n_strains distances over n_loci loci: every unordered
+    // pair is compared once, whichever matrix is filled
+    void count_distances(size_t n_strains, size_t n_loci) {
+        uint64_t pairs = n_strains > 1 ?
+            uint64_t(n_strains) * (n_strains - 1) / 2 : 0;
+        pairs_compared += pairs;
+        loci_scanned += pairs * n_loci;
+    }
+
+    // The response came from the result cache; nothing was recomputed
+    void set_cached() { cached_ = true; }
+
+    // {total_seconds, stages: {name: seconds}, cached, counters...}
+    nlohmann::json to_json() const {
+        nlohmann::json stages = nlohmann::json::object();
+        for (const Stage& stage : stages_) {
+            stages[stage.name] = stage.seconds;
+        }
+
+        nlohmann::json out;
+        out["total_seconds"] =
+            std::chrono::duration<double>(Clock::now() - start_).count();
+        out["stages"] = std::move(stages);
+        out["cached"] = cached_;
+        out["pairs_compared"] = pairs_compared;
+        out["loci_scanned"] = loci_scanned;
+        out["tie_breaks"] = tree.tie_breaks;
+        out["cycles_contracted"] = tree.cycles_contracted;
+        out["contraction_depth"] = tree.contraction_depth;
+        out["recraft_swaps_tried"] = tree.recraft_swaps_tried;
+        out["recraft_swaps_accepted"] = tree.recraft_swaps_accepted;
+        out["bytes_allocated"] = bytes_allocated;
+        out["memory"] = memory_json();
+        return out;
+    }
+
+    // Add the profile to a JSON object response as its "profile" key
+    void append_to(std::string& response) const {
+        if (response.empty() || response.back() != '}') {
+            return;
+        }
+        response.pop_back();
+        if (response.size() > 1) {
+            response += ',';
+        }
+        response += "\"profile\":";
+        response += to_json().dump();
+        response += '}';
+    }
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_RUN_PROFILE_H
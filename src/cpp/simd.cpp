@@ -0,0 +1,192 @@
+// simd.cpp - Portable 128-bit vectors for the distance kernels
+// Maps to wasm SIMD128 when built with -msimd128, SSE2 natively, and
+// plain four-lane scalar code otherwise, so each kernel is written once
+
+#ifndef GRAPETREE_SIMD_H
+#define GRAPETREE_SIMD_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace grapetree {
+namespace simd {
+
+// 128 bits, viewed as four uint32_t lanes or as two uint64_t bit words
+struct V128 {
+#if defined(__wasm_simd128__)
+    v128_t v;
+#elif defined(__SSE2__)
+    __m128i v;
+#else
+    uint32_t v[4];
+#endif
+};
+
+constexpr size_t U32_LANES = 4;
+constexpr size_t U64_LANES = 2;
+
+// Unaligned loads and stores
+
+inline V128 load(const uint32_t* p) {
+#if defined(__wasm_simd128__)
+    return {wasm_v128_load(p)};
+#elif defined(__SSE2__)
+    return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+#else
+    V128 r;
+    std::memcpy(r.v, p, sizeof(r.v));
+    return r;
+#endif
+}
+
+inline V128 load(const uint64_t* p) {
+#if defined(__wasm_simd128__)
+    return {wasm_v128_load(p)};
+#elif defined(__SSE2__)
+    return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+#else
+    V128 r;
+    std::memcpy(r.v, p, sizeof(r.v));
+    return r;
+#endif
+}
+
+inline void store(uint32_t* p, V128 a) {
+#if defined(__wasm_simd128__)
+    wasm_v128_store(p, a.v);
+#elif defined(__SSE2__)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a.v);
+#else
+    std::memcpy(p, a.v, sizeof(a.v));
+#endif
+}
+
+inline V128 splat(uint32_t x) {
+#if defined(__wasm_simd128__)
+    return {wasm_i32x4_splat(static_cast<int32_t>(x))};
+#elif defined(__SSE2__)
+    return {_mm_set1_epi32(static_cast<int>(x))};
+#else
+    return {{x, x, x, x}};
+#endif
+}
+
+inline V128 zero() { return splat(0); }
+
+// Bitwise operations
+
+inline V128 bit_and(V128 a, V128 b) {
+#if defined(__wasm_simd128__)
+    return {wasm_v128_and(a.v, b.v)};
+#elif defined(__SSE2__)
+    return {_mm_and_si128(a.v, b.v)};
+#else
+    return {{a.v[0] & b.v[0], a.v[1] & b.v[1], a.v[2] & b.v[2], a.v[3] & b.v[3]}};
+#endif
+}
+
+inline V128 bit_or(V128 a, V128 b) {
+#if defined(__wasm_simd128__)
+    return {wasm_v128_or(a.v, b.v)};
+#elif defined(__SSE2__)
+    return {_mm_or_si128(a.v, b.v)};
+#else
+    return {{a.v[0] | b.v[0], a.v[1] | b.v[1], a.v[2] | b.v[2], a.v[3] | b.v[3]}};
+#endif
+}
+
+inline V128 bit_xor(V128 a, V128 b) {
+#if defined(__wasm_simd128__)
+    return {wasm_v128_xor(a.v, b.v)};
+#elif defined(__SSE2__)
+    return {_mm_xor_si128(a.v, b.v)};
+#else
+    return {{a.v[0] ^ b.v[0], a.v[1] ^ b.v[1], a.v[2] ^ b.v[2], a.v[3] ^ b.v[3]}};
+#endif
+}
+
+// b with the bits of mask cleared (b & ~mask)
+inline V128 clear(V128 b, V128 mask) {
+#if defined(__wasm_simd128__)
+    return {wasm_v128_andnot(b.v, mask.v)};
+#elif defined(__SSE2__)
+    return {_mm_andnot_si128(mask.v, b.v)};
+#else
+    return {{b.v[0] & ~mask.v[0], b.v[1] & ~mask.v[1],
+             b.v[2] & ~mask.v[2], b.v[3] & ~mask.v[3]}};
+#endif
+}
+
+// uint32_t lanes
+
+inline V128 add_u32(V128 a, V128 b) {
+#if defined(__wasm_simd128__)
+    return {wasm_i32x4_add(a.v, b.v)};
+#elif defined(__SSE2__)
+    return {_mm_add_epi32(a.v, b.v)};
+#else
+    return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+#endif
+}
+
+// All ones in lanes where a == b, zero elsewhere
+inline V128 eq_u32(V128 a, V128 b) {
+#if defined(__wasm_simd128__)
+    return {wasm_i32x4_eq(a.v, b.v)};
+#elif defined(__SSE2__)
+    return {_mm_cmpeq_epi32(a.v, b.v)};
+#else
+    V128 r;
+    for (size_t i = 0; i < 4; ++i) {
+        r.v[i] = a.v[i] == b.v[i] ? ~0u : 0u;
+    }
+    return r;
+#endif
+}
+
+inline uint32_t sum_u32(V128 a) {
+    uint32_t lanes[U32_LANES];
+    store(lanes, a);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+// Set-bit counts spread over the uint32_t lanes: sum_u32() of the
+// result is the population count of a. Each lane stays small enough
+// to accumulate with add_u32() over billions of bits.
+inline V128 bit_counts(V128 a) {
+#if defined(__wasm_simd128__)
+    v128_t bytes = wasm_i8x16_popcnt(a.v);
+    return {wasm_u32x4_extadd_pairwise_u16x8(
+        wasm_u16x8_extadd_pairwise_u8x16(bytes)
+    )};
+#elif defined(__SSE2__)
+    // Per-byte counts, then summed per 64-bit half into its low lane
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+    __m128i x = a.v;
+    x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi16(x, 1), m1));
+    x = _mm_add_epi8(_mm_and_si128(x, m2),
+                     _mm_and_si128(_mm_srli_epi16(x, 2), m2));
+    x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi16(x, 4)), m4);
+    return {_mm_sad_epu8(x, _mm_setzero_si128())};
+#else
+    V128 r;
+    for (size_t i = 0; i < 4; ++i) {
+        r.v[i] = static_cast<uint32_t>(__builtin_popcount(a.v[i]));
+    }
+    return r;
+#endif
+}
+
+} // namespace simd
+} // namespace grapetree
+
+#endif // GRAPETREE_SIMD_H
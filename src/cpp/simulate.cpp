@@ -0,0 +1,581 @@
+// simulate.cpp - Synthetic cgMLST datasets for scaling benchmarks
+// Simulates clonal expansion on a branching genealogy and writes the
+// strains' allele profiles (delimited or JSON) and, optionally, a
+// matching aligned FASTA and the true genealogy
+//
+// Build: make grapetree-simulate
+//
+// Model: strain i > 0 descends from a uniformly chosen earlier strain (a
+// random recursive tree, the shape of a pure-birth/coalescent genealogy).
+// Along each branch
+//   - a duplicate (probability --duplicates) is an identical copy;
+//   - otherwise Poisson(--mutation-rate) loci change to a new allele, and
+//     with probability --recombination a run of about
+//     --recombination-length loci is imported, each taking an allele
+//     already seen at that locus (homoplasy, as from another lineage).
+// Each written cell is then missing with probability --missing.
+//
+// Strains are written in depth-first order of the genealogy, keeping
+// only the current lineage's changes in memory, so a million strains by
+// thousands of loci stream straight to disk. Output depends only on the
+// options: the random generator is fixed (xoshiro256**), not the
+// standard library's.
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <charconv>
+#include <stdexcept>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+
+namespace {
+
+const char* USAGE =
+    "Usage: grapetree-simulate [options]\n"
+    "\n"
+    "Writes a synthetic cgMLST collection grown by clonal expansion.\n"
+    "\n"
+    "  -n, --strains N              strains (default 1000)\n"
+    "  -l, --loci N                 loci (default 3000)\n"
+    "  -r, --mutation-rate X        mean new alleles per branch (default 2)\n"
+    "      --recombination P        chance a branch imports a run of loci\n"
+    "                               (default 0.05)\n"
+    "      --recombination-length N mean loci per import (default 20)\n"
+    "  -d, --duplicates P           fraction of identical copies (default 0.1)\n"
+    "  -m, --missing P              fraction of missing cells (default 0.01)\n"
+    "  -s, --seed N                 random seed (default 1)\n"
+    "  -f, --format FORMAT          tsv (default), csv or json\n"
+    "  -o, --output PREFIX          write PREFIX.tsv/.csv/.json instead of\n"
+    "                               stdout\n"
+    "      --fasta                  also write PREFIX.fasta, an aligned FASTA\n"
+    "                               with one segment per locus\n"
+    "      --locus-length N         bases per locus in the FASTA (default 12)\n"
+    "      --truth                  also write PREFIX.truth.tsv: parent,\n"
+    "                               child and alleles changed per branch\n"
+    "  -h, --help                   show this help\n";
+
+class UsageError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct SimulateOptions {
+    uint64_t n_strains = 1000;
+    uint64_t n_loci = 3000;
+    double mutation_rate = 2.0;
+    double recombination = 0.05;
+    double recombination_length = 20.0;
+    double duplicates = 0.1;
+    double missing = 0.01;
+    uint64_t seed = 1;
+    std::string format = "tsv";
+    std::string output;
+    bool fasta = false;
+    uint64_t locus_length = 12;
+    bool truth = false;
+};
+
+// xoshiro256** seeded through splitmix64
+class Random {
+private:
+    uint64_t s_[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    explicit Random(uint64_t seed) {
+        for (uint64_t& s : s_) {
+            seed += 0x9e3779b97f4a7c15ull;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            s = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(s_[1] * 5, 7) * 9;
+        uint64_t t = s_[1] << 17;
+        s_[2] ^= s_[0];
+        s_[3] ^= s_[1];
+        s_[1] ^= s_[2];
+        s_[0] ^= s_[3];
+        s_[2] ^= t;
+        s_[3] = rotl(s_[3], 45);
+        return result;
+    }
+
+    // [0, 1)
+    double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+    // [0, n)
+    uint64_t below(uint64_t n) {
+        return static_cast<uint64_t>(
+            (static_cast<unsigned __int128>(next()) * n) >> 64
+        );
+    }
+
+    bool chance(double p) { return uniform() < p; }
+
+    // Knuth's method; the means here are small
+    uint64_t poisson(double mean) {
+        if (mean <= 0.0) {
+            return 0;
+        }
+        double limit = std::exp(-mean);
+        double product = uniform();
+        uint64_t k = 0;
+        while (product > limit) {
+            ++k;
+            product *= uniform();
+        }
+        return k;
+    }
+
+    // Failures before the first success, success probability p
+    uint64_t geometric(double p) {
+        if (p >= 1.0) {
+            return 0;
+        }
+        if (p <= 0.0) {
+            return UINT64_MAX;
+        }
+        double u = 1.0 - uniform();  // (0, 1]
+        double k = std::floor(std::log(u) / std::log1p(-p));
+        return k >= 1.8e19 ? UINT64_MAX : static_cast<uint64_t>(k);
+    }
+};
+
+// Buffered writer for one output file (or stdout)
+class Output {
+private:
+    std::FILE* file_;
+    std::string path_;
+    std::string buffer_;
+
+public:
+    explicit Output(const std::string& path)
+        : file_(path.empty() ? stdout : std::fopen(path.c_str(), "wb")),
+          path_(path.empty() ? "stdout" : path) {
+        if (!file_) {
+            throw std::runtime_error(
+                "Cannot write " + path + ": " + std::strerror(errno)
+            );
+        }
+        buffer_.reserve(1 << 20);
+    }
+
+    ~Output() {
+        if (file_ && file_ != stdout) {
+            std::fclose(file_);
+        }
+    }
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    std::string& buffer() { return buffer_; }
+
+    void number(uint64_t value) {
+        char digits[24];
+        char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        buffer_.append(digits, end);
+    }
+
+    // Write the buffer out once it is large
+    void flush_if_full() {
+        if (buffer_.size() >= (1 << 20)) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (std::fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size()) {
+            throw std::runtime_error("Error writing " + path_);
+        }
+        buffer_.clear();
+    }
+
+    void close() {
+        flush();
+        bool ok = std::fflush(file_) == 0;
+        if (file_ != stdout) {
+            ok = std::fclose(file_) == 0 && ok;
+        }
+        file_ = nullptr;
+        if (!ok) {
+            throw std::runtime_error("Error writing " + path_);
+        }
+    }
+};
+
+// Random recursive tree as child lists (CSR, children in birth order)
+struct Genealogy {
+    std::vector<uint32_t> parent;
+    std::vector<uint64_t> first_child;  // n + 1 offsets into children
+    std::vector<uint32_t> children;
+};
+
+Genealogy grow(uint64_t n, Random& random) {
+    Genealogy g;
+    g.parent.assign(n, 0);
+    g.first_child.assign(n + 1, 0);
+    for (uint64_t i = 1; i < n; ++i) {
+        g.parent[i] = static_cast<uint32_t>(random.below(i));
+        ++g.first_child[g.parent[i] + 1];
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+        g.first_child[i + 1] += g.first_child[i];
+    }
+    g.children.resize(n > 0 ? n - 1 : 0);
+    std::vector<uint64_t> fill(g.first_child.begin(), g.first_child.end() - 1);
+    for (uint64_t i = 1; i < n; ++i) {
+        g.children[fill[g.parent[i]]++] = static_cast<uint32_t>(i);
+    }
+    return g;
+}
+
+// Sequence of allele a at a locus: the locus' reference bases (allele 1)
+// with a few substitutions derived from (locus, allele)
+class AlleleSequences {
+private:
+    uint64_t length_;
+    uint64_t seed_;
+
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+public:
+    AlleleSequences(uint64_t length, uint64_t seed) : length_(length), seed_(seed) {}
+
+    void append(std::string& out, uint64_t locus, uint32_t allele) const {
+        static const char BASES[] = "ACGT";
+        size_t start = out.size();
+        if (allele == 0) {
+            out.append(length_, 'N');
+            return;
+        }
+        for (uint64_t p = 0; p < length_; ++p) {
+            out += BASES[mix(seed_ ^ (locus * length_ + p)) & 3];
+        }
+        if (allele == 1) {
+            return;
+        }
+        uint64_t h = mix(seed_ + locus * 0x100000001b3ull + allele);
+        int substitutions = 1 + static_cast<int>(h & 1);
+        for (int k = 0; k < substitutions; ++k) {
+            h = mix(h);
+            char& base = out[start + (h >> 8) % length_];
+            const char* at = std::strchr(BASES, base);
+            base = BASES[(at - BASES + 1 + (h & 3) % 3) & 3];
+        }
+    }
+};
+
+void simulate(const SimulateOptions& options) {
+    uint64_t n = options.n_strains;
+    uint64_t n_loci = options.n_loci;
+    if (n == 0 || n_loci == 0) {
+        throw UsageError("Need at least one strain and one locus");
+    }
+    if (n > UINT32_MAX) {
+        throw UsageError("At most 4294967295 strains");
+    }
+
+    Random random(options.seed);
+    Genealogy genealogy = grow(n, random);
+
+    std::string extension = options.format == "json" ? ".json" :
+        options.format == "csv" ? ".csv" : ".tsv";
+    char separator = options.format == "csv" ? ',' : '\t';
+    bool json = options.format == "json";
+
+    Output profiles(options.output.empty() ? "" : options.output + extension);
+    std::unique_ptr<Output> fasta;
+    std::unique_ptr<Output> truth;
+    if (options.fasta) {
+        fasta = std::make_unique<Output>(options.output + ".fasta");
+    }
+    if (options.truth) {
+        truth = std::make_unique<Output>(options.output + ".truth.tsv");
+        truth->buffer() += "parent\tchild\tchanged\n";
+    }
+    AlleleSequences sequences(options.locus_length, options.seed);
+
+    // Name width so names sort in birth order
+    int width = static_cast<int>(std::to_string(n).size());
+    auto append_name = [&](std::string& out, uint64_t strain) {
+        char name[32];
+        int length = std::snprintf(name, sizeof(name), "strain_%0*llu", width,
+                                   static_cast<unsigned long long>(strain + 1));
+        out.append(name, static_cast<size_t>(length));
+    };
+
+    if (json) {
+        // Profiles stream out as they are made; the names, which the
+        // reader accepts in either order, follow at the end
+        profiles.buffer() += "{\"profiles\":[";
+    } else {
+        profiles.buffer() += "#ST";
+        for (uint64_t locus = 0; locus < n_loci; ++locus) {
+            profiles.buffer() += separator;
+            profiles.buffer() += "locus_";
+            profiles.number(locus + 1);
+        }
+        profiles.buffer() += '\n';
+    }
+
+    std::vector<uint32_t> alleles(n_loci, 1);
+    std::vector<uint32_t> n_alleles(n_loci, 1);
+    std::vector<uint32_t> order;  // depth-first order, for the JSON names
+    if (json) {
+        order.reserve(n);
+    }
+
+    // Changes made on the current lineage: (locus, previous allele), and
+    // where each open strain's changes start
+    std::vector<std::pair<uint32_t, uint32_t>> undo;
+    struct Frame {
+        uint32_t strain;
+        uint64_t next_child;
+        size_t undo_start;
+    };
+    std::vector<Frame> stack;
+
+    uint64_t gap = random.geometric(options.missing);
+
+    auto write_strain = [&](uint32_t strain) {
+        if (json) {
+            profiles.buffer() += strain == 0 ? "[" : ",[";
+            order.push_back(strain);
+        } else {
+            append_name(profiles.buffer(), strain);
+        }
+        if (fasta) {
+            fasta->buffer() += '>';
+            append_name(fasta->buffer(), strain);
+            fasta->buffer() += '\n';
+        }
+
+        for (uint64_t locus = 0; locus < n_loci; ++locus) {
+            uint32_t allele = alleles[locus];
+            if (gap == 0) {
+                allele = 0;
+                gap = random.geometric(options.missing);
+            } else if (gap != UINT64_MAX) {
+                --gap;
+            }
+            if (json) {
+                if (locus != 0) {
+                    profiles.buffer() += ',';
+                }
+                if (allele == 0) {
+                    profiles.buffer() += "null";
+                } else {
+                    profiles.number(allele);
+                }
+            } else {
+                profiles.buffer() += separator;
+                if (allele == 0) {
+                    profiles.buffer() += '-';
+                } else {
+                    profiles.number(allele);
+                }
+            }
+            if (fasta) {
+                sequences.append(fasta->buffer(), locus, allele);
+            }
+        }
+        profiles.buffer() += json ? "]" : "\n";
+        profiles.flush_if_full();
+        if (fasta) {
+            fasta->buffer() += '\n';
+            fasta->flush_if_full();
+        }
+    };
+
+    auto mutate = [&](uint32_t strain) {
+        uint64_t changed = 0;
+        if (!random.chance(options.duplicates)) {
+            uint64_t mutations = random.poisson(options.mutation_rate);
+            for (uint64_t m = 0; m < mutations; ++m) {
+                uint32_t locus = static_cast<uint32_t>(random.below(n_loci));
+                undo.emplace_back(locus, alleles[locus]);
+                alleles[locus] = ++n_alleles[locus];
+                ++changed;
+            }
+            if (random.chance(options.recombination)) {
+                uint64_t length = 1 + random.geometric(
+                    1.0 / std::max(1.0, options.recombination_length)
+                );
+                uint64_t start = random.below(n_loci);
+                for (uint64_t k = 0; k < length && start + k < n_loci; ++k) {
+                    uint32_t locus = static_cast<uint32_t>(start + k);
+                    uint32_t donor = 1 + static_cast<uint32_t>(
+                        random.below(n_alleles[locus])
+                    );
+                    if (donor != alleles[locus]) {
+                        undo.emplace_back(locus, alleles[locus]);
+                        alleles[locus] = donor;
+                        ++changed;
+                    }
+                }
+            }
+        }
+        if (truth) {
+            append_name(truth->buffer(), genealogy.parent[strain]);
+            truth->buffer() += '\t';
+            append_name(truth->buffer(), strain);
+            truth->buffer() += '\t';
+            truth->number(changed);
+            truth->buffer() += '\n';
+            truth->flush_if_full();
+        }
+    };
+
+    write_strain(0);
+    stack.push_back(Frame{0, genealogy.first_child[0], 0});
+    while (!stack.empty()) {
+        Frame& top = stack.back();
+        if (top.next_child == genealogy.first_child[top.strain + 1]) {
+            for (size_t k = undo.size(); k > top.undo_start; --k) {
+                alleles[undo[k - 1].first] = undo[k - 1].second;
+            }
+            undo.resize(top.undo_start);
+            stack.pop_back();
+            continue;
+        }
+        uint32_t child = genealogy.children[top.next_child++];
+        size_t start = undo.size();
+        mutate(child);
+        write_strain(child);
+        stack.push_back(Frame{child, genealogy.first_child[child], start});
+    }
+
+    if (json) {
+        profiles.buffer() += "],\"strains\":[";
+        for (size_t k = 0; k < order.size(); ++k) {
+            profiles.buffer() += k == 0 ? "\"" : ",\"";
+            append_name(profiles.buffer(), order[k]);
+            profiles.buffer() += '"';
+            profiles.flush_if_full();
+        }
+        profiles.buffer() += "]}\n";
+    }
+
+    profiles.close();
+    if (fasta) {
+        fasta->close();
+    }
+    if (truth) {
+        truth->close();
+    }
+}
+
+double parse_number(const std::string& text, const std::string& option) {
+    char* end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0' || !(value >= 0.0)) {
+        throw UsageError(option + " expects a non-negative number, got '" + text + "'");
+    }
+    return value;
+}
+
+uint64_t parse_count(const std::string& text, const std::string& option) {
+    uint64_t value = 0;
+    const char* end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value);
+    if (result.ec != std::errc() || result.ptr != end) {
+        throw UsageError(option + " expects a whole number, got '" + text + "'");
+    }
+    return value;
+}
+
+double parse_fraction(const std::string& text, const std::string& option) {
+    double value = parse_number(text, option);
+    if (value > 1.0) {
+        throw UsageError(option + " must be between 0 and 1");
+    }
+    return value;
+}
+
+SimulateOptions parse_arguments(int argc, char** argv) {
+    SimulateOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw UsageError(arg + " expects a value");
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") {
+            std::fputs(USAGE, stdout);
+            std::exit(0);
+        } else if (arg == "-n" || arg == "--strains") {
+            options.n_strains = parse_count(value(), arg);
+        } else if (arg == "-l" || arg == "--loci") {
+            options.n_loci = parse_count(value(), arg);
+        } else if (arg == "-r" || arg == "--mutation-rate") {
+            options.mutation_rate = parse_number(value(), arg);
+        } else if (arg == "--recombination") {
+            options.recombination = parse_fraction(value(), arg);
+        } else if (arg == "--recombination-length") {
+            options.recombination_length = parse_number(value(), arg);
+        } else if (arg == "-d" || arg == "--duplicates") {
+            options.duplicates = parse_fraction(value(), arg);
+        } else if (arg == "-m" || arg == "--missing") {
+            options.missing = parse_fraction(value(), arg);
+        } else if (arg == "-s" || arg == "--seed") {
+            options.seed = parse_count(value(), arg);
+        } else if (arg == "-f" || arg == "--format") {
+            options.format = value();
+        } else if (arg == "-o" || arg == "--output") {
+            options.output = value();
+        } else if (arg == "--fasta") {
+            options.fasta = true;
+        } else if (arg == "--locus-length") {
+            options.locus_length = parse_count(value(), arg);
+        } else if (arg == "--truth") {
+            options.truth = true;
+        } else {
+            throw UsageError("Unknown option " + arg);
+        }
+    }
+
+    if (options.format != "tsv" && options.format != "csv" && options.format != "json") {
+        throw UsageError("Unknown format " + options.format);
+    }
+    if ((options.fasta || options.truth) && options.output.empty()) {
+        throw UsageError("--fasta and --truth need --output");
+    }
+    if (options.fasta && options.locus_length == 0) {
+        throw UsageError("--locus-length must be at least 1");
+    }
+    return options;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        simulate(parse_arguments(argc, argv));
+        return 0;
+    } catch (const UsageError& e) {
+        std::fprintf(stderr, "grapetree-simulate: %s\n\n%s", e.what(), USAGE);
+        return 2;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "grapetree-simulate: %s\n", e.what());
+        return 1;
+    }
+}
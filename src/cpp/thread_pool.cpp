@@ -0,0 +1,211 @@
+// thread_pool.cpp - Shared worker pool for the parallel engines
+// Natively and in the pthreads wasm build, a fixed set of workers runs
+// parallel_for() batches; in the single-threaded wasm build the same
+// calls run inline on the calling thread
+
+#ifndef GRAPETREE_THREAD_POOL_H
+#define GRAPETREE_THREAD_POOL_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define GRAPETREE_HAS_THREADS 1
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+namespace grapetree {
+
+// Runs one parallel_for() batch at a time across its workers and the
+// calling thread. Indices are handed out dynamically in grains, so
+// uneven work (e.g. the shrinking rows of a triangular matrix) balances
+// itself. A parallel_for() issued from inside a batch runs inline.
+class ThreadPool {
+public:
+    using Range = std::function<void(size_t begin, size_t end)>;
+
+private:
+    struct Batch {
+        const Range* body = nullptr;
+        size_t n = 0;
+        size_t grain = 1;
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;  // written once, by the first failure
+    };
+
+    unsigned n_threads_ = 1;
+
+#ifdef GRAPETREE_HAS_THREADS
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::mutex submit_mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    Batch* batch_ = nullptr;
+    size_t generation_ = 0;
+    size_t busy_ = 0;
+    bool stopping_ = false;
+#endif
+
+public:
+    // n_threads counts the calling thread; 0 means one per core
+    explicit ThreadPool(unsigned n_threads = 0) {
+#ifdef GRAPETREE_HAS_THREADS
+        if (n_threads == 0) {
+            n_threads = std::thread::hardware_concurrency();
+        }
+        n_threads_ = n_threads > 0 ? n_threads : 1;
+        for (unsigned t = 1; t < n_threads_; ++t) {
+            workers_.emplace_back([this]() { work(); });
+        }
+#else
+        (void)n_threads;
+#endif
+    }
+
+    ~ThreadPool() {
+#ifdef GRAPETREE_HAS_THREADS
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+#endif
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return n_threads_; }
+
+    // body(begin, end) over [0, n) in ranges of at most grain indices.
+    // Blocks until every range has run; rethrows the first exception.
+    void parallel_for(size_t n, const Range& body, size_t grain = 1) {
+        if (n == 0) {
+            return;
+        }
+        grain = grain > 0 ? grain : 1;
+
+        Batch batch;
+        batch.body = &body;
+        batch.n = n;
+        batch.grain = grain;
+
+#ifdef GRAPETREE_HAS_THREADS
+        if (workers_.empty() || in_batch() || n <= grain) {
+            run(batch);
+        } else {
+            std::lock_guard<std::mutex> submit(submit_mutex_);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                batch_ = &batch;
+                ++generation_;
+            }
+            wake_.notify_all();
+
+            run(batch);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            idle_.wait(lock, [&] { return busy_ == 0; });
+            batch_ = nullptr;
+        }
+#else
+        run(batch);
+#endif
+
+        if (batch.error) {
+            std::rethrow_exception(batch.error);
+        }
+    }
+
+    // Process-wide pool used by the engines, sized to the machine
+    // (navigator.hardwareConcurrency in the pthreads wasm build) unless
+    // set_shared_threads() was called first
+    static ThreadPool& shared() {
+        static ThreadPool pool(shared_threads());
+        return pool;
+    }
+
+    // Size of the shared pool; only takes effect before its first use
+    static void set_shared_threads(unsigned n_threads) {
+        shared_threads() = n_threads;
+    }
+
+private:
+    static unsigned& shared_threads() {
+        static unsigned n_threads = 0;
+        return n_threads;
+    }
+
+    static bool& in_batch() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    static void run(Batch& batch) {
+        bool outer = !in_batch();
+        in_batch() = true;
+        for (;;) {
+            size_t begin = batch.next.fetch_add(batch.grain);
+            if (begin >= batch.n) {
+                break;
+            }
+            size_t end = begin + batch.grain < batch.n ?
+                begin + batch.grain : batch.n;
+            try {
+                (*batch.body)(begin, end);
+            } catch (...) {
+                // Record the first failure and drain the remaining ranges
+                if (!batch.failed.exchange(true)) {
+                    batch.error = std::current_exception();
+                }
+                batch.next.store(batch.n);
+            }
+        }
+        if (outer) {
+            in_batch() = false;
+        }
+    }
+
+#ifdef GRAPETREE_HAS_THREADS
+    void work() {
+        size_t seen = 0;
+        for (;;) {
+            Batch* batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] {
+                    return stopping_ || (batch_ && generation_ != seen);
+                });
+                if (stopping_) {
+                    return;
+                }
+                seen = generation_;
+                batch = batch_;
+                ++busy_;
+            }
+
+            run(*batch);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --busy_;
+            }
+            idle_.notify_all();
+        }
+    }
+#endif
+};
+
+} // namespace grapetree
+
+#endif // GRAPETREE_THREAD_POOL_H
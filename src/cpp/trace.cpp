@@ -0,0 +1,231 @@
+// trace.cpp - Scoped trace spans exported as Chrome trace-event JSON
+// Engines mark their work with GRAPETREE_SPAN*; each thread records into
+// its own buffer and trace_json() merges them into a document that
+// chrome://tracing and Perfetto (ui.perfetto.dev) load, one track per
+// thread. Built without GRAPETREE_TRACE (the default; make TRACE=1 turns
+// it on) the macros expand to nothing and their arguments are never
+// evaluated.
+//
+//   GRAPETREE_SPAN("tree", "recraft");              // until end of scope
+//   GRAPETREE_SPAN_ARG("distance", "rows", "first", b);
+//   GRAPETREE_SPAN_VAR(span, "tree", "Prim", "first", 1);
+//   GRAPETREE_SPAN_EVERY(span, 1024, count);       // new span each 1024
+
+#ifndef GRAPETREE_TRACE_H
+#define GRAPETREE_TRACE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#ifdef GRAPETREE_TRACE
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <charconv>
+#endif
+
+namespace grapetree {
+
+#ifdef GRAPETREE_TRACE
+
+namespace trace {
+
+// Complete ("X") event; names are string literals
+struct Event {
+    const char* category;
+    const char* name;
+    const char* arg_name;  // nullptr = no argument
+    int64_t arg;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+// One thread's events. The owning thread appends; the lock is only ever
+// contended while trace_json() or clear_trace() run.
+struct ThreadBuffer {
+    uint32_t tid;
+    std::mutex mutex;
+    std::vector<Event> events;
+};
+
+class Recorder {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point epoch_ = Clock::now();
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;  // outlive their threads
+
+public:
+    static Recorder& instance() {
+        static Recorder recorder;
+        return recorder;
+    }
+
+    uint64_t now_ns() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - epoch_
+        ).count());
+    }
+
+    ThreadBuffer& local() {
+        thread_local std::shared_ptr<ThreadBuffer> buffer = enroll();
+        return *buffer;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& buffer : buffers_) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            buffer->events.clear();
+        }
+    }
+
+    std::string json() {
+        std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        char number[32];
+        auto append_number = [&](uint64_t value) {
+            out.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+        };
+        // Microseconds with nanosecond precision
+        auto append_us = [&](uint64_t ns) {
+            append_number(ns / 1000);
+            out += '.';
+            uint64_t fraction = ns % 1000;
+            out += static_cast<char>('0' + fraction / 100);
+            out += static_cast<char>('0' + fraction / 10 % 10);
+            out += static_cast<char>('0' + fraction % 10);
+        };
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& buffer : buffers_) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+            if (!first) {
+                out += ',';
+            }
+            first = false;
+            out += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":";
+            append_number(buffer->tid);
+            out += ",\"args\":{\"name\":\"thread ";
+            append_number(buffer->tid);
+            out += "\"}}";
+
+            for (const Event& event : buffer->events) {
+                out += ",{\"ph\":\"X\",\"pid\":1,\"tid\":";
+                append_number(buffer->tid);
+                out += ",\"cat\":\"";
+                out += event.category;
+                out += "\",\"name\":\"";
+                out += event.name;
+                out += "\",\"ts\":";
+                append_us(event.start_ns);
+                out += ",\"dur\":";
+                append_us(event.duration_ns);
+                if (event.arg_name) {
+                    out += ",\"args\":{\"";
+                    out += event.arg_name;
+                    out += "\":";
+                    if (event.arg < 0) {
+                        out += '-';
+                    }
+                    append_number(static_cast<uint64_t>(event.arg < 0 ? -event.arg : event.arg));
+                    out += '}';
+                }
+                out += '}';
+            }
+        }
+        out += "]}";
+        return out;
+    }
+
+private:
+    // Threads are numbered in the order they open their first span, so
+    // the thread driving the engines is normally 0
+    std::shared_ptr<ThreadBuffer> enroll() {
+        auto buffer = std::make_shared<ThreadBuffer>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffer->tid = static_cast<uint32_t>(buffers_.size());
+        buffers_.push_back(buffer);
+        return buffer;
+    }
+};
+
+class Span {
+private:
+    ThreadBuffer& buffer_;
+    Event event_;
+
+public:
+    Span(const char* category, const char* name,
+         const char* arg_name = nullptr, int64_t arg = 0)
+        : buffer_(Recorder::instance().local()),
+          event_{category, name, arg_name, arg, Recorder::instance().now_ns(), 0} {}
+
+    ~Span() { close(); }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    // End this span and start the next one of the same name
+    void restart(int64_t arg) {
+        close();
+        event_.arg = arg;
+        event_.start_ns = Recorder::instance().now_ns();
+    }
+
+private:
+    void close() {
+        event_.duration_ns = Recorder::instance().now_ns() - event_.start_ns;
+        std::lock_guard<std::mutex> lock(buffer_.mutex);
+        buffer_.events.push_back(event_);
+    }
+};
+
+} // namespace trace
+
+#define GRAPETREE_TRACE_CONCAT2(a, b) a##b
+#define GRAPETREE_TRACE_CONCAT(a, b) GRAPETREE_TRACE_CONCAT2(a, b)
+#define GRAPETREE_SPAN(category, name) \
+    ::grapetree::trace::Span GRAPETREE_TRACE_CONCAT(grapetree_span_, __LINE__)(category, name)
+#define GRAPETREE_SPAN_ARG(category, name, arg_name, arg) \
+    ::grapetree::trace::Span GRAPETREE_TRACE_CONCAT(grapetree_span_, __LINE__)( \
+        category, name, arg_name, static_cast<int64_t>(arg))
+#define GRAPETREE_SPAN_VAR(var, category, name, arg_name, arg) \
+    ::grapetree::trace::Span var(category, name, arg_name, static_cast<int64_t>(arg))
+#define GRAPETREE_SPAN_EVERY(var, period, arg) \
+    do { \
+        if ((arg) % (period) == 0) var.restart(static_cast<int64_t>(arg)); \
+    } while (0)
+
+// Chrome trace-event JSON of every span recorded so far. Call it while
+// no engine is running, or the running spans are simply not in it yet.
+inline std::string trace_json() {
+    return trace::Recorder::instance().json();
+}
+
+inline void clear_trace() {
+    trace::Recorder::instance().clear();
+}
+
+#else // GRAPETREE_TRACE
+
+#define GRAPETREE_SPAN(category, name) ((void)0)
+#define GRAPETREE_SPAN_ARG(category, name, arg_name, arg) ((void)0)
+#define GRAPETREE_SPAN_VAR(var, category, name, arg_name, arg) ((void)0)
+#define GRAPETREE_SPAN_EVERY(var, period, arg) ((void)0)
+
+// An empty trace, saying how to get a real one
+inline std::string trace_json() {
+    return "{\"traceEvents\":[],\"otherData\":{\"tracing\":"
+           "\"disabled; build with -DGRAPETREE_TRACE (make TRACE=1)\"}}";
+}
+
+inline void clear_trace() {}
+
+#endif // GRAPETREE_TRACE
+
+} // namespace grapetree
+
+#endif // GRAPETREE_TRACE_H
@@ -0,0 +1,314 @@
+// vcf_reader.cpp - Streaming multi-sample VCF reader
+// Keeps biallelic SNVs only and packs each sample's genotypes into
+// alt/missing bit planes as records arrive, so no pseudo-alignment
+// is ever built
+
+#ifndef GRAPETREE_VCF_READER_H
+#define GRAPETREE_VCF_READER_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#include "profile_store.cpp"
+#include "mapped_file.cpp"
+#include "memory.cpp"
+
+namespace grapetree {
+
+// One sample's genotypes over the kept sites, 64 sites per word.
+// alt is set where the call carries the alternate allele (including
+// heterozygous calls); missing is set for no-calls. Padding past the
+// last site is ref and not missing.
+struct PackedGenotypes {
+    TrackedVector<uint64_t> alt = tracked_vector<uint64_t>(MemoryStage::encode);
+    TrackedVector<uint64_t> missing = tracked_vector<uint64_t>(MemoryStage::encode);
+};
+
+class SnpMatrix {
+private:
+    StringArena names_;
+    std::vector<PackedGenotypes> samples_;
+    size_t n_sites_ = 0;
+    size_t n_skipped_ = 0;
+
+    friend class VcfReader;
+
+public:
+    size_t n_samples() const { return samples_.size(); }
+    size_t n_sites() const { return n_sites_; }
+    size_t n_words() const { return (n_sites_ + 63) / 64; }
+
+    // Records dropped for not being biallelic SNVs
+    size_t n_skipped() const { return n_skipped_; }
+
+    const StringArena& names() const { return names_; }
+    const PackedGenotypes& sample(size_t i) const { return samples_[i]; }
+};
+
+// Incremental VCF parser. Like FastaReader, input may be split at any
+// byte boundary: feed() each chunk, then finish() once. Only a partial
+// trailing line is buffered between chunks.
+class VcfReader {
+private:
+    // Fixed columns before the samples: CHROM POS ID REF ALT QUAL
+    // FILTER INFO FORMAT
+    static constexpr size_t FIXED_FIELDS = 9;
+
+    SnpMatrix matrix_;
+    std::string carry_;
+    bool have_header_ = false;
+    size_t line_ = 0;
+    std::vector<uint64_t> alt_;
+    std::vector<uint64_t> missing_;
+
+public:
+    void feed(const char* data, size_t size) {
+        const char* end = data + size;
+        const char* p = data;
+
+        if (!carry_.empty()) {
+            const void* nl = std::memchr(p, '\n', end - p);
+            if (!nl) {
+                carry_.append(p, end);
+                return;
+            }
+            const char* eol = static_cast<const char*>(nl);
+            carry_.append(p, eol);
+            parse_line(carry_.data(), carry_.data() + carry_.size());
+            carry_.clear();
+            p = eol + 1;
+        }
+
+        while (p < end) {
+            const void* nl = std::memchr(p, '\n', end - p);
+            if (!nl) {
+                carry_.assign(p, end);
+                return;
+            }
+            const char* eol = static_cast<const char*>(nl);
+            parse_line(p, eol);
+            p = eol + 1;
+        }
+    }
+
+    void feed(std::string_view chunk) { feed(chunk.data(), chunk.size()); }
+
+    SnpMatrix finish() {
+        if (!carry_.empty()) {
+            parse_line(carry_.data(), carry_.data() + carry_.size());
+            carry_.clear();
+        }
+
+        if (!have_header_) {
+            throw std::runtime_error("VCF input has no #CHROM header line");
+        }
+        if ((matrix_.n_sites_ & 63) != 0) {
+            flush_word();
+        }
+        return std::move(matrix_);
+    }
+
+private:
+    void parse_line(const char* p, const char* end) {
+        ++line_;
+        if (end > p && end[-1] == '\r') {
+            --end;
+        }
+        if (p == end) {
+            return;
+        }
+
+        if (*p == '#') {
+            if (end - p > 1 && p[1] == '#') {
+                return;  // ## meta-information
+            }
+            parse_header(p, end);
+            return;
+        }
+
+        if (!have_header_) {
+            throw std::runtime_error(
+                "Line " + std::to_string(line_) +
+                ": VCF record before the #CHROM header line"
+            );
+        }
+        parse_record(p, end);
+    }
+
+    // #CHROM POS ID REF ALT QUAL FILTER INFO FORMAT sample...
+    void parse_header(const char* p, const char* end) {
+        if (have_header_) {
+            throw std::runtime_error(
+                "Line " + std::to_string(line_) + ": duplicate #CHROM header"
+            );
+        }
+
+        size_t field = 0;
+        while (p <= end) {
+            const char* tab = next_tab(p, end);
+            if (field >= FIXED_FIELDS) {
+                matrix_.names_.push(std::string_view(p, tab - p));
+            }
+            ++field;
+            p = tab + 1;
+        }
+
+        size_t n = matrix_.names_.size();
+        if (n == 0) {
+            throw std::runtime_error("VCF header lists no samples");
+        }
+        matrix_.samples_.resize(n);
+        alt_.assign(n, 0);
+        missing_.assign(n, 0);
+        have_header_ = true;
+    }
+
+    void parse_record(const char* p, const char* end) {
+        std::string_view fields[FIXED_FIELDS];
+        for (size_t f = 0; f < FIXED_FIELDS; ++f) {
+            if (p > end) {
+                throw record_error("truncated record");
+            }
+            const char* tab = next_tab(p, end);
+            fields[f] = std::string_view(p, tab - p);
+            p = tab + 1;
+        }
+
+        const std::string_view& ref = fields[3];
+        const std::string_view& alt = fields[4];
+        int gt_index = genotype_index(fields[8]);
+        if (!is_base(ref) || !is_base(alt) || gt_index < 0) {
+            ++matrix_.n_skipped_;
+            return;
+        }
+
+        uint64_t bit = uint64_t(1) << (matrix_.n_sites_ & 63);
+        size_t n = matrix_.n_samples();
+        size_t j = 0;
+        for (; j < n && p <= end; ++j) {
+            const char* tab = next_tab(p, end);
+            switch (parse_genotype(subfield(p, tab, gt_index))) {
+                case ALT:
+                    alt_[j] |= bit;
+                    break;
+                case MISSING:
+                    missing_[j] |= bit;
+                    break;
+                case REF:
+                    break;
+            }
+            p = tab + 1;
+        }
+        if (j != n || p <= end) {
+            throw record_error(
+                "expected " + std::to_string(n) + " sample columns"
+            );
+        }
+
+        if ((++matrix_.n_sites_ & 63) == 0) {
+            flush_word();
+        }
+    }
+
+    enum Genotype { REF, ALT, MISSING };
+
+    // Haploid ("1") or diploid ("0/1", "1|1") call on a biallelic site
+    static Genotype parse_genotype(std::string_view gt) {
+        if (gt.empty()) {
+            return MISSING;
+        }
+        Genotype result = REF;
+        for (char c : gt) {
+            if (c == '.') {
+                return MISSING;
+            }
+            if (c == '1') {
+                result = ALT;
+            }
+        }
+        return result;
+    }
+
+    static bool is_base(std::string_view allele) {
+        if (allele.size() != 1) {
+            return false;
+        }
+        switch (allele[0]) {
+            case 'A': case 'C': case 'G': case 'T':
+            case 'a': case 'c': case 'g': case 't':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Position of GT in the FORMAT column, or -1 if absent
+    static int genotype_index(std::string_view format) {
+        int index = 0;
+        size_t start = 0;
+        for (;;) {
+            size_t colon = format.find(':', start);
+            if (format.substr(start, colon - start) == "GT") {
+                return index;
+            }
+            if (colon == std::string_view::npos) {
+                return -1;
+            }
+            start = colon + 1;
+            ++index;
+        }
+    }
+
+    static std::string_view subfield(const char* p, const char* end, int index) {
+        for (; index > 0; --index) {
+            const void* colon = std::memchr(p, ':', end - p);
+            if (!colon) {
+                return std::string_view();
+            }
+            p = static_cast<const char*>(colon) + 1;
+        }
+        const void* colon = std::memchr(p, ':', end - p);
+        const char* stop = colon ? static_cast<const char*>(colon) : end;
+        return std::string_view(p, stop - p);
+    }
+
+    // Next tab in [p, end), or end
+    static const char* next_tab(const char* p, const char* end) {
+        const void* tab = std::memchr(p, '\t', end - p);
+        return tab ? static_cast<const char*>(tab) : end;
+    }
+
+    std::runtime_error record_error(const std::string& detail) const {
+        return std::runtime_error(
+            "Line " + std::to_string(line_) + ": " + detail
+        );
+    }
+
+    void flush_word() {
+        for (size_t j = 0; j < alt_.size(); ++j) {
+            matrix_.samples_[j].alt.push_back(alt_[j]);
+            matrix_.samples_[j].missing.push_back(missing_[j]);
+            alt_[j] = 0;
+            missing_[j] = 0;
+        }
+    }
+};
+
+#ifndef __EMSCRIPTEN__
+// Map a VCF from disk and pack it in one pass
+inline SnpMatrix load_vcf(const std::string& path) {
+    MappedFile file(path);
+    VcfReader reader;
+    reader.feed(file.data(), file.size());
+    return reader.finish();
+}
+#endif
+
+} // namespace grapetree
+
+#endif // GRAPETREE_VCF_READER_H
@@ -7,48 +7,613 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <charconv>
+#include <algorithm>
+#include <map>
+#include <memory>
 
 // Include our GrapeTree modules
+#include "profile_store.cpp"
+#include "profile_json.cpp"
+#include "profile_tsv.cpp"
+#include "fasta_reader.cpp"
+#include "vcf_reader.cpp"
+#include "profile_binary.cpp"
 #include "distance.cpp"
 #include "mstree.cpp"
 #include "mstree_v2.cpp"
 #include "newick.cpp"
+#include "pipeline.cpp"
+#include "job.cpp"
+#include "result_cache.cpp"
+#include "plan.cpp"
+#include "response_json.cpp"
+#include "run_profile.cpp"
+#include "memory.cpp"
+#include "trace.cpp"
 
 using namespace emscripten;
 using json = nlohmann::json;
 using namespace grapetree;
 
-// Helper function to parse JSON profile data
-DistanceMatrix::ProfileData parse_profile_json(const std::string& json_str) {
-    json data = json::parse(json_str);
+// Helper function to parse JSON profile data into packed columns
+ProfileStore parse_profile_json(
+    const std::string& json_str,
+    const ParseOptions& options = ParseOptions()
+) {
+    return parse_profile_json_store(json_str, options);
+}
+
+// Accepts a JSON document ({strains, profiles}), the raw text of a
+// tab/comma delimited profile file, or a binary profile store, so the
+// browser can hand over file contents without converting them first.
+// A binary store is used in place and must not outlive input.
+ProfileStore parse_profiles(
+    const std::string& input,
+    const ParseOptions& options = ParseOptions()
+) {
+    if (ProfileStoreFormat::matches(input.data(), input.size())) {
+        return view_profile_store(input.data(), input.size());
+    }
     
-    DistanceMatrix::ProfileData profile;
-    profile.strain_names = data["strains"].get<std::vector<std::string>>();
-    profile.profiles = data["profiles"].get<std::vector<std::vector<int>>>();
-    profile.n_strains = profile.strain_names.size();
-    profile.n_genes = profile.profiles.empty() ? 0 : profile.profiles[0].size();
+    size_t first = input.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos && input[first] == '{') {
+        return parse_profile_json(input, options);
+    }
+    return parse_profile_tsv_parallel(input.data(), input.size(), options);
+}
+
+// Parse options as JSON, e.g. {"missing_tokens": ["-", "LNF"],
+// "pack_columns": true}. Absent keys (or an empty string) keep defaults.
+ParseOptions parse_options_json(const std::string& options_json) {
+    ParseOptions options;
+    if (options_json.empty()) {
+        return options;
+    }
     
-    return profile;
+    json parsed = json::parse(options_json);
+    if (parsed.contains("missing_tokens")) {
+        options.missing_tokens =
+            parsed["missing_tokens"].get<std::vector<std::string>>();
+    }
+    if (parsed.contains("pack_columns")) {
+        options.pack_columns = parsed["pack_columns"].get<bool>();
+    }
+    return options;
 }
 
-// Convert edges to JSON
-json edges_to_json(
-    const std::vector<Edge>& edges,
-    const std::vector<std::string>& strain_names
+// Symmetric or asymmetric allelic distances for a parsed profile set
+DenseMatrix compute_profile_distances(
+    const ProfileStore& profile_data,
+    const std::string& matrix_type,
+    int missing_handler
 ) {
-    json result = json::array();
+    DistanceMatrix dm(profile_data);
+    
+    if (matrix_type == "symmetric") {
+        return dm.compute_symmetric(
+            static_cast<DistanceMatrix::MissingHandler>(missing_handler)
+        );
+    }
+    return dm.compute_asymmetric();
+}
+
+// {fits, storage, matrix_bytes, peak_bytes, seconds, reason, ...}
+json plan_to_json(const RunPlan& plan) {
+    json out;
+    out["fits"] = plan.fits;
+    out["storage"] = storage_name(plan.storage);
+    out["matrix_bytes"] = plan.matrix_bytes;
+    out["peak_bytes"] = plan.peak_bytes;
+    out["distance_seconds"] = plan.distance_seconds;
+    out["tree_seconds"] = plan.tree_seconds;
+    out["seconds"] = plan.seconds();
+    out["reason"] = plan.reason;
+    if (plan.storage == MatrixStorage::SPARSE) {
+        out["sparse_threshold"] = plan.sparse_threshold;
+        out["max_sparse_pairs"] = plan.max_sparse_pairs;
+    }
+    if (plan.storage == MatrixStorage::LAZY) {
+        out["cached_rows"] = plan.cached_rows;
+    }
+    return out;
+}
+
+// Parsed profiles and the results derived from them. Distance matrices
+// and trees are computed on first request and cached, so switching tree
+// method or heuristic reuses the matrix instead of re-parsing and
+// recomputing everything. Result methods return the same JSON as the
+// one-shot entry points.
+class Session {
+private:
+    ProfileStore profiles_;
+    std::map<std::string, DenseMatrix> matrices_;
+    std::map<std::string, std::string> trees_;
+    
+public:
+    explicit Session(ProfileStore&& profiles)
+        : profiles_(std::move(profiles)) {}
+    
+    // Same inputs as compute_tree. A binary store is copied, since the
+    // session outlives the JS buffer it came from.
+    Session(const std::string& input, const std::string& options_json)
+        : profiles_(load(input, parse_options_json(options_json))) {}
+    
+    size_t n_strains() const { return profiles_.n_strains(); }
+    size_t n_loci() const { return profiles_.n_loci(); }
+    
+    const ProfileStore& profiles() const { return profiles_; }
+    
+    bool has_distances(const std::string& matrix_type, int missing_handler) const {
+        return matrices_.count(matrix_key(matrix_type, missing_handler)) > 0;
+    }
+    
+    // Cache a matrix computed elsewhere (e.g. by a TreeJob)
+    void store_distances(
+        const std::string& matrix_type,
+        int missing_handler,
+        DenseMatrix&& matrix
+    ) {
+        matrices_[matrix_key(matrix_type, missing_handler)] = std::move(matrix);
+    }
+    
+    // A matrix computed here is timed and counted in profile, if given
+    const DenseMatrix& distances(
+        const std::string& matrix_type,
+        int missing_handler,
+        RunProfile* profile = nullptr
+    ) {
+        std::string key = matrix_key(matrix_type, missing_handler);
+        auto it = matrices_.find(key);
+        if (it == matrices_.end()) {
+            it = matrices_.emplace(
+                key,
+                RunProfile::time(profile, "distances", [&] {
+                    return compute_profile_distances(profiles_, matrix_type, missing_handler);
+                })
+            ).first;
+            if (profile) {
+                profile->count_distances(profiles_.n_strains(), profiles_.n_loci());
+                profile->bytes_allocated += it->second.size() * it->second.size() * sizeof(double);
+            }
+        }
+        return it->second;
+    }
+    
+    std::string tree(
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic
+    ) {
+        return profiled_tree(method, matrix_type, missing_handler, heuristic, nullptr);
+    }
+    
+    // tree(), recording stage times and work counts in profile if given;
+    // a set cancel token stops the engine with a "cancelled" error
+    std::string profiled_tree(
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic,
+        RunProfile* profile,
+        const CancelToken* cancel = nullptr
+    ) {
+        try {
+            std::string key = tree_key(method, matrix_type, missing_handler, heuristic);
+            auto it = trees_.find(key);
+            if (it != trees_.end()) {
+                return it->second;
+            }
+            
+            const DenseMatrix& matrix = distances(matrix_type, missing_handler, profile);
+            TreeCounters counters;
+            std::vector<Edge> tree_edges = RunProfile::time(profile, "tree", [&] {
+                return build_tree(matrix, method, heuristic, &counters, cancel);
+            });
+            
+            std::string result = RunProfile::time(profile, "output", [&] {
+                return tree_response(
+                    tree_edges,
+                    profiles_.strain_names(),
+                    profiles_.n_strains()
+                ).dump();
+            });
+            if (profile) {
+                profile->tree = counters;
+                profile->bytes_allocated += result.size();
+            }
+            trees_.emplace(key, result);
+            return result;
+            
+        } catch (const std::exception& e) {
+            json error_response;
+            error_response["success"] = false;
+            error_response["error"] = e.what();
+            return error_response.dump();
+        }
+    }
+    
+    std::string distance_matrix(
+        const std::string& matrix_type,
+        int missing_handler
+    ) {
+        return profiled_distance_matrix(matrix_type, missing_handler, nullptr);
+    }
+    
+    // distance_matrix(), recording stage times and work counts in profile
+    // if given
+    std::string profiled_distance_matrix(
+        const std::string& matrix_type,
+        int missing_handler,
+        RunProfile* profile
+    ) {
+        try {
+            const DenseMatrix& matrix = distances(matrix_type, missing_handler, profile);
+            
+            // Convert to JSON. The matrix is written straight into the output
+            // string rather than through a JSON DOM of n^2 values.
+            std::string out = RunProfile::time(profile, "output", [&] {
+                json response;
+                response["success"] = true;
+                json names = json::array();
+                for (size_t i = 0; i < profiles_.n_strains(); ++i) {
+                    names.push_back(std::string(profiles_.strain_names()[i]));
+                }
+                response["strain_names"] = std::move(names);
+                response["n_strains"] = profiles_.n_strains();
+                
+                // Keys are emitted in sorted order, so "matrix" leads the object
+                std::string text = "{\"matrix\":";
+                append_matrix_json(text, matrix);
+                text += ',';
+                text += response.dump().substr(1);
+                return text;
+            });
+            if (profile) {
+                profile->bytes_allocated += out.size();
+            }
+            return out;
+            
+        } catch (const std::exception& e) {
+            json error_response;
+            error_response["success"] = false;
+            error_response["error"] = e.what();
+            return error_response.dump();
+        }
+    }
+    
+    bool has_tree(
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic
+    ) const {
+        return trees_.count(tree_key(method, matrix_type, missing_handler, heuristic)) > 0;
+    }
+    
+    // Cache a tree built elsewhere (e.g. by a TreeJob); its tree() JSON
+    std::string store_tree(
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic,
+        const std::vector<Edge>& tree_edges
+    ) {
+        std::string result = tree_response(
+            tree_edges,
+            profiles_.strain_names(),
+            profiles_.n_strains()
+        ).dump();
+        trees_[tree_key(method, matrix_type, missing_handler, heuristic)] = result;
+        return result;
+    }
+    
+    // Drop cached matrices (n^2 each) but keep the tree results
+    void release_matrices() { matrices_.clear(); }
+    
+    // How a tree on this session would be run within budget_bytes (0 =
+    // unlimited); sparse_threshold > 0 allows sparse storage
+    RunPlan plan(
+        const std::string& method,
+        const std::string& matrix_type,
+        double budget_bytes,
+        int sparse_threshold
+    ) const {
+        PlanRequest request;
+        request.n_strains = profiles_.n_strains();
+        request.n_loci = profiles_.n_loci();
+        request.method = method;
+        request.asymmetric = matrix_type != "symmetric";
+        request.budget_bytes = static_cast<uint64_t>(std::max(0.0, budget_bytes));
+        request.profile_bytes = profiles_.code_bytes();
+        request.sparse_threshold = static_cast<uint32_t>(std::max(0, sparse_threshold));
+        return plan_run(request);
+    }
     
-    for (const Edge& e : edges) {
-        json edge_obj;
-        edge_obj["from"] = e.from;
-        edge_obj["to"] = e.to;
-        edge_obj["from_name"] = strain_names[e.from];
-        edge_obj["to_name"] = strain_names[e.to];
-        edge_obj["distance"] = e.distance;
-        result.push_back(edge_obj);
+    std::string plan_json(
+        const std::string& method,
+        const std::string& matrix_type,
+        double budget_bytes,
+        int sparse_threshold
+    ) const {
+        return plan_to_json(
+            plan(method, matrix_type, budget_bytes, sparse_threshold)
+        ).dump();
     }
     
-    return result;
+    // tree() within a memory budget: the matrix storage is chosen by
+    // plan(), and the response carries the plan. A run that cannot fit
+    // fails up front. Only dense matrices are kept in the session.
+    std::string budgeted_tree(
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic,
+        double budget_bytes,
+        int sparse_threshold
+    ) {
+        try {
+            RunPlan run = plan(method, matrix_type, budget_bytes, sparse_threshold);
+            if (run.fits && run.storage == MatrixStorage::DENSE) {
+                json response = json::parse(
+                    tree(method, matrix_type, missing_handler, heuristic)
+                );
+                response["plan"] = plan_to_json(run);
+                return response.dump();
+            }
+            
+            std::string key = tree_key(method, matrix_type, missing_handler, heuristic) +
+                '|' + storage_name(run.storage) + std::to_string(run.sparse_threshold);
+            auto it = trees_.find(key);
+            if (it == trees_.end()) {
+                std::vector<Edge> tree_edges = build_planned_tree(
+                    profiles_, run, method, matrix_type != "symmetric",
+                    static_cast<DistanceMatrix::MissingHandler>(missing_handler),
+                    heuristic
+                );
+                it = trees_.emplace(key, tree_response(
+                    tree_edges,
+                    profiles_.strain_names(),
+                    profiles_.n_strains()
+                ).dump()).first;
+            }
+            
+            json response = json::parse(it->second);
+            response["plan"] = plan_to_json(run);
+            return response.dump();
+            
+        } catch (const std::exception& e) {
+            json error_response;
+            error_response["success"] = false;
+            error_response["error"] = e.what();
+            return error_response.dump();
+        }
+    }
+    
+private:
+    static ProfileStore load(
+        const std::string& input,
+        const ParseOptions& options
+    ) {
+        if (ProfileStoreFormat::matches(input.data(), input.size())) {
+            return adopt_profile_store(std::string(input));
+        }
+        return parse_profiles(input, options);
+    }
+    
+    // The asymmetric matrix ignores the missing-data handler
+    static std::string matrix_key(
+        const std::string& matrix_type,
+        int missing_handler
+    ) {
+        if (matrix_type != "symmetric") {
+            return "asymmetric";
+        }
+        return matrix_type + std::to_string(missing_handler);
+    }
+    
+    static std::string tree_key(
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic
+    ) {
+        return method + '|' + matrix_key(matrix_type, missing_handler) + '|' + heuristic;
+    }
+};
+
+// A Session tree computed in bounded slices. Each step() fills a slice
+// of distance matrix rows, then (MSTree) adds a slice of nodes to the
+// tree, and returns true once a result is ready, so a Web Worker can post
+// progress and act on a cancel message between slices. MSTreeV2 builds
+// its tree in one step, polling the cancel token as it goes. Cancelling
+// keeps the rows and tree nodes already computed; resume() continues
+// from them. The matrix and tree are cached in the session when
+// complete, so later trees on the matrix skip straight to building.
+class TreeJob {
+private:
+    Session& session_;
+    std::string method_;
+    std::string matrix_type_;
+    int missing_handler_;
+    std::string heuristic_;
+    std::unique_ptr<DistanceJob> distances_;
+    std::unique_ptr<BasicMSTree<DenseMatrix>> prim_;
+    const DenseMatrix* prim_matrix_ = nullptr;  // the matrix prim_ reads
+    CancelToken token_;
+    std::string stage_ = "distances";
+    std::string result_;
+    
+    void set_cancelled() {
+        stage_ = "cancelled";
+        json error_response;
+        error_response["success"] = false;
+        error_response["error"] = CancelledError().what();
+        result_ = error_response.dump();
+    }
+    
+public:
+    TreeJob(
+        Session& session,
+        const std::string& method,
+        const std::string& matrix_type,
+        int missing_handler,
+        const std::string& heuristic
+    ) : session_(session),
+        method_(method),
+        matrix_type_(matrix_type),
+        missing_handler_(missing_handler),
+        heuristic_(heuristic) {}
+    
+    // max_pairs bounds the strain pairs compared (or matrix entries
+    // scanned, while building the tree) in this slice
+    bool step(double max_pairs) {
+        if (stage_ == "done" || stage_ == "cancelled") {
+            return true;
+        }
+        if (token_.cancelled()) {
+            set_cancelled();
+            return true;
+        }
+        
+        try {
+            uint64_t budget = static_cast<uint64_t>(std::max(1.0, max_pairs));
+            if (!session_.has_distances(matrix_type_, missing_handler_)) {
+                // Matrices released since the tree was started
+                prim_.reset();
+                if (!distances_ || distances_->done()) {
+                    distances_ = std::make_unique<DistanceJob>(
+                        session_.profiles(),
+                        matrix_type_ != "symmetric",
+                        static_cast<DistanceMatrix::MissingHandler>(missing_handler_)
+                    );
+                }
+                if (distances_->step(budget)) {
+                    session_.store_distances(
+                        matrix_type_, missing_handler_, distances_->take()
+                    );
+                    stage_ = "tree";
+                }
+                return false;
+            }
+            
+            stage_ = "tree";
+            if (method_ == "MSTree" &&
+                !session_.has_tree(method_, matrix_type_, missing_handler_, heuristic_)) {
+                const DenseMatrix& matrix = session_.distances(matrix_type_, missing_handler_);
+                if (!prim_ || prim_matrix_ != &matrix) {
+                    prim_ = std::make_unique<BasicMSTree<DenseMatrix>>(
+                        matrix, tree_heuristic(heuristic_)
+                    );
+                    prim_->set_cancel_token(&token_);
+                    prim_matrix_ = &matrix;
+                }
+                // Each node scans about one row
+                if (!prim_->step(budget / std::max<size_t>(1, matrix.size()))) {
+                    return false;
+                }
+                result_ = session_.store_tree(
+                    method_, matrix_type_, missing_handler_, heuristic_, prim_->take()
+                );
+                prim_.reset();
+            } else {
+                result_ = session_.profiled_tree(
+                    method_, matrix_type_, missing_handler_, heuristic_, nullptr, &token_
+                );
+                if (token_.cancelled() &&
+                    !session_.has_tree(method_, matrix_type_, missing_handler_, heuristic_)) {
+                    set_cancelled();
+                    return true;
+                }
+            }
+        } catch (const CancelledError&) {
+            set_cancelled();
+            return true;
+        } catch (const std::exception& e) {
+            json error_response;
+            error_response["success"] = false;
+            error_response["error"] = e.what();
+            result_ = error_response.dump();
+        }
+        stage_ = "done";
+        return true;
+    }
+    
+    void cancel() { token_.cancel(); }
+    
+    // Continue a cancelled job from the rows and tree nodes it had
+    // finished
+    void resume() {
+        token_.reset();
+        if (stage_ == "cancelled") {
+            stage_ = session_.has_distances(matrix_type_, missing_handler_) ?
+                "tree" : "distances";
+            result_.clear();
+        }
+    }
+    
+    // {stage, fraction, pairs_done, pairs_total, pairs_per_second,
+    // nodes_done, nodes_total}; fraction is of the distance work, which
+    // dominates the run time, and nodes count MSTree's progress
+    std::string progress() const {
+        JobProgress p;
+        if (distances_) {
+            p = distances_->progress();
+        } else if (stage_ != "distances") {
+            p.fraction = 1.0;
+        }
+        
+        json response;
+        response["stage"] = stage_;
+        response["fraction"] = stage_ == "done" ? 1.0 : p.fraction;
+        response["pairs_done"] = p.pairs_done;
+        response["pairs_total"] = p.pairs_total;
+        response["pairs_per_second"] = p.pairs_per_second;
+        response["nodes_done"] = prim_ ? prim_->nodes_done() : 0;
+        response["nodes_total"] = session_.n_strains();
+        return response.dump();
+    }
+    
+    // Tree JSON (as compute_tree) once step() has returned true
+    std::string result() const { return result_; }
+};
+
+// Results of compute_tree and compute_distance_matrix, keyed by a hash
+// of the input bytes and parameters; shared by every call in the module
+ResultCache& result_cache() {
+    static ResultCache cache;
+    return cache;
+}
+
+// Whether compute_tree and compute_distance_matrix add a "profile"
+// section (stage times and work counts) to their responses
+bool& profiling_enabled() {
+    static bool enabled = false;
+    return enabled;
+}
+
+void set_profiling(bool enabled) {
+    profiling_enabled() = enabled;
+}
+
+// Hard cap on tracked memory (memory.cpp) in bytes, 0 = none. A call that
+// would cross it returns {"success":false,"error":"Memory cap exceeded..."}
+// instead of growing the heap until the browser aborts the module.
+void set_memory_cap(double bytes) {
+    MemoryAccount::instance().set_cap(static_cast<uint64_t>(std::max(0.0, bytes)));
+}
+
+// Tracked memory by stage; peaks are those of the last compute_tree or
+// compute_distance_matrix call (see memory_json)
+std::string memory_usage() {
+    return memory_json().dump();
+}
+
+// Error responses are not cached, so a failed request is retried.
+// json::dump() sorts keys, so an error response always starts this way.
+bool is_error_response(const std::string& response) {
+    return response.compare(0, 9, "{\"error\":") == 0;
 }
 
 // Main tree computation function
@@ -60,51 +625,129 @@ std::string compute_tree(
     const std::string& heuristic
 ) {
     try {
-        // Parse input
-        auto profile_data = parse_profile_json(profile_json);
-        
-        // Compute distance matrix
-        DistanceMatrix dm(profile_data);
-        std::vector<std::vector<double>> distances;
-        
-        if (matrix_type == "symmetric") {
-            distances = dm.compute_symmetric(
-                static_cast<DistanceMatrix::MissingHandler>(missing_handler)
-            );
-        } else {
-            distances = dm.compute_asymmetric();
-        }
-        
-        // Compute tree
-        std::vector<Edge> tree_edges;
-        
-        if (method == "MSTree") {
-            MSTree::Heuristic h = (heuristic == "harmonic") ?
-                MSTree::HARMONIC : MSTree::EBURST;
-            MSTree mst(distances, h);
-            tree_edges = mst.compute();
-        } else if (method == "MSTreeV2") {
-            MSTreeV2 mst2(distances);
-            tree_edges = mst2.compute();
-        } else {
-            throw std::runtime_error("Unknown method: " + method);
-        }
-        
-        // Format output as Newick
-        NewickFormatter formatter;
-        std::string newick = formatter.format(
+        MemoryAccount::instance().reset_peaks();
+        RunProfile profile;
+        RunProfile* active = profiling_enabled() ? &profile : nullptr;
+        
+        uint64_t key = ResultKey().add("tree").add(profile_json).add(method)
+            .add(matrix_type).add(missing_handler).add(heuristic).value();
+        std::string response;
+        if (result_cache().find(key, response)) {
+            if (active) {
+                profile.set_cached();
+                profile.append_to(response);
+            }
+            return response;
+        }
+        
+        // Parse input; the text is held for the whole call
+        MemoryCharge input(MemoryStage::parse, profile_json.size());
+        Session session(RunProfile::time(active, "parse", [&] {
+            return parse_profiles(profile_json);
+        }));
+        if (active) {
+            profile.bytes_allocated += session.profiles().code_bytes();
+        }
+        
+        response = session.profiled_tree(
+            method, matrix_type, missing_handler, heuristic, active
+        );
+        if (!is_error_response(response)) {
+            result_cache().insert(key, response);
+            if (active) {
+                profile.append_to(response);
+            }
+        }
+        return response;
+        
+    } catch (const std::exception& e) {
+        json error_response;
+        error_response["success"] = false;
+        error_response["error"] = e.what();
+        return error_response.dump();
+    }
+}
+
+// Tree from profile text streamed into a ProfilePipeline. Distances were
+// computed row by row while the text arrived; only the tree is left.
+std::string compute_pipeline_tree(
+    ProfilePipeline& pipeline,
+    const std::string& method,
+    const std::string& heuristic
+) {
+    try {
+        PipelineResult result = pipeline.finish();
+        
+        std::vector<Edge> tree_edges = build_tree(
+            result.distances, method, heuristic
+        );
+        
+        return tree_response(
+            tree_edges,
+            result.profiles.strain_names(),
+            result.profiles.n_strains()
+        ).dump();
+        
+    } catch (const std::exception& e) {
+        json error_response;
+        error_response["success"] = false;
+        error_response["error"] = e.what();
+        return error_response.dump();
+    }
+}
+
+// Tree from an aligned FASTA streamed into a FastaReader chunk by chunk.
+// Distances are p-distances over the packed alignment; the reader is
+// finished (and its alignment consumed) by this call.
+std::string compute_fasta_tree(
+    FastaReader& reader,
+    const std::string& method,
+    const std::string& heuristic
+) {
+    try {
+        PackedAlignment alignment = reader.finish();
+        
+        DenseMatrix distances = DistanceMatrix::compute_p_distance(alignment);
+        
+        std::vector<Edge> tree_edges = build_tree(distances, method, heuristic);
+        
+        json response = tree_response(
             tree_edges,
-            profile_data.strain_names
+            alignment.names(),
+            alignment.n_sequences()
         );
+        response["n_sites"] = alignment.length();
+        return response.dump();
         
-        // Build JSON response
-        json response;
-        response["success"] = true;
-        response["newick"] = newick;
-        response["edges"] = edges_to_json(tree_edges, profile_data.strain_names);
-        response["n_nodes"] = profile_data.n_strains;
-        response["n_edges"] = tree_edges.size();
+    } catch (const std::exception& e) {
+        json error_response;
+        error_response["success"] = false;
+        error_response["error"] = e.what();
+        return error_response.dump();
+    }
+}
+
+// Tree from a multi-sample VCF streamed into a VcfReader. Distances are
+// SNP counts over biallelic SNVs called in both samples.
+std::string compute_vcf_tree(
+    VcfReader& reader,
+    const std::string& method,
+    const std::string& heuristic
+) {
+    try {
+        SnpMatrix snps = reader.finish();
+        
+        DenseMatrix distances = DistanceMatrix::compute_snp_distance(snps);
         
+        std::vector<Edge> tree_edges = build_tree(distances, method, heuristic);
+        
+        json response = tree_response(
+            tree_edges,
+            snps.names(),
+            snps.n_samples()
+        );
+        response["n_sites"] = snps.n_sites();
+        response["n_skipped"] = snps.n_skipped();
         return response.dump();
         
     } catch (const std::exception& e) {
@@ -115,6 +758,29 @@ std::string compute_tree(
     }
 }
 
+// Parse profiles once and return them as a binary profile store
+// (Uint8Array) that later calls can take instead of re-parsing the text
+val export_profile_store(const std::string& profile_input) {
+    std::string bytes = serialize_profile_store(parse_profiles(profile_input));
+    return val::global("Uint8Array").new_(
+        typed_memory_view(bytes.size(),
+                          reinterpret_cast<const uint8_t*>(bytes.data()))
+    );
+}
+
+// Text chunk from a JS stream (TextDecoder output)
+void fasta_feed(FastaReader& reader, const std::string& chunk) {
+    reader.feed(chunk);
+}
+
+void vcf_feed(VcfReader& reader, const std::string& chunk) {
+    reader.feed(chunk);
+}
+
+void pipeline_feed(ProfilePipeline& pipeline, const std::string& chunk) {
+    pipeline.feed(chunk);
+}
+
 // Distance matrix computation
 std::string compute_distance_matrix(
     const std::string& profile_json,
@@ -122,28 +788,84 @@ std::string compute_distance_matrix(
     int missing_handler
 ) {
     try {
-        auto profile_data = parse_profile_json(profile_json);
+        MemoryAccount::instance().reset_peaks();
+        RunProfile profile;
+        RunProfile* active = profiling_enabled() ? &profile : nullptr;
         
-        DistanceMatrix dm(profile_data);
-        std::vector<std::vector<double>> distances;
+        uint64_t key = ResultKey().add("matrix").add(profile_json)
+            .add(matrix_type).add(missing_handler).value();
+        std::string response;
+        if (result_cache().find(key, response)) {
+            if (active) {
+                profile.set_cached();
+                profile.append_to(response);
+            }
+            return response;
+        }
         
-        if (matrix_type == "symmetric") {
-            distances = dm.compute_symmetric(
-                static_cast<DistanceMatrix::MissingHandler>(missing_handler)
-            );
-        } else {
-            distances = dm.compute_asymmetric();
+        MemoryCharge input(MemoryStage::parse, profile_json.size());
+        Session session(RunProfile::time(active, "parse", [&] {
+            return parse_profiles(profile_json);
+        }));
+        if (active) {
+            profile.bytes_allocated += session.profiles().code_bytes();
         }
         
-        // Convert to JSON
+        response = session.profiled_distance_matrix(matrix_type, missing_handler, active);
+        if (!is_error_response(response)) {
+            result_cache().insert(key, response);
+            if (active) {
+                profile.append_to(response);
+            }
+        }
+        return response;
+        
+    } catch (const std::exception& e) {
+        json error_response;
+        error_response["success"] = false;
+        error_response["error"] = e.what();
+        return error_response.dump();
+    }
+}
+
+// Plan a tree run before loading any data: storage, peak memory and
+// estimated time for n_strains x n_loci profiles within budget_bytes
+std::string plan_tree(
+    double n_strains,
+    double n_loci,
+    const std::string& method,
+    const std::string& matrix_type,
+    double budget_bytes,
+    int sparse_threshold
+) {
+    PlanRequest request;
+    request.n_strains = static_cast<size_t>(std::max(0.0, n_strains));
+    request.n_loci = static_cast<size_t>(std::max(0.0, n_loci));
+    request.method = method;
+    request.asymmetric = matrix_type != "symmetric";
+    request.budget_bytes = static_cast<uint64_t>(std::max(0.0, budget_bytes));
+    request.sparse_threshold = static_cast<uint32_t>(std::max(0, sparse_threshold));
+    return plan_to_json(plan_run(request)).dump();
+}
+
+// Result cache contents as bytes (Uint8Array), to persist in IndexedDB
+// or a file and hand back to import_result_cache() in a later session
+val export_result_cache() {
+    std::string bytes = result_cache().serialize();
+    return val::global("Uint8Array").new_(
+        typed_memory_view(bytes.size(),
+                          reinterpret_cast<const uint8_t*>(bytes.data()))
+    );
+}
+
+// Merge a saved cache in; {"success":true,"entries":n} or an error
+std::string import_result_cache(const std::string& bytes) {
+    try {
+        result_cache().load(bytes.data(), bytes.size());
         json response;
         response["success"] = true;
-        response["matrix"] = distances;
-        response["strain_names"] = profile_data.strain_names;
-        response["n_strains"] = profile_data.n_strains;
-        
+        response["entries"] = result_cache().size();
         return response.dump();
-        
     } catch (const std::exception& e) {
         json error_response;
         error_response["success"] = false;
@@ -152,10 +874,84 @@ std::string compute_distance_matrix(
     }
 }
 
+// {entries, bytes, max_bytes, hits, misses}
+std::string result_cache_stats() {
+    const ResultCache& cache = result_cache();
+    json response;
+    response["entries"] = cache.size();
+    response["bytes"] = cache.bytes();
+    response["max_bytes"] = cache.max_bytes();
+    response["hits"] = cache.hits();
+    response["misses"] = cache.misses();
+    return response.dump();
+}
+
+// Byte budget for cached results; 0 disables caching
+void set_result_cache_limit(double max_bytes) {
+    result_cache().set_max_bytes(static_cast<size_t>(std::max(0.0, max_bytes)));
+}
+
+void clear_result_cache() {
+    result_cache().clear();
+}
+
 // Emscripten bindings
 EMSCRIPTEN_BINDINGS(grapetree_module) {
     function("compute_tree", &compute_tree);
     function("compute_distance_matrix", &compute_distance_matrix);
+    function("compute_fasta_tree", &compute_fasta_tree);
+    function("compute_vcf_tree", &compute_vcf_tree);
+    function("compute_pipeline_tree", &compute_pipeline_tree);
+    function("export_profile_store", &export_profile_store);
+    function("plan_tree", &plan_tree);
+    function("export_result_cache", &export_result_cache);
+    function("import_result_cache", &import_result_cache);
+    function("result_cache_stats", &result_cache_stats);
+    function("set_result_cache_limit", &set_result_cache_limit);
+    function("clear_result_cache", &clear_result_cache);
+    function("set_profiling", &set_profiling);
+    function("set_memory_cap", &set_memory_cap);
+    function("memory_usage", &memory_usage);
+    function("export_trace", &trace_json);
+    function("clear_trace", &clear_trace);
+    
+    // Streaming FASTA input: feed() text chunks, then compute_fasta_tree()
+    class_<FastaReader>("FastaReader")
+        .constructor<>()
+        .function("feed", &fasta_feed);
+    
+    // Streaming VCF input: feed() text chunks, then compute_vcf_tree()
+    class_<VcfReader>("VcfReader")
+        .constructor<>()
+        .function("feed", &vcf_feed);
+    
+    // Streaming profile text: distances are computed as rows arrive,
+    // then compute_pipeline_tree() builds the tree
+    class_<ProfilePipeline>("ProfilePipeline")
+        .constructor<const std::string&, int>()
+        .function("feed", &pipeline_feed)
+        .function("n_rows", &ProfilePipeline::n_rows);
+    
+    // Parsed profiles with cached matrices and trees
+    class_<Session>("Session")
+        .constructor<const std::string&, const std::string&>()
+        .function("tree", &Session::tree)
+        .function("distance_matrix", &Session::distance_matrix)
+        .function("release_matrices", &Session::release_matrices)
+        .function("plan", &Session::plan_json)
+        .function("budgeted_tree", &Session::budgeted_tree)
+        .function("n_strains", &Session::n_strains)
+        .function("n_loci", &Session::n_loci);
+    
+    // Sliced tree computation on a session, with progress and cancel
+    class_<TreeJob>("TreeJob")
+        .constructor<Session&, const std::string&, const std::string&,
+                     int, const std::string&>()
+        .function("step", &TreeJob::step)
+        .function("cancel", &TreeJob::cancel)
+        .function("resume", &TreeJob::resume)
+        .function("progress", &TreeJob::progress)
+        .function("result", &TreeJob::result);
     
     // Also expose individual components if needed
     enum_<DistanceMatrix::MissingHandler>("MissingHandler")
@@ -168,30 +964,3 @@ EMSCRIPTEN_BINDINGS(grapetree_module) {
         .value("EBURST", MSTree::EBURST)
         .value("HARMONIC", MSTree::HARMONIC);
 }
-
-// For standalone compilation (non-WASM)
-#ifndef __EMSCRIPTEN__
-int main() {
-    // Test harness
-    std::string test_data = R"({
-        "strains": ["A", "B", "C"],
-        "profiles": [
-            [1, 2, 3],
-            [1, 2, 4],
-            [1, 3, 3]
-        ]
-    })";
-    
-    std::string result = compute_tree(
-        test_data,
-        "MSTreeV2",
-        "asymmetric",
-        0,
-        "harmonic"
-    );
-    
-    std::cout << "Result: " << result << std::endl;
-    
-    return 0;
-}
-#endif
@@ -2,9 +2,28 @@
 // Provides JavaScript API for WASM tree computation
 
 class GrapeTreeWASM {
-    constructor() {
+    /**
+     * @param {Object} [options]
+     * @param {string} [options.baseUrl] - Where the grapetree*.js builds
+     *     are served from (default: the page's directory)
+     * @param {boolean} [options.simd] - Force (true) or forbid (false) the
+     *     SIMD128 builds; by default they are used when the browser
+     *     validates SIMD code
+     * @param {boolean} [options.threads] - Force (true) or forbid (false) the
+     *     multi-threaded build; by default it is used when the page is
+     *     cross-origin isolated and SIMD is available
+     * @param {boolean} [options.memory64] - Load the Memory64 build, for
+     *     datasets whose distance matrix exceeds 4 GB (about 23k strains);
+     *     init() rejects on runtimes without Memory64 support
+     */
+    constructor(options = {}) {
         this.module = null;
         this.isInitialized = false;
+        this.baseUrl = options.baseUrl || '';
+        this.simd = options.simd;
+        this.threads = options.threads;
+        this.memory64 = options.memory64 === true;
+        this.variant = null;
     }
     
     /**
@@ -17,10 +36,22 @@ class GrapeTreeWASM {
         }
         
         try {
+            // Pick the Emscripten build, unless a page already loaded one
+            if (typeof GrapeTreeWASMModule === 'undefined') {
+                this.variant = this._selectVariant();
+                const file = {
+                    baseline: 'grapetree.js',
+                    simd: 'grapetree-simd.js',
+                    threads: 'grapetree-threads.js',
+                    memory64: 'grapetree-64.js'
+                }[this.variant];
+                await GrapeTreeWASM._loadScript(this.baseUrl + file);
+            }
+            
             // Load the WASM module (Emscripten generated)
             this.module = await GrapeTreeWASMModule();
             this.isInitialized = true;
-            console.log('GrapeTree WASM module initialized successfully');
+            console.log(`GrapeTree WASM module initialized successfully${this.variant ? ` (${this.variant})` : ''}`);
             return this;
         } catch (error) {
             console.error('Failed to initialize WASM module:', error);
@@ -28,10 +59,83 @@ class GrapeTreeWASM {
         }
     }
     
+    /**
+     * 'memory64', 'threads' (SIMD + pthreads), 'simd' or 'baseline'
+     * @returns {string}
+     */
+    _selectVariant() {
+        if (this.memory64) {
+            if (!GrapeTreeWASM.supportsMemory64()) {
+                throw new Error(
+                    'This runtime does not support WebAssembly Memory64, which is ' +
+                    'needed for datasets larger than 4 GB. Use a browser with ' +
+                    'Memory64 enabled, or reduce the dataset to fit the standard build.'
+                );
+            }
+            return 'memory64';
+        }
+        const simd = this.simd ?? GrapeTreeWASM.supportsSimd();
+        if (simd && (this.threads ?? GrapeTreeWASM.supportsThreads())) {
+            return 'threads';
+        }
+        return simd ? 'simd' : 'baseline';
+    }
+    
+    /**
+     * Whether the browser accepts SIMD128 code: validates a minimal module
+     * whose only function splats and popcounts a v128
+     * @returns {boolean}
+     */
+    static supportsSimd() {
+        return typeof WebAssembly === 'object' && WebAssembly.validate(new Uint8Array([
+            0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0,
+            10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11
+        ]));
+    }
+    
+    /**
+     * Whether the runtime accepts 64-bit linear memories: validates a
+     * module that only declares an i64-indexed memory
+     * @returns {boolean}
+     */
+    static supportsMemory64() {
+        return typeof WebAssembly === 'object' && WebAssembly.validate(new Uint8Array([
+            0, 97, 115, 109, 1, 0, 0, 0, 5, 3, 1, 4, 0
+        ]));
+    }
+    
+    /**
+     * Whether the pthreads build can run here: it needs SharedArrayBuffer,
+     * which browsers only expose to cross-origin isolated pages (served with
+     * COOP: same-origin and COEP: require-corp headers)
+     * @returns {boolean}
+     */
+    static supportsThreads() {
+        return typeof SharedArrayBuffer !== 'undefined' &&
+            globalThis.crossOriginIsolated === true;
+    }
+    
+    static _loadScript(url) {
+        // Workers load classic scripts synchronously
+        if (typeof importScripts === 'function') {
+            importScripts(url);
+            return Promise.resolve();
+        }
+        return new Promise((resolve, reject) => {
+            const script = document.createElement('script');
+            script.src = url;
+            script.onload = () => resolve();
+            script.onerror = () => reject(new Error(`Cannot load ${url}`));
+            document.head.appendChild(script);
+        });
+    }
+    
     /**
      * Compute phylogenetic tree from profile data
      * @param {Object} options - Tree computation options
-     * @param {Object} options.data - Profile data {strains: [], profiles: []}
+     * @param {Object|string|Uint8Array} options.data - Profile data
+     *     {strains: [], profiles: []}, the raw text of a tab/comma delimited
+     *     profile file, or a binary profile store from exportProfileStore()
      * @param {string} options.method - Tree method: 'MSTree', 'MSTreeV2', 'NJ'
      * @param {string} options.matrix - Matrix type: 'symmetric', 'asymmetric'
      * @param {number} options.missing - Missing data handler: 0-3
@@ -53,8 +157,8 @@ class GrapeTreeWASM {
         this._validateTreeOptions(data, method, matrix, missing, heuristic);
         
         try {
-            // Convert data to JSON string
-            const profileJson = JSON.stringify(data);
+            // Raw text and binary stores are passed as-is; objects go through JSON
+            const profileJson = this._profileInput(data);
             
             // Call WASM function
             const resultJson = this.module.compute_tree(
@@ -76,7 +180,8 @@ class GrapeTreeWASM {
                 newick: result.newick,
                 edges: result.edges,
                 nNodes: result.n_nodes,
-                nEdges: result.n_edges
+                nEdges: result.n_edges,
+                profile: result.profile
             };
             
         } catch (error) {
@@ -85,9 +190,169 @@ class GrapeTreeWASM {
         }
     }
     
+    /**
+     * Compute a p-distance tree from an aligned FASTA file.
+     * The file is streamed into the module chunk by chunk and packed as it
+     * arrives, so the alignment text is never held in memory as a whole.
+     * @param {Blob} file - FASTA file (File or Blob)
+     * @param {Object} options - {method, heuristic}
+     * @returns {Promise<Object>} Tree result with newick, edges, nodes
+     */
+    async computeFastaTree(file, options = {}) {
+        this._checkInitialized();
+        
+        const {
+            method = 'MSTree',
+            heuristic = 'eBurst'
+        } = options;
+        
+        const reader = new this.module.FastaReader();
+        
+        try {
+            await this._streamText(file, reader);
+            
+            const result = JSON.parse(
+                this.module.compute_fasta_tree(reader, method, heuristic)
+            );
+            
+            if (!result.success) {
+                throw new Error(result.error || 'Tree computation failed');
+            }
+            
+            return {
+                newick: result.newick,
+                edges: result.edges,
+                nNodes: result.n_nodes,
+                nEdges: result.n_edges,
+                nSites: result.n_sites
+            };
+            
+        } catch (error) {
+            console.error('FASTA tree computation error:', error);
+            throw error;
+        } finally {
+            reader.delete();
+        }
+    }
+    
+    /**
+     * Compute a SNP-distance tree from a multi-sample VCF file.
+     * Only biallelic SNVs are kept; genotypes are packed per sample as the
+     * file streams in, so no pseudo-alignment is ever built.
+     * @param {Blob} file - Uncompressed VCF file (File or Blob)
+     * @param {Object} options - {method, heuristic}
+     * @returns {Promise<Object>} Tree result with newick, edges, nodes
+     */
+    async computeVcfTree(file, options = {}) {
+        this._checkInitialized();
+        
+        const {
+            method = 'MSTree',
+            heuristic = 'eBurst'
+        } = options;
+        
+        const reader = new this.module.VcfReader();
+        
+        try {
+            await this._streamText(file, reader);
+            
+            const result = JSON.parse(
+                this.module.compute_vcf_tree(reader, method, heuristic)
+            );
+            
+            if (!result.success) {
+                throw new Error(result.error || 'Tree computation failed');
+            }
+            
+            return {
+                newick: result.newick,
+                edges: result.edges,
+                nNodes: result.n_nodes,
+                nEdges: result.n_edges,
+                nSites: result.n_sites,
+                nSkipped: result.n_skipped
+            };
+            
+        } catch (error) {
+            console.error('VCF tree computation error:', error);
+            throw error;
+        } finally {
+            reader.delete();
+        }
+    }
+    
+    /**
+     * Compute a tree from a delimited profile file while it is still
+     * arriving. Each chunk's complete rows are parsed and compared against
+     * all earlier rows straight away, so by the time the last byte lands
+     * only the tree itself remains to be built.
+     * @param {Blob|ReadableStream} source - Profile file, or a stream such
+     *     as a fetch() response body
+     * @param {Object} options - {method, matrix, missing, heuristic}
+     * @returns {Promise<Object>} Tree result with newick, edges, nodes
+     */
+    async computeTreeStreaming(source, options = {}) {
+        this._checkInitialized();
+        
+        const {
+            method = 'MSTreeV2',
+            matrix = 'asymmetric',
+            missing = 0,
+            heuristic = 'harmonic'
+        } = options;
+        
+        const pipeline = new this.module.ProfilePipeline(matrix, missing);
+        
+        try {
+            await this._streamText(source, pipeline);
+            
+            const result = JSON.parse(
+                this.module.compute_pipeline_tree(pipeline, method, heuristic)
+            );
+            
+            if (!result.success) {
+                throw new Error(result.error || 'Tree computation failed');
+            }
+            
+            return {
+                newick: result.newick,
+                edges: result.edges,
+                nNodes: result.n_nodes,
+                nEdges: result.n_edges
+            };
+            
+        } catch (error) {
+            console.error('Streaming tree computation error:', error);
+            throw error;
+        } finally {
+            pipeline.delete();
+        }
+    }
+    
+    /**
+     * Decode a file stream chunk by chunk into a streaming reader
+     * @param {Blob|ReadableStream} source - Text file (File or Blob) or
+     *     a byte stream
+     * @param {Object} reader - Module reader with a feed(text) method
+     */
+    async _streamText(source, reader) {
+        const byteStream = source instanceof ReadableStream ?
+            source : source.stream();
+        const stream = byteStream.getReader();
+        const decoder = new TextDecoder();
+        
+        for (;;) {
+            const { done, value } = await stream.read();
+            if (done) break;
+            reader.feed(decoder.decode(value, { stream: true }));
+        }
+        reader.feed(decoder.decode());
+    }
+    
     /**
      * Compute distance matrix only
-     * @param {Object} data - Profile data
+     * @param {Object|string|Uint8Array} data - Profile data, raw profile
+     *     file text or a binary profile store
      * @param {string} matrixType - 'symmetric' or 'asymmetric'
      * @param {number} missing - Missing data handler
      * @returns {Object} Distance matrix result
@@ -96,7 +361,7 @@ class GrapeTreeWASM {
         this._checkInitialized();
         
         try {
-            const profileJson = JSON.stringify(data);
+            const profileJson = this._profileInput(data);
             
             const resultJson = this.module.compute_distance_matrix(
                 profileJson,
@@ -113,7 +378,8 @@ class GrapeTreeWASM {
             return {
                 matrix: result.matrix,
                 strainNames: result.strain_names,
-                nStrains: result.n_strains
+                nStrains: result.n_strains,
+                profile: result.profile
             };
             
         } catch (error) {
@@ -122,6 +388,255 @@ class GrapeTreeWASM {
         }
     }
     
+    /**
+     * Parse profiles once into a binary profile store. The returned bytes
+     * can be kept (e.g. in IndexedDB) and passed as `data` to later calls,
+     * which then skip parsing entirely.
+     * @param {Object|string} data - Profile data or raw profile file text
+     * @returns {Uint8Array} Binary profile store
+     */
+    exportProfileStore(data) {
+        this._checkInitialized();
+        return this.module.export_profile_store(this._profileInput(data));
+    }
+
+    /**
+     * Plan a tree run before loading data: which matrix storage fits the
+     * memory budget (dense, condensed16, sparse or lazy), the expected
+     * peak memory, and a rough time estimate. A plan with fits === false
+     * says in `reason` how much memory the run would need.
+     * @param {Object} options - {nStrains, nLoci, method, matrix,
+     *     memoryBudget (bytes, 0 = unlimited), sparseThreshold (allelic
+     *     differences; 0 disables sparse storage)}
+     * @returns {Object} Plan (see _plan)
+     */
+    planTree(options) {
+        this._checkInitialized();
+        
+        const {
+            nStrains,
+            nLoci,
+            method = 'MSTreeV2',
+            matrix = 'asymmetric',
+            memoryBudget = 0,
+            sparseThreshold = 0
+        } = options;
+        
+        return GrapeTreeWASM._plan(JSON.parse(this.module.plan_tree(
+            nStrains, nLoci, method, matrix, memoryBudget, sparseThreshold
+        )));
+    }
+    
+    // {fits, storage, matrixBytes, peakBytes, seconds, ...} from the
+    // module's plan JSON
+    static _plan(plan) {
+        const result = {
+            fits: plan.fits,
+            storage: plan.storage,
+            matrixBytes: plan.matrix_bytes,
+            peakBytes: plan.peak_bytes,
+            seconds: plan.seconds,
+            distanceSeconds: plan.distance_seconds,
+            treeSeconds: plan.tree_seconds,
+            reason: plan.reason
+        };
+        if (plan.storage === 'sparse') {
+            result.sparseThreshold = plan.sparse_threshold;
+            result.maxSparsePairs = plan.max_sparse_pairs;
+        }
+        if (plan.storage === 'lazy') {
+            result.cachedRows = plan.cached_rows;
+        }
+        return result;
+    }
+
+    /**
+     * computeTree and computeDistanceMatrix results are cached in the
+     * module, keyed by a hash of the input and parameters, so repeating a
+     * request returns at once. These helpers inspect, bound and persist
+     * that cache.
+     * @returns {Object} {entries, bytes, maxBytes, hits, misses}
+     */
+    cacheStats() {
+        this._checkInitialized();
+        const stats = JSON.parse(this.module.result_cache_stats());
+        return {
+            entries: stats.entries,
+            bytes: stats.bytes,
+            maxBytes: stats.max_bytes,
+            hits: stats.hits,
+            misses: stats.misses
+        };
+    }
+
+    /**
+     * @param {number} maxBytes - Budget for cached results; 0 disables caching
+     */
+    setCacheLimit(maxBytes) {
+        this._checkInitialized();
+        this.module.set_result_cache_limit(maxBytes);
+    }
+
+    clearCache() {
+        this._checkInitialized();
+        this.module.clear_result_cache();
+    }
+
+    /**
+     * With profiling on, computeTree and computeDistanceMatrix results
+     * carry a `profile`: wall time per stage (parse, distances, tree,
+     * output), the work done (pairs compared, loci scanned, tie-breaks,
+     * cycles contracted, contraction depth, recraft swaps tried and
+     * accepted), the bytes of the main buffers and tracked memory peaks
+     * per stage (see memoryUsage). Cheap enough to leave on.
+     * @param {boolean} enabled
+     */
+    setProfiling(enabled) {
+        this._checkInitialized();
+        this.module.set_profiling(enabled);
+    }
+
+    /**
+     * Cap the engines' tracked memory (profiles, matrices, tree arrays,
+     * response text). A call that would go over fails with a "Memory cap
+     * exceeded" error instead of aborting the module when the heap cannot
+     * grow; keep it below what the browser lets the page allocate.
+     * @param {number} maxBytes - Cap in bytes; 0 removes it
+     */
+    setMemoryCap(maxBytes) {
+        this._checkInitialized();
+        this.module.set_memory_cap(maxBytes);
+    }
+
+    /**
+     * @returns {Object} Tracked memory: {cap_bytes, current_bytes,
+     *     peak_bytes, stages: {parse, encode, matrix, tree, output}}, each
+     *     stage with current_bytes and peak_bytes. Peaks are those of the
+     *     last computeTree or computeDistanceMatrix call.
+     */
+    memoryUsage() {
+        this._checkInitialized();
+        return JSON.parse(this.module.memory_usage());
+    }
+
+    /**
+     * Engine trace spans recorded so far (distance tiles, Prim batches,
+     * Edmonds contraction levels, recraft passes, output formatting) as
+     * Chrome trace-event JSON, one track per thread; save it to a file and
+     * open it in ui.perfetto.dev. Empty unless the module was built with
+     * make TRACE=1.
+     * @returns {string} Trace JSON
+     */
+    exportTrace() {
+        this._checkInitialized();
+        return this.module.export_trace();
+    }
+
+    clearTrace() {
+        this._checkInitialized();
+        this.module.clear_trace();
+    }
+
+    /**
+     * @returns {Uint8Array} Cache contents, e.g. to save as a file
+     */
+    exportCache() {
+        this._checkInitialized();
+        return this.module.export_result_cache();
+    }
+
+    /**
+     * Merge a cache saved by exportCache()
+     * @param {Uint8Array} bytes
+     * @returns {number} Entries now cached
+     */
+    importCache(bytes) {
+        this._checkInitialized();
+        const result = JSON.parse(this.module.import_result_cache(bytes));
+        if (!result.success) {
+            throw new Error(result.error || 'Cannot import result cache');
+        }
+        return result.entries;
+    }
+
+    /**
+     * Store the cache as a Blob in IndexedDB, so results survive reloads
+     * @param {string} dbName - IndexedDB database name
+     */
+    async saveCache(dbName = 'grapetree-cache') {
+        const blob = new Blob([this.exportCache()]);
+        const db = await GrapeTreeWASM._openCacheDB(dbName);
+        try {
+            await new Promise((resolve, reject) => {
+                const tx = db.transaction('results', 'readwrite');
+                tx.objectStore('results').put(blob, 'cache');
+                tx.oncomplete = () => resolve();
+                tx.onerror = () => reject(tx.error);
+            });
+        } finally {
+            db.close();
+        }
+    }
+
+    /**
+     * Merge the cache saved by saveCache(), if any
+     * @param {string} dbName - IndexedDB database name
+     * @returns {Promise<number>} Entries now cached
+     */
+    async loadCache(dbName = 'grapetree-cache') {
+        const db = await GrapeTreeWASM._openCacheDB(dbName);
+        let blob;
+        try {
+            blob = await new Promise((resolve, reject) => {
+                const request = db.transaction('results').objectStore('results').get('cache');
+                request.onsuccess = () => resolve(request.result);
+                request.onerror = () => reject(request.error);
+            });
+        } finally {
+            db.close();
+        }
+        if (!blob) {
+            return this.cacheStats().entries;
+        }
+        return this.importCache(new Uint8Array(await blob.arrayBuffer()));
+    }
+
+    static _openCacheDB(dbName) {
+        return new Promise((resolve, reject) => {
+            const request = indexedDB.open(dbName, 1);
+            request.onupgradeneeded = () => request.result.createObjectStore('results');
+            request.onsuccess = () => resolve(request.result);
+            request.onerror = () => reject(request.error);
+        });
+    }
+    
+    /**
+     * Parse profiles once into a session that keeps them, and every
+     * matrix and tree computed from them, inside the module. Switching
+     * method or heuristic then reuses the cached matrix.
+     * @param {Object|string|Uint8Array} data - Same inputs as computeTree
+     * @param {Object} parseOptions - {missingTokens, packColumns}
+     * @returns {GrapeTreeSession} Call dispose() when done
+     */
+    createSession(data, parseOptions = {}) {
+        this._checkInitialized();
+        this._validateData(data);
+        
+        const options = {};
+        if (parseOptions.missingTokens !== undefined) {
+            options.missing_tokens = parseOptions.missingTokens;
+        }
+        if (parseOptions.packColumns !== undefined) {
+            options.pack_columns = parseOptions.packColumns;
+        }
+        
+        const session = new this.module.Session(
+            this._profileInput(data),
+            JSON.stringify(options)
+        );
+        return new GrapeTreeSession(this, session);
+    }
+    
     /**
      * Export tree to Newick format string
      * @param {Object} tree - Tree result from computeTree
@@ -160,19 +675,37 @@ class GrapeTreeWASM {
         }
     }
     
+    _profileInput(data) {
+        if (typeof data === 'string' || this._isBinary(data)) {
+            return data;
+        }
+        return JSON.stringify(data);
+    }
+    
+    _isBinary(data) {
+        return data instanceof ArrayBuffer || ArrayBuffer.isView(data);
+    }
+    
     _validateTreeOptions(data, method, matrix, missing, heuristic) {
-        if (!data || !data.strains || !data.profiles) {
+        this._validateData(data);
+        this._validateMethodOptions(method, matrix, missing, heuristic);
+    }
+    
+    _validateData(data) {
+        if (typeof data === 'string' || this._isBinary(data)) {
+            if (data.length === 0 || data.byteLength === 0) {
+                throw new Error('Empty profile file');
+            }
+        } else if (!data || !data.strains || !data.profiles) {
             throw new Error('Invalid data format. Expected {strains: [], profiles: []}');
-        }
-        
-        if (data.strains.length === 0) {
+        } else if (data.strains.length === 0) {
             throw new Error('No strains provided');
-        }
-        
-        if (data.profiles.length !== data.strains.length) {
+        } else if (data.profiles.length !== data.strains.length) {
             throw new Error('Number of profiles must match number of strains');
         }
-        
+    }
+    
+    _validateMethodOptions(method, matrix, missing, heuristic) {
         const validMethods = ['MSTree', 'MSTreeV2', 'NJ'];
         if (!validMethods.includes(method)) {
             throw new Error(`Invalid method: ${method}. Must be one of: ${validMethods.join(', ')}`);
@@ -194,6 +727,283 @@ class GrapeTreeWASM {
     }
 }
 
+// Parsed profiles held by the WASM module (see createSession)
+class GrapeTreeSession {
+    constructor(owner, session) {
+        this.owner = owner;
+        this.session = session;
+    }
+    
+    get nStrains() {
+        return Number(this.session.n_strains());
+    }
+    
+    get nLoci() {
+        return Number(this.session.n_loci());
+    }
+    
+    /**
+     * Tree for the given options; repeated calls are served from cache.
+     * With a memoryBudget the matrix storage is planned to fit it (see
+     * planTree) and the result carries the plan; a run that cannot fit
+     * throws before any work is done.
+     * @param {Object} options - {method, matrix, missing, heuristic,
+     *     memoryBudget, sparseThreshold}
+     * @returns {Object} Tree result with newick, edges, nodes (and plan)
+     */
+    computeTree(options = {}) {
+        const {
+            method = 'MSTreeV2',
+            matrix = 'asymmetric',
+            missing = 0,
+            heuristic = 'harmonic',
+            memoryBudget = null,
+            sparseThreshold = 0
+        } = options;
+        
+        this.owner._validateMethodOptions(method, matrix, missing, heuristic);
+        
+        const result = JSON.parse(memoryBudget === null ?
+            this.session.tree(method, matrix, missing, heuristic) :
+            this.session.budgeted_tree(
+                method, matrix, missing, heuristic, memoryBudget, sparseThreshold
+            )
+        );
+        
+        if (!result.success) {
+            throw new Error(result.error || 'Tree computation failed');
+        }
+        
+        const tree = {
+            newick: result.newick,
+            edges: result.edges,
+            nNodes: result.n_nodes,
+            nEdges: result.n_edges
+        };
+        if (result.plan) {
+            tree.plan = GrapeTreeWASM._plan(result.plan);
+        }
+        return tree;
+    }
+    
+    /**
+     * How computeTree would run on this session within a memory budget
+     * @param {Object} options - {method, matrix, memoryBudget,
+     *     sparseThreshold}
+     * @returns {Object} Plan, as from GrapeTreeWASM.planTree
+     */
+    planTree(options = {}) {
+        const {
+            method = 'MSTreeV2',
+            matrix = 'asymmetric',
+            memoryBudget = 0,
+            sparseThreshold = 0
+        } = options;
+        
+        return GrapeTreeWASM._plan(JSON.parse(
+            this.session.plan(method, matrix, memoryBudget, sparseThreshold)
+        ));
+    }
+    
+    /**
+     * Tree computed in slices, yielding to the event loop between them so
+     * a page or Web Worker stays responsive. Progress is reported after
+     * each slice; aborting the signal stops at the next slice boundary
+     * and rejects with an AbortError whose job property holds the
+     * paused GrapeTreeJob: call job.resume(control) to continue from the
+     * rows and tree nodes already done, or job.dispose() to drop it.
+     * A completed matrix stays cached in the session, so later runs with
+     * another method or heuristic go straight to building the tree.
+     * @param {Object} options - {method, matrix, missing, heuristic}
+     * @param {Object} control - {onProgress(progress), signal (AbortSignal),
+     *     slicePairs (strain pairs per slice)}
+     * @returns {Promise<Object>} Tree result with newick, edges, nodes
+     */
+    async computeTreeAsync(options = {}, control = {}) {
+        const job = this.startTree(options);
+        let paused = false;
+        
+        try {
+            return await job.run(control);
+        } catch (error) {
+            paused = error.name === 'AbortError';
+            throw error;
+        } finally {
+            if (!paused) {
+                job.dispose();
+            }
+        }
+    }
+    
+    /**
+     * Sliced tree computation to drive with job.run(control), as in
+     * computeTreeAsync
+     * @param {Object} options - {method, matrix, missing, heuristic}
+     * @returns {GrapeTreeJob} Call dispose() when done
+     */
+    startTree(options = {}) {
+        const {
+            method = 'MSTreeV2',
+            matrix = 'asymmetric',
+            missing = 0,
+            heuristic = 'harmonic'
+        } = options;
+        
+        this.owner._validateMethodOptions(method, matrix, missing, heuristic);
+        
+        return new GrapeTreeJob(new this.owner.module.TreeJob(
+            this.session, method, matrix, missing, heuristic
+        ));
+    }
+    
+    /**
+     * Distance matrix, computed once per matrix type / missing handler
+     * @param {string} matrixType - 'symmetric' or 'asymmetric'
+     * @param {number} missing - Missing data handler
+     * @returns {Object} Distance matrix result
+     */
+    computeDistanceMatrix(matrixType = 'symmetric', missing = 0) {
+        const result = JSON.parse(
+            this.session.distance_matrix(matrixType, missing)
+        );
+        
+        if (!result.success) {
+            throw new Error(result.error || 'Distance computation failed');
+        }
+        
+        return {
+            matrix: result.matrix,
+            strainNames: result.strain_names,
+            nStrains: result.n_strains
+        };
+    }
+    
+    /**
+     * Free cached distance matrices; cached trees are kept
+     */
+    releaseMatrices() {
+        this.session.release_matrices();
+    }
+    
+    /**
+     * Free the session's WASM memory
+     */
+    dispose() {
+        if (this.session) {
+            this.session.delete();
+            this.session = null;
+        }
+    }
+}
+
+/**
+ * A tree computed in slices on a session, from
+ * GrapeTreeSession.startTree. An aborted run() keeps the distance rows
+ * and (MSTree) tree nodes done so far; resume() continues from them.
+ */
+class GrapeTreeJob {
+    constructor(job) {
+        this.job = job;
+    }
+    
+    /**
+     * Step the job to its result, yielding to the event loop between
+     * slices
+     * @param {Object} control - {onProgress(progress), signal (AbortSignal),
+     *     slicePairs (strain pairs per slice)}
+     * @returns {Promise<Object>} Tree result with newick, edges, nodes;
+     *     rejects with an AbortError (error.job = this job) when the
+     *     signal aborts
+     */
+    async run(control = {}) {
+        const {
+            onProgress = null,
+            signal = null,
+            slicePairs = 2000000
+        } = control;
+        
+        for (;;) {
+            if (signal && signal.aborted) {
+                this.job.cancel();
+            }
+            
+            const finished = this.job.step(slicePairs);
+            const p = this.progress();
+            
+            if (onProgress) {
+                onProgress(p);
+            }
+            
+            if (p.stage === 'cancelled') {
+                const error = new Error('Tree computation cancelled');
+                error.name = 'AbortError';
+                error.job = this;
+                throw error;
+            }
+            
+            if (finished) break;
+            await new Promise(resolve => setTimeout(resolve, 0));
+        }
+        
+        const result = JSON.parse(this.job.result());
+        
+        if (!result.success) {
+            throw new Error(result.error || 'Tree computation failed');
+        }
+        
+        return {
+            newick: result.newick,
+            edges: result.edges,
+            nNodes: result.n_nodes,
+            nEdges: result.n_edges
+        };
+    }
+    
+    /**
+     * Continue after a cancel, from the work already done
+     * @param {Object} control - As for run()
+     * @returns {Promise<Object>} Tree result, as from run()
+     */
+    resume(control = {}) {
+        this.job.resume();
+        return this.run(control);
+    }
+    
+    /**
+     * Stop at the next slice boundary, as aborting run()'s signal does
+     */
+    cancel() {
+        this.job.cancel();
+    }
+    
+    /**
+     * @returns {Object} {stage, fraction, pairsDone, pairsTotal,
+     *     pairsPerSecond, nodesDone, nodesTotal}
+     */
+    progress() {
+        const p = JSON.parse(this.job.progress());
+        return {
+            stage: p.stage,
+            fraction: p.fraction,
+            pairsDone: p.pairs_done,
+            pairsTotal: p.pairs_total,
+            pairsPerSecond: p.pairs_per_second,
+            nodesDone: p.nodes_done,
+            nodesTotal: p.nodes_total
+        };
+    }
+    
+    /**
+     * Free the job's WASM memory
+     */
+    dispose() {
+        if (this.job) {
+            this.job.delete();
+            this.job = null;
+        }
+    }
+}
+
 // Export for module systems
 if (typeof module !== 'undefined' && module.exports) {
     module.exports = GrapeTreeWASM;